@@ -21,13 +21,16 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <stdio.h>
 #include <string.h>
-#include <math.h>
 
+#include "app_timer.h"
 #include "nrf_gpio.h"
 #include "nrfx_gpiote.h"
+#include "nrfx_ppi.h"
 #include "nrfx_saadc.h"
 #include "nrfx_spim.h"
+#include "nrfx_timer.h"
 #include "nrfx_twim.h"
 #include "nrf52811.h"
 #include "s1.h"
@@ -45,7 +48,119 @@ static const nrfx_twim_t i2c = NRFX_TWIM_INSTANCE(0);
 /**
  * @brief Interrupt driven pending flag for when the FPGA_DONE_PIN goes high
  */
-static bool fpga_done_flag_pending = false;
+static volatile bool fpga_done_flag_pending = false;
+
+/**
+ * @brief App timer tick when CRESET was last released, and how many ticks it
+ *        took from then until CDONE went high.
+ */
+static uint32_t fpga_reset_release_ticks = 0;
+static uint32_t fpga_boot_ticks = 0;
+
+/**
+ * @brief User handler called from the CDONE interrupt.
+ */
+static s1_fpga_boot_handler_t fpga_boot_handler = NULL;
+
+/**
+ * @brief Set once CDONE goes high, and cleared whenever the FPGA is reset.
+ *        Unlike fpga_done_flag_pending, checking it doesn't clear it.
+ */
+static volatile bool fpga_booted = false;
+
+/**
+ * @brief Image the FPGA was last successfully configured with by
+ *        s1_fpga_configure_from_buffer(), or NULL if it was last booted from
+ *        the flash. Used to reboot the same design.
+ */
+static unsigned char const *fpga_last_bitstream = NULL;
+static size_t fpga_last_bitstream_len = 0;
+
+/**
+ * @brief How long to wait for the FPGA when it's rebooted from the flash.
+ */
+#define FPGA_REBOOT_TIMEOUT_MS 100
+
+/**
+ * @brief User handler for the doorbell. While it's set, rising edges on the
+ *        INT pin are passed here instead of being treated as CDONE.
+ */
+static s1_fpga_doorbell_handler_t volatile fpga_doorbell_handler = NULL;
+static void *fpga_doorbell_context = NULL;
+static volatile uint32_t fpga_doorbell_count = 0;
+
+#if S1_PROFILE
+
+/**
+ * @brief Timings of each profiled function, and their names for
+ *        s1_profile_dump().
+ */
+static s1_profile_stats_t profile_stats[S1_PROFILE_POINTS];
+
+static char const *const profile_names[S1_PROFILE_POINTS] = {
+    [S1_PROFILE_PMIC_READ_REGS] = "pmic_read_regs",
+    [S1_PROFILE_PMIC_WRITE_REG] = "pmic_write_reg",
+    [S1_PROFILE_SPI_QUEUE_WAIT] = "spi_queue_wait",
+    [S1_PROFILE_SPI_TX_RX] = "spi_tx_rx",
+    [S1_PROFILE_FLASH_PAGE_FROM_IMAGE] = "s1_flash_page_from_image",
+    [S1_PROFILE_FLASH_READ] = "s1_flash_read",
+    [S1_PROFILE_FLASH_PROGRAM_IMAGE] = "s1_flash_program_image",
+    [S1_PROFILE_FPGA_REG_BATCH] = "s1_fpga_reg_batch",
+};
+
+/**
+ * @brief A timing in progress. The cleanup attribute records it whenever the
+ *        function returns, wherever that is from.
+ */
+typedef struct
+{
+    s1_profile_point_t point;
+    uint32_t start;
+} profile_scope_t;
+
+/**
+ * @brief Local function for recording the cycles since a timing started.
+ *        Interrupts are held off so that the stats stay consistent if a
+ *        profiled function is also called from an interrupt.
+ *
+ * @param scope: The timing which has finished.
+ */
+static void profile_scope_end(profile_scope_t const *scope)
+{
+    uint32_t cycles = DWT->CYCCNT - scope->start;
+    s1_profile_stats_t *stats = &profile_stats[scope->point];
+
+    NRFX_CRITICAL_SECTION_ENTER();
+
+    if (stats->calls == 0 || cycles < stats->min_cycles)
+    {
+        stats->min_cycles = cycles;
+    }
+
+    if (cycles > stats->max_cycles)
+    {
+        stats->max_cycles = cycles;
+    }
+
+    stats->calls++;
+    stats->total_cycles += cycles;
+
+    NRFX_CRITICAL_SECTION_EXIT();
+}
+
+/**
+ * @brief Times the rest of the enclosing function. Compiles to nothing when
+ *        S1_PROFILE is 0.
+ */
+#define PROFILE_FUNCTION(point)                                                  \
+    profile_scope_t _profile_scope __attribute__((cleanup(profile_scope_end))) = \
+        {(point), DWT->CYCCNT}
+
+#else
+
+#define PROFILE_FUNCTION(point)
+
+#endif
 
 /**
  * @brief Definition of the ADC input pin for battery monitoring.
@@ -53,180 +168,3382 @@ static bool fpga_done_flag_pending = false;
 #define PMIC_AMUX_PIN NRF_SAADC_INPUT_AIN1
 
 /**
- * @brief Local function for reading a register of the PMIC. Should not be
- *        directly accessed, instead use the relevant s1_pmic_...() functions
- *        to read data.
+ * @brief Bus transaction counters for the PMIC, and how many reads the shadow
+ *        saved.
+ */
+static s1_pmic_stats_t pmic_stats = {0};
+
+/**
+ * @brief Range of PMIC configuration registers kept in the shadow. These only
+ *        change when we write them, unlike the status registers below 0x20.
+ */
+#define PMIC_SHADOW_FIRST 0x20
+#define PMIC_SHADOW_LAST 0x39
+
+/**
+ * @brief RAM copy of the PMIC configuration registers. A set bit in the valid
+ *        mask means the matching register is known to be up to date. Only
+ *        updated once a transfer completes, from the I2C interrupt.
+ */
+static uint8_t pmic_shadow[PMIC_SHADOW_LAST - PMIC_SHADOW_FIRST + 1];
+static volatile uint32_t pmic_shadow_valid = 0;
+
+/**
+ * @brief If true, every write is read back from the PMIC and compared.
+ */
+static bool pmic_shadow_verify = false;
+
+/**
+ * @brief SBB1 (Vfpga) voltage setting used whenever the FPGA is powered up.
+ *        0x08 = (1200mV - 800mV) / 50mV, the nominal iCE40 core voltage.
+ */
+static uint8_t pmic_vfpga_setting = 0x08;
+
+/**
+ * @brief Local function for updating the shadow after a transfer. Registers
+ *        outside the shadowed range are ignored.
  *
- * @param reg: Address of the 8bit register that should be read.
+ * @param start: Address of the first register that was transferred.
+ *
+ * @param data: The register values, or NULL if the transfer failed and the
+ *              registers are now unknown.
+ *
+ * @param len: Number of registers transferred.
+ */
+static void pmic_shadow_update(uint8_t start, uint8_t const *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        size_t reg = start + i;
+
+        if (reg < PMIC_SHADOW_FIRST || reg > PMIC_SHADOW_LAST)
+        {
+            continue;
+        }
+
+        uint32_t bit = 1UL << (reg - PMIC_SHADOW_FIRST);
+
+        if (data == NULL)
+        {
+            pmic_shadow_valid &= ~bit;
+            continue;
+        }
+
+        pmic_shadow[reg - PMIC_SHADOW_FIRST] = data[i];
+        pmic_shadow_valid |= bit;
+    }
+}
+
+/**
+ * @brief Checks whether the caller is running somewhere that a peripheral
+ *        interrupt can't preempt, such as a handler of the same or higher
+ *        priority, or with interrupts disabled. Waiting on that peripheral
+ *        from there would never return.
+ *
+ * @param irq: The interrupt of the peripheral which will be waited on.
+ *
+ * @returns true if waiting would block forever.
+ */
+static bool irq_would_block(IRQn_Type irq)
+{
+    // Interrupts are masked so nothing can complete
+    if (__get_PRIMASK() != 0)
+    {
+        return true;
+    }
+
+    // Thread mode can always be preempted
+    uint32_t ipsr = __get_IPSR();
+    if (ipsr == 0)
+    {
+        return false;
+    }
+
+    // Faults, SVC, PendSV and SysTick are treated as blocking
+    if (ipsr < 16)
+    {
+        return true;
+    }
+
+    // Lower numbers are higher priorities, and equal ones don't preempt
+    return NVIC_GetPriority((IRQn_Type)(ipsr - 16)) <= NVIC_GetPriority(irq);
+}
+
+/**
+ * @brief Timer for short delays which are needed from within interrupts. Each
+ *        user has its own compare channel, and the timer only runs while at
+ *        least one delay is pending.
+ */
+static const nrfx_timer_t delay_timer = NRFX_TIMER_INSTANCE(2);
+
+#define DELAY_PMIC_RETRY_CHANNEL NRF_TIMER_CC_CHANNEL0
+#define DELAY_TELEMETRY_CHANNEL NRF_TIMER_CC_CHANNEL1
+#define DELAY_CHANNELS 2
+
+typedef void (*delay_handler_t)(void);
+static delay_handler_t delay_handlers[DELAY_CHANNELS];
+static volatile uint32_t delay_pending = 0;
+
+/**
+ * @brief Local function for calling a handler once a delay has passed. Any
+ *        delay already pending on the same channel is replaced.
+ *
+ * @param channel: Compare channel belonging to the user.
+ *
+ * @param delay_us: How long to wait.
+ *
+ * @param handler: Called from the timer interrupt once the delay has passed.
+ */
+static void delay_start(nrf_timer_cc_channel_t channel,
+                        uint32_t delay_us,
+                        delay_handler_t handler)
+{
+    NRFX_CRITICAL_SECTION_ENTER();
+
+    delay_handlers[channel] = handler;
+
+    // Only run the timer while it's needed
+    if (delay_pending == 0)
+    {
+        nrfx_timer_clear(&delay_timer);
+        nrfx_timer_enable(&delay_timer);
+    }
+
+    delay_pending |= 1UL << channel;
+
+    uint32_t now = nrfx_timer_capture(&delay_timer, channel);
+    nrfx_timer_compare(&delay_timer, channel,
+                       now + nrfx_timer_us_to_ticks(&delay_timer, delay_us),
+                       true);
+
+    NRFX_CRITICAL_SECTION_EXIT();
+}
+
+/**
+ * @brief Interrupt routine for the delay timer. Calls the handler of each
+ *        delay which has passed, and stops the timer once none are left.
+ *
+ * @param event_type: The compare event which fired.
+ *
+ * @param p_context: Unused context pointer.
+ */
+static void delay_timer_handler(nrf_timer_event_t event_type, void *p_context)
+{
+    (void)p_context;
+
+    for (uint32_t channel = 0; channel < DELAY_CHANNELS; channel++)
+    {
+        if (event_type != nrf_timer_compare_event_get(channel))
+        {
+            continue;
+        }
+
+        nrfx_timer_compare_int_disable(&delay_timer, channel);
+        delay_pending &= ~(1UL << channel);
+
+        if (delay_pending == 0)
+        {
+            nrfx_timer_disable(&delay_timer);
+        }
+
+        delay_handlers[channel]();
+    }
+}
+
+/**
+ * @brief Entry of the PMIC transaction queue. The register address, and the
+ *        value for writes, are kept here so EasyDMA can read them from RAM.
+ */
+typedef struct
+{
+    uint8_t tx[2];
+    uint8_t *rx_buffer;
+    size_t rx_len;
+    bool retried;
+    s1_pmic_handler_t handler;
+    void *context;
+} pmic_queue_entry_t;
+
+/**
+ * @brief Fixed capacity ring of transfers waiting for, or using, the I2C bus.
+ *        The entry at the head is the one currently in flight.
+ */
+static pmic_queue_entry_t pmic_queue[S1_PMIC_QUEUE_SIZE];
+static volatile size_t pmic_queue_head = 0;
+static volatile size_t pmic_queue_count = 0;
+
+/**
+ * @brief Local function for finishing the transfer at the head of the queue.
+ *        Updates the shadow, starts the next transfer and then notifies
+ *        whoever queued the finished one.
+ *
+ * @param err: Result of the transfer.
+ */
+static void pmic_queue_complete(s1_error_t err);
+
+/**
+ * @brief Local function for starting the transfer at the head of the queue.
+ *        Must be called with interrupts masked, or from the I2C interrupt
+ *        itself.
+ */
+static void pmic_queue_start(void)
+{
+    if (pmic_queue_count == 0)
+    {
+        return;
+    }
+
+    pmic_queue_entry_t *entry = &pmic_queue[pmic_queue_head];
+
+    // Reads send the register address, writes also send the value
+    nrfx_twim_xfer_desc_t i2c_xfer =
+        NRFX_TWIM_XFER_DESC_TX(0x48, entry->tx, 2);
+
+    if (entry->rx_buffer != NULL)
+    {
+        nrfx_twim_xfer_desc_t read_xfer =
+            NRFX_TWIM_XFER_DESC_TXRX(0x48, entry->tx, 1,
+                                     entry->rx_buffer, entry->rx_len);
+        i2c_xfer = read_xfer;
+    }
+
+    // If it couldn't start, fail it so that the rest of the queue runs
+    if (nrfx_twim_xfer(&i2c, &i2c_xfer, 0) != NRFX_SUCCESS)
+    {
+        pmic_queue_complete(S1_PMIC_COMMUNICATION_ERROR);
+    }
+}
+
+static void pmic_queue_complete(s1_error_t err)
+{
+    pmic_queue_entry_t done = pmic_queue[pmic_queue_head];
+    pmic_queue_head = (pmic_queue_head + 1) % S1_PMIC_QUEUE_SIZE;
+    pmic_queue_count--;
+
+    // Remember what the registers now hold, or forget them on failure
+    if (done.rx_buffer != NULL)
+    {
+        pmic_shadow_update(done.tx[0],
+                           err == S1_SUCCESS ? done.rx_buffer : NULL,
+                           done.rx_len);
+    }
+    else
+    {
+        pmic_shadow_update(done.tx[0], err == S1_SUCCESS ? &done.tx[1] : NULL, 1);
+    }
+
+    pmic_queue_start();
+
+    if (done.handler != NULL)
+    {
+        done.handler(err, done.context);
+    }
+}
+
+/**
+ * @brief Handler for when the retry delay of a failed PMIC transfer has
+ *        passed. The failed transfer is still at the head of the queue, so
+ *        nothing else has used the bus in the meantime.
+ */
+static void pmic_retry_handler(void)
+{
+    pmic_queue_start();
+}
+
+/**
+ * @brief Interrupt routine for when an I2C transfer to the PMIC ends. Failed
+ *        transfers are tried once more after 100us. This can be needed if the
+ *        PMIC is under load, and the power fluctuates. The delay runs on a
+ *        timer so the interrupt isn't held up.
+ *
+ * @param p_event: Event from the I2C driver.
+ *
+ * @param p_context: Unused context pointer.
+ */
+static void pmic_event_handler(nrfx_twim_evt_t const *p_event, void *p_context)
+{
+    (void)p_context;
+
+    if (p_event->type == NRFX_TWIM_EVT_DONE)
+    {
+        pmic_queue_complete(S1_SUCCESS);
+        return;
+    }
+
+    pmic_queue_entry_t *entry = &pmic_queue[pmic_queue_head];
+
+    if (!entry->retried)
+    {
+        entry->retried = true;
+        delay_start(DELAY_PMIC_RETRY_CHANNEL, 100, pmic_retry_handler);
+        return;
+    }
+
+    pmic_queue_complete(S1_PMIC_COMMUNICATION_ERROR);
+}
+
+/**
+ * @brief Local function for adding a transfer to the PMIC queue, and starting
+ *        it if the bus is idle.
+ *
+ * @param entry: The transfer to add. It's copied into the queue.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_COMMUNICATION_ERROR if the queue is full.
+ */
+static s1_error_t pmic_queue_add(pmic_queue_entry_t const *entry)
+{
+    s1_error_t err = S1_SUCCESS;
+
+    NRFX_CRITICAL_SECTION_ENTER();
+
+    if (pmic_queue_count == S1_PMIC_QUEUE_SIZE)
+    {
+        err = S1_PMIC_COMMUNICATION_ERROR;
+    }
+    else
+    {
+        size_t tail = (pmic_queue_head + pmic_queue_count) % S1_PMIC_QUEUE_SIZE;
+        pmic_queue[tail] = *entry;
+        pmic_queue[tail].retried = false;
+        pmic_queue_count++;
+
+        // Kick off the bus if this is the only transfer
+        if (pmic_queue_count == 1)
+        {
+            pmic_queue_start();
+        }
+    }
+
+    NRFX_CRITICAL_SECTION_EXIT();
+
+    return err;
+}
+
+/**
+ * @brief Completion flag and result for blocking PMIC transfers. Set by
+ *        pmic_wait_handler().
+ */
+static volatile bool pmic_wait_flag = false;
+static volatile s1_error_t pmic_wait_result = S1_SUCCESS;
+
+/**
+ * @brief Handler used by blocking transfers to know when they're done.
+ *
+ * @param err: Result of the transfer.
+ *
+ * @param context: Unused context pointer.
+ */
+static void pmic_wait_handler(s1_error_t err, void *context)
+{
+    (void)context;
+    pmic_wait_result = err;
+    pmic_wait_flag = true;
+}
+
+/**
+ * @brief Local function for checking whether waiting on the PMIC queue would
+ *        block forever. Completion comes from the I2C interrupt, and retries
+ *        from the delay timer interrupt, so both must be able to preempt.
+ *
+ * @returns true if the caller can't wait on the queue.
+ */
+static bool pmic_wait_would_block(void)
+{
+    return irq_would_block(nrfx_get_irq_number(i2c.p_twim)) ||
+           irq_would_block(nrfx_get_irq_number(delay_timer.p_reg));
+}
+
+/**
+ * @brief Queues a transfer to the PMIC, and waits until it completes. Anything
+ *        already queued runs first.
+ *
+ * @param entry: The transfer to run.
+ *
+ * @returns S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC did
+ *          not respond, or S1_BLOCKED_IN_INTERRUPT if called from an interrupt
+ *          which the I2C or retry timer interrupts can't preempt.
+ */
+static s1_error_t pmic_queue_wait(pmic_queue_entry_t *entry)
+{
+    // Completion and retries come from interrupts, which must be able to run
+    if (pmic_wait_would_block())
+    {
+        return S1_BLOCKED_IN_INTERRUPT;
+    }
+
+    entry->handler = pmic_wait_handler;
+    entry->context = NULL;
+    pmic_wait_flag = false;
+
+    // The queue may be full of asynchronous transfers, so retry until it fits
+    while (pmic_queue_add(entry) != S1_SUCCESS)
+    {
+    }
+
+    // Wait until the transfer is complete
+    while (!pmic_wait_flag)
+    {
+    }
+
+    return pmic_wait_result;
+}
+
+/**
+ * @brief Local function for reading consecutive registers of the PMIC in one
+ *        I2C transfer, bypassing the shadow. The PMIC auto-increments the
+ *        register address after each byte. Use pmic_read_regs() instead.
+ *
+ * @param start: Address of the first 8bit register that should be read.
  *
  * @param data: Pointer to where the read data will be stored.
  *
+ * @param len: Number of registers to read.
+ *
  * @returns S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC did
  *          not respond.
  */
-static s1_error_t pmic_read_reg(uint8_t reg, uint8_t *data)
+static s1_error_t pmic_bus_read_regs(uint8_t start, uint8_t *data, size_t len)
 {
-    // Transfer descriptor configured for a 1 byte read, and 1 byte write
-    nrfx_twim_xfer_desc_t i2c_xfer =
-        NRFX_TWIM_XFER_DESC_TXRX(0x48, &reg, 1, data, 1);
+    pmic_stats.bus_reads++;
+
+    pmic_queue_entry_t entry = {{start, 0}, data, len, false, NULL, NULL};
+    return pmic_queue_wait(&entry);
+}
+
+/**
+ * @brief Local function for reading a single register of the PMIC over I2C,
+ *        bypassing the shadow. Use pmic_read_reg() instead.
+ *
+ * @param reg: Address of the 8bit register that should be read.
+ *
+ * @param data: Pointer to where the read data will be stored.
+ *
+ * @returns S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC did
+ *          not respond.
+ */
+static s1_error_t pmic_bus_read_reg(uint8_t reg, uint8_t *data)
+{
+    return pmic_bus_read_regs(reg, data, 1);
+}
+
+/**
+ * @brief Local function for writing a register of the PMIC over I2C. Use
+ *        pmic_write_reg() instead.
+ *
+ * @param reg: Address of the 8bit register that should be written to.
+ *
+ * @param data: Value which should be written in the register.
+ *
+ * @returns S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC did
+ *          not respond.
+ */
+static s1_error_t pmic_bus_write_reg(uint8_t reg, uint8_t data)
+{
+    pmic_stats.bus_writes++;
+
+    pmic_queue_entry_t entry = {{reg, data}, NULL, 0, false, NULL, NULL};
+    return pmic_queue_wait(&entry);
+}
+
+/**
+ * @brief Local function for reading consecutive registers of the PMIC. Should
+ *        not be directly accessed, instead use the relevant s1_pmic_...()
+ *        functions to read data. If every register is already in the shadow,
+ *        no I2C transfer is made. Otherwise they are all read in one burst.
+ *
+ * @param start: Address of the first 8bit register that should be read.
+ *
+ * @param data: Pointer to where the read data will be stored.
+ *
+ * @param len: Number of registers to read.
+ *
+ * @returns S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC did
+ *          not respond.
+ */
+static s1_error_t pmic_read_regs(uint8_t start, uint8_t *data, size_t len)
+{
+    PROFILE_FUNCTION(S1_PROFILE_PMIC_READ_REGS);
+
+    // Check if the shadow holds the whole range
+    bool shadowed = true;
+    for (size_t i = 0; i < len; i++)
+    {
+        size_t reg = start + i;
+
+        if (reg < PMIC_SHADOW_FIRST ||
+            reg > PMIC_SHADOW_LAST ||
+            !(pmic_shadow_valid & (1UL << (reg - PMIC_SHADOW_FIRST))))
+        {
+            shadowed = false;
+            break;
+        }
+    }
+
+    // Serve the values from the shadow if we have them
+    if (shadowed)
+    {
+        memcpy(data, &pmic_shadow[start - PMIC_SHADOW_FIRST], len);
+        pmic_stats.shadow_hits++;
+        return S1_SUCCESS;
+    }
+
+    // Otherwise read them all, which also refreshes the shadow
+    return pmic_bus_read_regs(start, data, len);
+}
+
+/**
+ * @brief Local function for reading a register of the PMIC. Should not be
+ *        directly accessed, instead use the relevant s1_pmic_...() functions
+ *        to read data. Configuration registers are served from the shadow
+ *        once known.
+ *
+ * @param reg: Address of the 8bit register that should be read.
+ *
+ * @param data: Pointer to where the read data will be stored.
+ *
+ * @returns S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC did
+ *          not respond.
+ */
+static s1_error_t pmic_read_reg(uint8_t reg, uint8_t *data)
+{
+    return pmic_read_regs(reg, data, 1);
+}
+
+/**
+ * @brief Local function for writing a register of the PMIC. Should not be
+ *        directly accessed, instead use the relevant s1_pmic_...() functions
+ *        to write data. Configuration registers are written through to the
+ *        shadow.
+ *
+ * @param reg: Address of the 8bit register that should be written to.
+ *
+ * @param data: Value which should be written in the register.
+ *
+ * @returns S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC did
+ *          not respond, or didn't read back the same value in verify mode.
+ */
+static s1_error_t pmic_write_reg(uint8_t reg, uint8_t data)
+{
+    PROFILE_FUNCTION(S1_PROFILE_PMIC_WRITE_REG);
+
+    s1_error_t err = pmic_bus_write_reg(reg, data);
+
+    // If an error occurs, or we don't need to check it, return
+    if (err != S1_SUCCESS || !pmic_shadow_verify)
+    {
+        return err;
+    }
+
+    // Read back the register. The shadow keeps whatever the PMIC really holds
+    uint8_t readback;
+    err = pmic_bus_read_reg(reg, &readback);
+
+    if (err != S1_SUCCESS || readback != data)
+    {
+        return S1_PMIC_COMMUNICATION_ERROR;
+    }
+
+    return S1_SUCCESS;
+}
+
+/**
+ * @brief True while the SPI driver is initialised and owns the bus pins.
+ */
+static bool spi_session_open = false;
+
+/**
+ * @brief The device currently selected on the SPI bus. Determines the polarity
+ *        of the chip select line.
+ */
+static s1_spi_target_t spi_target = S1_SPI_FLASH;
+
+/**
+ * @brief Local function for driving the shared chip select line. The flash
+ *        chip select is active low, while the FPGA chip select is active high.
+ *
+ * @param active: If true, selects the current target. If false, deselects it.
+ */
+static void spi_cs_set(bool active)
+{
+    if (spi_target == S1_SPI_FPGA)
+    {
+        nrf_gpio_pin_write(SPI_CS_PIN, active);
+        return;
+    }
+
+    nrf_gpio_pin_write(SPI_CS_PIN, !active);
+}
+
+/**
+ * @brief Entry of the SPI transaction queue. The handler is only set on the
+ *        last transfer of a batch, which is also marked as last.
+ */
+typedef struct
+{
+    s1_spi_xfer_t xfer;
+    s1_spi_handler_t handler;
+    void *context;
+    bool last;
+} spi_queue_entry_t;
+
+/**
+ * @brief Fixed capacity ring of transfers waiting for, or using, the SPI bus.
+ *        The entry at the head is the one currently in flight.
+ */
+_Static_assert(S1_SPI_QUEUE_SIZE >= 2,
+               "S1_SPI_QUEUE_SIZE must hold a command and its data transfer");
+
+static spi_queue_entry_t spi_queue[S1_SPI_QUEUE_SIZE];
+static volatile size_t spi_queue_head = 0;
+static volatile size_t spi_queue_count = 0;
+
+/**
+ * @brief Number of batches dropped because the driver refused to start them.
+ *        Lets callers which queue without a handler notice a failure.
+ */
+static volatile uint32_t spi_failed_batches = 0;
+
+/**
+ * @brief Local function for removing the head of the queue once it's done.
+ *
+ * @returns A copy of the entry that was removed.
+ */
+static spi_queue_entry_t spi_queue_pop(void)
+{
+    spi_queue_entry_t entry = spi_queue[spi_queue_head];
+    spi_queue_head = (spi_queue_head + 1) % S1_SPI_QUEUE_SIZE;
+    spi_queue_count--;
+    return entry;
+}
+
+/**
+ * @brief Local function for starting the transfer at the head of the queue.
+ *        Each transfer gets its own chip select assertion, unless the previous
+ *        one held it. Must be called with interrupts masked, or from the SPI
+ *        interrupt itself.
+ */
+static void spi_queue_start(void)
+{
+    while (spi_queue_count > 0)
+    {
+        s1_spi_xfer_t *xfer = &spi_queue[spi_queue_head].xfer;
+
+        // Changing target only needs the chip select idle level to flip
+        if (xfer->target != spi_target)
+        {
+            s1_spi_select(xfer->target);
+        }
+
+        // Transfer descriptor for how many bytes to read and write
+        nrfx_spim_xfer_desc_t spi_xfer =
+            NRFX_SPIM_XFER_TRX(xfer->tx_buffer, xfer->tx_len,
+                               xfer->rx_buffer, xfer->rx_len);
+
+        // Initiate the transfer. The event handler deselects the device
+        spi_cs_set(true);
+        if (nrfx_spim_xfer(&spi, &spi_xfer, 0) == NRFX_SUCCESS)
+        {
+            return;
+        }
+
+        // If it couldn't start, drop the rest of its batch, as later transfers
+        // may continue this one. Then let the rest of the queue run
+        spi_cs_set(false);
+        spi_queue_entry_t dropped;
+        do
+        {
+            dropped = spi_queue_pop();
+        } while (!dropped.last);
+
+        spi_failed_batches++;
+
+        if (dropped.handler != NULL)
+        {
+            dropped.handler(S1_FLASH_FPGA_COMMUNICATION_ERROR, dropped.context);
+        }
+    }
+}
+
+/**
+ * @brief Interrupt routine for when an EasyDMA transfer on the SPI bus ends.
+ *        Deselects the device, starts the next queued transfer straight away,
+ *        and then notifies whoever queued the finished one.
+ *
+ * @param p_event: Event from the SPI driver.
+ *
+ * @param p_context: Unused context pointer.
+ */
+static void spi_event_handler(nrfx_spim_evt_t const *p_event, void *p_context)
+{
+    (void)p_context;
+
+    if (p_event->type != NRFX_SPIM_EVENT_DONE)
+    {
+        return;
+    }
+
+    spi_queue_entry_t done = spi_queue_pop();
+
+    // Keep the device selected if the next transfer continues this one
+    if (!done.xfer.cs_hold)
+    {
+        spi_cs_set(false);
+    }
+
+    spi_queue_start();
+
+    if (done.handler != NULL)
+    {
+        done.handler(S1_SUCCESS, done.context);
+    }
+}
+
+/**
+ * @brief Set while one user has the bus to itself, such as while a bitstream
+ *        is streamed with slave select held across several batches.
+ */
+static volatile bool spi_queue_locked = false;
+
+/**
+ * @brief Local function for adding a batch of transfers to the queue, and
+ *        starting it if the bus is idle.
+ *
+ * @param xfers: Array of transfers to run.
+ *
+ * @param count: Number of transfers in the array.
+ *
+ * @param handler: Called once the last transfer in the batch is complete. Can
+ *                 be NULL.
+ *
+ * @param context: Pointer passed back to the handler.
+ *
+ * @param owner: True if the caller holds the queue lock.
+ *
+ * @returns S1_SUCCESS if the batch was queued,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the queue doesn't have room for
+ *          the whole batch, is locked by someone else, or the buffers are not
+ *          within the ram region.
+ */
+static s1_error_t spi_queue_add(s1_spi_xfer_t const *xfers, size_t count,
+                                s1_spi_handler_t handler, void *context,
+                                bool owner)
+{
+    // Nothing to do for an empty batch
+    if (count == 0)
+    {
+        return S1_SUCCESS;
+    }
+
+    // EasyDMA can only access buffers in RAM
+    for (size_t i = 0; i < count; i++)
+    {
+        if ((xfers[i].tx_len > 0 && !nrfx_is_in_ram(xfers[i].tx_buffer)) ||
+            (xfers[i].rx_len > 0 && !nrfx_is_in_ram(xfers[i].rx_buffer)))
+        {
+            return S1_FLASH_FPGA_COMMUNICATION_ERROR;
+        }
+    }
+
+    // While locked, the bus may be in another layout, so don't reopen it
+    if (spi_queue_locked && !owner)
+    {
+        return S1_FLASH_FPGA_COMMUNICATION_ERROR;
+    }
+
+    // Open the bus if this is the first transfer since boot or close
+    if (!spi_session_open)
+    {
+        if (s1_spi_open() != S1_SUCCESS)
+        {
+            return S1_FLASH_FPGA_COMMUNICATION_ERROR;
+        }
+    }
+
+    s1_error_t err = S1_SUCCESS;
+
+    NRFX_CRITICAL_SECTION_ENTER();
+
+    // The whole batch must fit, otherwise none of it is queued. While the
+    // queue is locked, only its owner can add to it
+    if ((spi_queue_locked && !owner) ||
+        count > S1_SPI_QUEUE_SIZE - spi_queue_count)
+    {
+        err = S1_FLASH_FPGA_COMMUNICATION_ERROR;
+    }
+    else
+    {
+        bool idle = spi_queue_count == 0;
+
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t index = (spi_queue_head + spi_queue_count) % S1_SPI_QUEUE_SIZE;
+            spi_queue[index].xfer = xfers[i];
+            spi_queue[index].handler = (i == count - 1) ? handler : NULL;
+            spi_queue[index].context = context;
+            spi_queue[index].last = i == count - 1;
+            spi_queue_count++;
+        }
+
+        // Otherwise the interrupt will pick these up once the bus frees up
+        if (idle)
+        {
+            spi_queue_start();
+        }
+    }
+
+    NRFX_CRITICAL_SECTION_EXIT();
+
+    return err;
+}
+
+/**
+ * @brief Local function for taking the queue for exclusive use. Waits for
+ *        anything already queued to finish, after which only transfers queued
+ *        with the owner flag are accepted until spi_queue_unlock().
+ */
+static void spi_queue_lock(void)
+{
+    bool locked = false;
+
+    while (!locked)
+    {
+        NRFX_CRITICAL_SECTION_ENTER();
+
+        if (spi_queue_count == 0 && !spi_queue_locked)
+        {
+            spi_queue_locked = true;
+            locked = true;
+        }
+
+        NRFX_CRITICAL_SECTION_EXIT();
+    }
+}
+
+/**
+ * @brief Local function for handing the queue back to everyone else.
+ */
+static void spi_queue_unlock(void)
+{
+    spi_queue_locked = false;
+}
+
+/**
+ * @brief Completion flag and result for blocking transfers. Set by
+ *        spi_wait_handler().
+ */
+static volatile bool spi_wait_flag = false;
+static volatile s1_error_t spi_wait_result = S1_SUCCESS;
+
+/**
+ * @brief Handler used by blocking transfers to know when they're done.
+ *
+ * @param err: Whether the batch ran.
+ *
+ * @param context: Unused context pointer.
+ */
+static void spi_wait_handler(s1_error_t err, void *context)
+{
+    (void)context;
+    spi_wait_result = err;
+    spi_wait_flag = true;
+}
+
+/**
+ * @brief Queues a batch of transfers on the SPI bus, and waits until the last
+ *        one completes. Anything already queued runs first.
+ *
+ * @param xfers: Array of transfers to run back to back.
+ *
+ * @param count: Number of transfers in the array.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the buffers are not within the
+ *          ram region, or the driver couldn't start one of the transfers,
+ *          S1_BLOCKED_IN_INTERRUPT if called from an interrupt which the SPI
+ *          interrupt can't preempt.
+ */
+static s1_error_t spi_queue_wait(s1_spi_xfer_t const *xfers, size_t count)
+{
+    PROFILE_FUNCTION(S1_PROFILE_SPI_QUEUE_WAIT);
+
+    // The SPI interrupt must be able to run, otherwise this never returns
+    if (irq_would_block(nrfx_get_irq_number(spi.p_reg)))
+    {
+        return S1_BLOCKED_IN_INTERRUPT;
+    }
+
+    spi_wait_flag = false;
+
+    // The queue may be full of asynchronous transfers, so retry until it fits
+    s1_error_t err;
+    do
+    {
+        err = s1_spi_queue(xfers, count, spi_wait_handler, NULL);
+    } while (err == S1_FLASH_FPGA_COMMUNICATION_ERROR &&
+             s1_spi_is_busy() &&
+             !spi_queue_locked &&
+             count <= S1_SPI_QUEUE_SIZE);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Wait until the transfer is complete
+    while (!spi_wait_flag)
+    {
+    }
+
+    // Return the result of the batch
+    return spi_wait_result;
+}
+
+/**
+ * @brief Performs a transfer on the SPI bus to the flash or FPGA, and waits
+ *        until it completes.
+ *
+ * @param tx_buffer: A pointer to where the transmit data is stored.
+ *
+ * @param tx_len: Length of the transmit data buffer in bytes. i.e how many
+ *                bytes to write.
+ *
+ * @param rx_buffer: A pointer to to where the receive data will be stored.
+ *
+ * @param rx_len: Length of the receive buffer in bytes. i.e how many bytes to
+ *                read.
+ *
+ * @param target: The device to select for the transfer.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the buffers are not within the
+ *          ram region. i.e not writable.
+ */
+static s1_error_t spi_tx_rx(uint8_t *tx_buffer, size_t tx_len,
+                            uint8_t *rx_buffer, size_t rx_len,
+                            s1_spi_target_t target)
+{
+    PROFILE_FUNCTION(S1_PROFILE_SPI_TX_RX);
+
+    s1_spi_xfer_t xfer = {tx_buffer, tx_len, rx_buffer, rx_len, target, false};
+    return spi_queue_wait(&xfer, 1);
+}
+
+/**
+ * @brief Local function for initialising the SPI driver and taking control of
+ *        the chip select. Chip select is driven manually so that the polarity
+ *        can change without re-initialising the driver.
+ *
+ * @param mosi_pin: Pin the nRF transmits on.
+ *
+ * @param miso_pin: Pin the nRF receives on, or NRFX_SPIM_PIN_NOT_USED.
+ *
+ * @param mode: Clock polarity and phase to use.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_INIT_ERROR if the SPI driver could not be initialised.
+ */
+static s1_error_t spi_session_start(uint32_t mosi_pin, uint32_t miso_pin,
+                                    nrf_spim_mode_t mode)
+{
+    // SPI hardware configuration
+    nrfx_spim_config_t spi_config = NRFX_SPIM_DEFAULT_CONFIG;
+    spi_config.mosi_pin = (uint8_t)mosi_pin;
+    spi_config.miso_pin = (uint8_t)miso_pin;
+    spi_config.sck_pin = SPI_CLK_PIN;
+    spi_config.ss_pin = NRFX_SPIM_PIN_NOT_USED;
+    spi_config.mode = mode;
+
+    // Initialise the SPI driver in non-blocking mode
+    nrfx_err_t err = nrfx_spim_init(&spi, &spi_config, spi_event_handler, NULL);
+
+    // If an error occurs, return an initialisation error
+    if (err != NRFX_SUCCESS)
+    {
+        return S1_INIT_ERROR;
+    }
+
+    // Take control of the chip select, starting deselected
+    spi_cs_set(false);
+    nrf_gpio_cfg_output(SPI_CS_PIN);
+
+    spi_session_open = true;
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+/**
+ * @brief Longest transfer EasyDMA can do in one go on SPIM0.
+ */
+#define SPI_MAX_XFER_LEN ((1 << SPIM0_EASYDMA_MAXCNT_SIZE) - 1)
+
+/**
+ * @brief Geometry of the 32Mbit flash IC.
+ */
+#define FLASH_SIZE 0x400000
+#define FLASH_PAGE_SIZE 256
+#define FLASH_SECTOR_SIZE S1_FLASH_ERASE_4K
+#define FLASH_HALF_BLOCK_SIZE S1_FLASH_ERASE_32K
+#define FLASH_BLOCK_SIZE S1_FLASH_ERASE_64K
+
+/**
+ * @brief Handler which receives the throughput of each image programming run.
+ */
+static s1_flash_benchmark_handler_t flash_benchmark_handler = NULL;
+
+/**
+ * @brief Two page program commands, so that one can be filled while the flash
+ *        is programming the other. Static as EasyDMA can't read the image from flash.
+ */
+static uint8_t flash_page_buffers[2][4 + FLASH_PAGE_SIZE];
+
+/**
+ * @brief Local function for starting the Cortex-M4 cycle counter, which is
+ *        used to time long running operations.
+ */
+static void cycle_counter_start(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+/**
+ * @brief Local function for accumulating elapsed cycles. Called often enough
+ *        that the 32bit counter never wraps more than once between calls.
+ *
+ * @param last: Counter value at the previous call. Updated to the current one.
+ *
+ * @param total: Running total of elapsed cycles.
+ */
+static void cycle_counter_lap(uint32_t *last, uint64_t *total)
+{
+    uint32_t now = DWT->CYCCNT;
+    *total += now - *last;
+    *last = now;
+}
+
+/**
+ * @brief Local function for starting an erase of a sector or block of the
+ *        flash. The flash stays busy until the erase is complete.
+ *
+ * @param opcode: 0x20 for a 4KB sector, 0x52 for a 32KB block, or 0xD8 for a
+ *                64KB block.
+ *
+ * @param address: Start address of the sector or block.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the command couldn't be sent.
+ */
+static s1_error_t flash_erase(uint8_t opcode, uint32_t address)
+{
+    uint8_t wren[1] = {0x06};
+    uint8_t erase_seq[4] = {opcode,
+                            (uint8_t)(address >> 16),
+                            (uint8_t)(address >> 8),
+                            (uint8_t)address};
+
+    // Disable write protection, and then issue the erase
+    s1_spi_xfer_t erase_xfers[2] = {
+        {wren, 1, NULL, 0, S1_SPI_FLASH, false},
+        {erase_seq, 4, NULL, 0, S1_SPI_FLASH, false},
+    };
+    return spi_queue_wait(erase_xfers, 2);
+}
+
+/**
+ * @brief Local function for picking the largest erase which starts at an
+ *        address, and doesn't go past the end of the range being erased.
+ *
+ * @param address: Sector aligned address to erase from.
+ *
+ * @param end: Sector aligned end of the range.
+ *
+ * @returns The size of the erase. One of the FLASH_..._SIZE values.
+ */
+static uint32_t flash_erase_size(uint32_t address, uint32_t end)
+{
+    if (address % FLASH_BLOCK_SIZE == 0 && end - address >= FLASH_BLOCK_SIZE)
+    {
+        return FLASH_BLOCK_SIZE;
+    }
+
+    if (address % FLASH_HALF_BLOCK_SIZE == 0 &&
+        end - address >= FLASH_HALF_BLOCK_SIZE)
+    {
+        return FLASH_HALF_BLOCK_SIZE;
+    }
+
+    return FLASH_SECTOR_SIZE;
+}
+
+/**
+ * @brief Local function for rounding a byte range out to whole sectors.
+ *
+ * @param address: Start of the range. Rounded down to a sector boundary.
+ *
+ * @param len: Length of the range in bytes.
+ *
+ * @returns The end of the range, rounded up to a sector boundary.
+ */
+static uint32_t flash_erase_bounds(uint32_t *address, size_t len)
+{
+    uint32_t end = *address + (uint32_t)len;
+    *address -= *address % FLASH_SECTOR_SIZE;
+    end += (FLASH_SECTOR_SIZE - end % FLASH_SECTOR_SIZE) % FLASH_SECTOR_SIZE;
+    return end;
+}
+
+/**
+ * @brief Local function for filling a page program command.
+ *
+ * @param buffer: Command buffer of 4 + FLASH_PAGE_SIZE bytes.
+ *
+ * @param address: Page aligned address in the flash to program.
+ *
+ * @param data: The data for the page.
+ *
+ * @param len: Number of bytes to copy. Up to FLASH_PAGE_SIZE.
+ *
+ * @returns Length of the command to transfer.
+ */
+static size_t flash_stage_page(uint8_t *buffer,
+                               uint32_t address,
+                               unsigned char const *data,
+                               size_t len)
+{
+    // Write page command with 24bit address
+    buffer[0] = 0x02;
+    buffer[1] = (uint8_t)(address >> 16);
+    buffer[2] = (uint8_t)(address >> 8);
+    buffer[3] = 0x00; // Lower byte 0 to avoid partial pages
+
+    memcpy(buffer + 4, data, len);
+
+    return 4 + len;
+}
+
+/**
+ * @brief State of the page programming engine. It's driven entirely from SPI
+ *        completion handlers, so each page is sent, and the flash polled, with
+ *        no round trip through the caller.
+ */
+static struct
+{
+    unsigned char const *image;
+    uint32_t address;
+    uint32_t offset;
+    uint32_t end;
+    size_t tx_len;
+    uint8_t current;
+    volatile bool done;
+    volatile s1_error_t err;
+} flash_program;
+
+/**
+ * @brief Commands used by the engine. Static as they're sent from interrupts.
+ */
+static uint8_t flash_program_wren[1] = {0x06};
+static uint8_t flash_program_status_cmd[1] = {0x05};
+static uint8_t flash_program_status_res[2];
+
+static void flash_program_page_sent(s1_error_t err, void *context);
+static void flash_program_status_read(s1_error_t err, void *context);
+
+/**
+ * @brief Local function for stopping the engine, and waking up the caller.
+ *
+ * @param err: The result to return.
+ */
+static void flash_program_finish(s1_error_t err)
+{
+    flash_program.err = err;
+    flash_program.done = true;
+}
+
+/**
+ * @brief Local function for staging the page at the current offset into the
+ *        current buffer.
+ */
+static void flash_program_stage(void)
+{
+    uint32_t left = flash_program.end - flash_program.offset;
+    size_t page_len = left < FLASH_PAGE_SIZE ? left : FLASH_PAGE_SIZE;
+
+    flash_program.tx_len = flash_stage_page(
+        flash_page_buffers[flash_program.current],
+        flash_program.address + flash_program.offset,
+        flash_program.image + flash_program.offset,
+        page_len);
+}
+
+/**
+ * @brief Local function for sending the staged page, with its own write enable.
+ */
+static void flash_program_send(void)
+{
+    s1_spi_xfer_t page_xfers[2] = {
+        {flash_program_wren, 1, NULL, 0, S1_SPI_FLASH, false},
+        {flash_page_buffers[flash_program.current], flash_program.tx_len,
+         NULL, 0, S1_SPI_FLASH, false},
+    };
+
+    if (s1_spi_queue(page_xfers, 2, flash_program_page_sent, NULL) != S1_SUCCESS)
+    {
+        flash_program_finish(S1_FLASH_FPGA_COMMUNICATION_ERROR);
+    }
+}
+
+/**
+ * @brief Local function for reading the status register to see if the flash
+ *        has finished programming.
+ */
+static void flash_program_poll(void)
+{
+    s1_spi_xfer_t status_xfer = {flash_program_status_cmd, 1,
+                                 flash_program_status_res, 2,
+                                 S1_SPI_FLASH, false};
+
+    if (s1_spi_queue(&status_xfer, 1, flash_program_status_read, NULL) != S1_SUCCESS)
+    {
+        flash_program_finish(S1_FLASH_FPGA_COMMUNICATION_ERROR);
+    }
+}
+
+/**
+ * @brief Handler for when a page has been sent. The flash is now programming
+ *        it, so the next page is staged into the other buffer in the meantime.
+ *
+ * @param err: Whether the page was sent.
+ *
+ * @param context: Unused context pointer.
+ */
+static void flash_program_page_sent(s1_error_t err, void *context)
+{
+    (void)context;
+
+    if (err != S1_SUCCESS)
+    {
+        flash_program_finish(err);
+        return;
+    }
+
+    flash_program.offset += FLASH_PAGE_SIZE;
+
+    if (flash_program.offset < flash_program.end)
+    {
+        flash_program.current ^= 1;
+        flash_program_stage();
+    }
+
+    flash_program_poll();
+}
+
+/**
+ * @brief Handler for when the status register has been read. Polls again while
+ *        the flash is busy, and then sends the next page, or finishes.
+ *
+ * @param err: Whether the status was read.
+ *
+ * @param context: Unused context pointer.
+ */
+static void flash_program_status_read(s1_error_t err, void *context)
+{
+    (void)context;
+
+    if (err != S1_SUCCESS)
+    {
+        flash_program_finish(err);
+        return;
+    }
+
+    if (flash_program_status_res[1] & 0x01)
+    {
+        flash_program_poll();
+        return;
+    }
+
+    if (flash_program.offset < flash_program.end)
+    {
+        flash_program_send();
+        return;
+    }
+
+    flash_program_finish(S1_SUCCESS);
+}
+
+/**
+ * @brief Local function for programming part of an image into an area of the
+ *        flash which has already been erased. Pages are sent and the flash is
+ *        polled from the SPI interrupt, and each page is staged while the
+ *        previous one is programming. Returns once the last page has finished
+ *        programming.
+ *
+ * @param address: Sector aligned flash address where the image starts.
+ *
+ * @param image: Pointer to the start of the image.
+ *
+ * @param start: Page aligned offset to start programming from.
+ *
+ * @param end: Offset to stop programming at.
+ *
+ * @param last_cycles: Cycle counter value used to time the programming.
+ *
+ * @param total_cycles: Running total of elapsed cycles.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the spi queue is full, or a
+ *          transfer couldn't be started.
+ */
+static s1_error_t flash_program_range(uint32_t address,
+                                      unsigned char const *image,
+                                      uint32_t start,
+                                      uint32_t end,
+                                      uint32_t *last_cycles,
+                                      uint64_t *total_cycles)
+{
+    if (start >= end)
+    {
+        return S1_SUCCESS;
+    }
+
+    flash_program.image = image;
+    flash_program.address = address;
+    flash_program.offset = start;
+    flash_program.end = end;
+    flash_program.current = 0;
+    flash_program.err = S1_SUCCESS;
+    flash_program.done = false;
+
+    // Send the first page. The handlers take it from there
+    flash_program_stage();
+    flash_program_send();
+
+    while (!flash_program.done)
+    {
+    }
+
+    cycle_counter_lap(last_cycles, total_cycles);
+
+    return flash_program.err;
+}
+
+/**
+ * @brief Local function for updating a CRC-32 (IEEE 802.3) with more data.
+ *        Start with a crc of 0xFFFFFFFF, and invert the final result.
+ *
+ * @param crc: The running CRC value.
+ *
+ * @param data: Pointer to the data.
+ *
+ * @param len: Length of the data in bytes.
+ *
+ * @returns The updated CRC value.
+ */
+static uint32_t crc32_update(uint32_t crc, uint8_t const *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Local function for calculating the CRC-32 of an area of the flash.
+ *        The data is read back a page at a time into a static buffer.
+ *
+ * @param address: Start address to read from.
+ *
+ * @param len: Number of bytes to include in the CRC.
+ *
+ * @param crc_out: Where to store the CRC-32 of the flash contents.
+ *
+ * @returns S1_SUCCESS if okay, or the error from reading the flash.
+ */
+static s1_error_t flash_crc32(uint32_t address, size_t len, uint32_t *crc_out)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    while (len > 0)
+    {
+        size_t chunk = len < FLASH_PAGE_SIZE ? len : FLASH_PAGE_SIZE;
+
+        s1_error_t err = s1_flash_read(address, flash_page_buffers[0], chunk);
+
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+
+        crc = crc32_update(crc, flash_page_buffers[0], chunk);
+
+        address += (uint32_t)chunk;
+        len -= chunk;
+    }
+
+    *crc_out = ~crc;
+
+    return S1_SUCCESS;
+}
+
+/**
+ * @brief Framed FPGA register protocol. Each access has an opcode, address and
+ *        length header. The trailer is the end opcode, the CRC, the status
+ *        byte and the FPGA's CRC.
+ */
+#define FPGA_FRAME_OP_END 0x00
+#define FPGA_FRAME_STATUS_OK 0xA5
+#define FPGA_FRAME_HEADER_LEN 3
+#define FPGA_FRAME_TRAILER_LEN 6
+
+/**
+ * @brief Transmit and receive buffers for the framed FPGA protocol.
+ */
+static uint8_t fpga_frame_tx[S1_FPGA_FRAME_SIZE];
+static uint8_t fpga_frame_rx[S1_FPGA_FRAME_SIZE];
+
+/**
+ * @brief Local function for updating a CRC-16/CCITT with more data. Start with
+ *        a crc of 0xFFFF.
+ *
+ * @param crc: The running CRC value.
+ *
+ * @param data: Pointer to the data.
+ *
+ * @param len: Length of the data in bytes.
+ *
+ * @returns The updated CRC value.
+ */
+static uint16_t crc16_update(uint16_t crc, uint8_t const *data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= (uint16_t)(data[i] << 8);
+
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+            crc = (uint16_t)((crc << 1) ^ ((crc & 0x8000) ? 0x1021 : 0));
+        }
+    }
+
+    return crc;
+}
+
+/**
+ * @brief Local function for releasing the FPGA from reset, and timestamping it
+ *        so the boot time can be measured once CDONE goes high.
+ */
+static void fpga_release_reset(void)
+{
+    s1_fpga_doorbell_disable();
+    fpga_booted = false;
+    fpga_done_flag_pending = false;
+    fpga_boot_ticks = 0;
+    fpga_reset_release_ticks = app_timer_cnt_get();
+    nrf_gpio_pin_set(FPGA_RESET_PIN);
+}
+
+/**
+ * @brief Timings from the iCE40 SPI slave configuration sequence. CRESET must
+ *        be low for at least 200ns, and the FPGA then needs 1200us to clear its
+ *        configuration memory before it accepts the bitstream. After the image
+ *        CDONE should rise within 100 clocks, and another 49 clocks start the
+ *        user IO.
+ */
+#define FPGA_CONFIG_RESET_LOW_US 1
+#define FPGA_CONFIG_CLEAR_US 1200
+#define FPGA_CONFIG_DONE_CLOCK_BYTES 13
+#define FPGA_CONFIG_WAKE_CLOCK_BYTES 7
+
+/**
+ * @brief Local function for sending dummy clocks to the FPGA while its
+ *        configuration port is deselected. The FPGA chip select polarity is
+ *        active high, so selecting it keeps the active low slave select high.
+ *        The caller must hold the SPI queue lock.
+ *
+ * @param bytes: Number of dummy bytes to send, 8 clocks each.
+ */
+static void fpga_config_clocks(size_t bytes)
+{
+    uint8_t dummy[FPGA_CONFIG_DONE_CLOCK_BYTES] = {0};
+    s1_spi_xfer_t xfer = {dummy, bytes, NULL, 0, S1_SPI_FPGA, false};
+
+    spi_queue_add(&xfer, 1, NULL, NULL, true);
+
+    // Wait until the clocks are out
+    while (s1_spi_is_busy())
+    {
+    }
+}
+
+/**
+ * @brief Local function for streaming a bitstream into the configuration port
+ *        while slave select stays asserted. Images already in ram are sent in
+ *        place, whereas images in internal flash are copied through the two
+ *        page buffers so one fills while the other is being sent. Chunks are
+ *        queued as they become ready and hold slave select between them, so
+ *        the caller must hold the SPI queue lock to keep anything else from
+ *        landing in the middle of the image.
+ *
+ * @param bitstream: The image to send.
+ *
+ * @param len: Length of the image in bytes.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if a transfer couldn't be queued.
+ */
+static s1_error_t fpga_config_stream(unsigned char const *bitstream, size_t len)
+{
+    bool in_ram = nrfx_is_in_ram(bitstream);
+    size_t chunk_len = in_ram ? SPI_MAX_XFER_LEN : sizeof(flash_page_buffers[0]);
+    uint8_t buffer = 0;
+    uint32_t failed_batches = spi_failed_batches;
+
+    // Stage the first chunk if it has to be copied
+    if (!in_ram)
+    {
+        memcpy(flash_page_buffers[0], bitstream,
+               len < chunk_len ? len : chunk_len);
+    }
+
+    for (size_t offset = 0; offset < len; offset += chunk_len)
+    {
+        size_t n = len - offset < chunk_len ? len - offset : chunk_len;
+        bool last = offset + n == len;
+
+        // Slave select is the active low flash polarity, held until the end
+        s1_spi_xfer_t xfer = {
+            in_ram ? (uint8_t *)&bitstream[offset] : flash_page_buffers[buffer],
+            n, NULL, 0, S1_SPI_FLASH, !last};
+
+        s1_error_t err;
+        do
+        {
+            err = spi_queue_add(&xfer, 1, NULL, NULL, true);
+        } while (err == S1_FLASH_FPGA_COMMUNICATION_ERROR && s1_spi_is_busy());
+
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+
+        if (in_ram || last)
+        {
+            continue;
+        }
+
+        // Wait until only this chunk is in flight, then fill the other buffer
+        while (spi_queue_count > 1)
+        {
+        }
+
+        buffer ^= 1;
+        size_t next = len - (offset + n) < chunk_len ? len - (offset + n)
+                                                     : chunk_len;
+        memcpy(flash_page_buffers[buffer], &bitstream[offset + n], next);
+    }
+
+    // Wait until the whole image is out
+    while (s1_spi_is_busy())
+    {
+    }
+
+    // Any chunk which didn't start leaves a gap in the bitstream
+    if (spi_failed_batches != failed_batches)
+    {
+        return S1_FLASH_FPGA_COMMUNICATION_ERROR;
+    }
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+/**
+ * @brief Instance of the timer which paces the ADC stream, and the PPI channel
+ *        which connects its compare event to the SAADC sample task.
+ */
+static const nrfx_timer_t adc_stream_timer = NRFX_TIMER_INSTANCE(1);
+static nrf_ppi_channel_t adc_stream_ppi_channel;
+
+/**
+ * @brief SAADC channels used for the ADC1 and ADC2 pins while streaming.
+ */
+#define ADC1_CHANNEL 0
+#define ADC2_CHANNEL 1
+
+/**
+ * @brief Time taken by one conversion while streaming. 10us of acquisition,
+ *        plus 2us for the conversion itself.
+ */
+#define ADC_STREAM_CONVERSION_US 12
+
+/**
+ * @brief Largest block the SAADC EasyDMA can fill in one go.
+ */
+#define ADC_STREAM_MAX_BLOCK_LEN 0x7FFF
+
+/**
+ * @brief ADC stream state. Each block is either free, queued in the SAADC
+ *        driver, or held by the application. The driver takes up to two blocks
+ *        at once, the one being filled and the next one.
+ */
+static volatile bool adc_stream_active = false;
+static volatile bool adc_stream_running = false;
+static s1_adc_stream_config_t adc_stream_config;
+static volatile uint32_t adc_stream_free_blocks = 0;
+static volatile size_t adc_stream_queued_blocks = 0;
+static volatile uint32_t adc_stream_overruns = 0;
+
+/**
+ * @brief Local function for handing free blocks to the SAADC driver until it
+ *        has two. Must be called with interrupts disabled, or from the SAADC
+ *        interrupt.
+ */
+static void adc_stream_queue_blocks(void)
+{
+    for (size_t i = 0; i < adc_stream_config.block_count; i++)
+    {
+        if (adc_stream_queued_blocks == 2)
+        {
+            return;
+        }
+
+        if ((adc_stream_free_blocks & (1u << i)) == 0)
+        {
+            continue;
+        }
+
+        nrf_saadc_value_t *block =
+            adc_stream_config.buffers + i * adc_stream_config.block_len;
+
+        // The first block queued while idle also starts the SAADC
+        if (nrfx_saadc_buffer_convert(block,
+                                      (uint16_t)adc_stream_config.block_len) !=
+            NRFX_SUCCESS)
+        {
+            return;
+        }
+
+        adc_stream_free_blocks &= ~(1u << i);
+        adc_stream_queued_blocks++;
+    }
+}
+
+/**
+ * @brief Local function for marking a block as free again, and queueing it if
+ *        the SAADC needs one. Must be called with interrupts disabled, or from
+ *        the SAADC interrupt.
+ *
+ * @param block: The block to free.
+ */
+static void adc_stream_free_block(int16_t const *block)
+{
+    size_t index = (size_t)(block - adc_stream_config.buffers) /
+                   adc_stream_config.block_len;
+
+    if (index >= adc_stream_config.block_count)
+    {
+        return;
+    }
+
+    adc_stream_free_blocks |= 1u << index;
+    adc_stream_queue_blocks();
+}
+
+/**
+ * @brief Local function for handling a block which the SAADC has filled.
+ *
+ * @param block: The completed block.
+ *
+ * @param len: Number of samples in the block.
+ */
+static void adc_stream_block_done(int16_t *block, size_t len)
+{
+    // A stop can still complete a block, which is discarded
+    if (!adc_stream_running)
+    {
+        return;
+    }
+
+    adc_stream_queued_blocks--;
+
+    // Hand the block over, and take it back if the handler is done with it
+    if (adc_stream_config.handler(block, len, adc_stream_config.context))
+    {
+        adc_stream_free_block(block);
+    }
+
+    // Nothing left to fill means sampling pauses until a block is released
+    if (adc_stream_queued_blocks == 0)
+    {
+        adc_stream_overruns++;
+    }
+}
+
+/**
+ * @brief Counters for the ADC to FPGA pipeline.
+ */
+static volatile uint32_t adc_fpga_blocks_sent = 0;
+static volatile uint32_t adc_fpga_blocks_dropped = 0;
+
+/**
+ * @brief Handler for when a block has been sent to the FPGA. The block is
+ *        handed back to the ADC stream to be filled again.
+ *
+ * @param err: Whether the block was sent.
+ *
+ * @param context: The block.
+ */
+static void adc_fpga_sent_handler(s1_error_t err, void *context)
+{
+    if (err == S1_SUCCESS)
+    {
+        adc_fpga_blocks_sent++;
+    }
+    else
+    {
+        adc_fpga_blocks_dropped++;
+    }
+
+    s1_adc_stream_release((int16_t const *)context);
+}
+
+/**
+ * @brief Block handler for the ADC to FPGA pipeline. The block itself is used
+ *        as the SPI transmit buffer.
+ *
+ * @returns True if the block couldn't be sent, and can be refilled straight
+ *          away, or false while it's on its way to the FPGA.
+ */
+static bool adc_fpga_block_handler(int16_t *block, size_t len, void *context)
+{
+    (void)context;
+
+    if (fpga_tx_rx_async((uint8_t *)block, len * sizeof(int16_t), NULL, 0,
+                         adc_fpga_sent_handler, block) != S1_SUCCESS)
+    {
+        adc_fpga_blocks_dropped++;
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief SAADC channel used for the PMIC AMUX. The highest channel is used so
+ *        the lower ones are left for the ADC1 and ADC2 pins.
+ */
+#define PMIC_AMUX_CHANNEL 7
+
+/**
+ * @brief MAX77654 AMUX selections in CNFG_CHG_I (0x28), sampled in this order
+ *        by the telemetry sampler. The upper 4 bits of the register hold the
+ *        discharge current scale, and are left alone.
+ */
+#define PMIC_AMUX_OFF 0x0
+#define PMIC_AMUX_CHGIN_V 0x1
+#define PMIC_AMUX_BATT_V 0x3
+#define PMIC_AMUX_BATT_CHG_I 0x4
+#define PMIC_AMUX_THM_V 0x7
+#define PMIC_AMUX_TBIAS_V 0x8
+
+static const uint8_t telemetry_channels[] = {
+    PMIC_AMUX_BATT_V,
+    PMIC_AMUX_CHGIN_V,
+    PMIC_AMUX_BATT_CHG_I,
+    PMIC_AMUX_THM_V,
+    PMIC_AMUX_TBIAS_V,
+};
+
+/**
+ * @brief Full scale of the AMUX output, and the voltage and current each
+ *        channel reads at full scale. Charge current is relative to the fast
+ *        charge current setting.
+ */
+#define PMIC_AMUX_FULL_SCALE_MV 1250
+#define PMIC_AMUX_BATT_FULL_SCALE_MV 4600
+#define PMIC_AMUX_CHGIN_FULL_SCALE_MV 7500
+
+/**
+ * @brief Time for the AMUX output to settle after switching channel.
+ */
+#define PMIC_AMUX_SETTLE_US 50
+
+/**
+ * @brief THM/TBIAS ratio in 1/1000ths, from -20C to 70C in 5C steps. Assumes
+ *        a 10k NTC thermistor with a beta of 3380, and a 10k bias resistor.
+ */
+static const uint16_t telemetry_ntc_table[] = {
+    882, 853, 819, 780, 738, 693, 646, 597, 548, 500,
+    453, 409, 367, 329, 294, 262, 233, 207, 184};
+
+#define TELEMETRY_NTC_FIRST_C -20
+#define TELEMETRY_NTC_STEP_C 5
+
+/**
+ * @brief State of the telemetry sampler. A round is started by the app timer,
+ *        and then driven from the PMIC, delay timer and SAADC interrupts, one
+ *        AMUX channel at a time.
+ */
+APP_TIMER_DEF(telemetry_timer);
+static bool telemetry_timer_created = false;
+static s1_telemetry_handler_t telemetry_handler = NULL;
+static volatile bool telemetry_busy = false;
+static volatile uint32_t telemetry_rounds = 0;
+static volatile s1_error_t telemetry_round_err = S1_SUCCESS;
+static size_t telemetry_step = 0;
+static uint8_t telemetry_pmic_regs[0x28 - 0x24 + 1];
+static uint32_t telemetry_amux_mv[sizeof(telemetry_channels)];
+static nrf_saadc_value_t telemetry_amux_value;
+static volatile bool telemetry_converting = false;
+static s1_telemetry_t telemetry_latest = {0};
+
+/**
+ * @brief Local function for converting a THM/TBIAS ratio to a temperature,
+ *        by interpolating the thermistor table.
+ *
+ * @param ratio: THM/TBIAS ratio in 1/1000ths.
+ *
+ * @returns Temperature in tenths of a degree C, clamped to the table.
+ */
+static int32_t telemetry_ntc_to_decicelsius(uint32_t ratio)
+{
+    size_t last = sizeof(telemetry_ntc_table) / sizeof(telemetry_ntc_table[0]) - 1;
+
+    // The ratio falls as the temperature rises
+    if (ratio >= telemetry_ntc_table[0])
+    {
+        return TELEMETRY_NTC_FIRST_C * 10;
+    }
+
+    for (size_t i = 1; i <= last; i++)
+    {
+        if (ratio >= telemetry_ntc_table[i])
+        {
+            int32_t span = telemetry_ntc_table[i - 1] - telemetry_ntc_table[i];
+            int32_t offset = telemetry_ntc_table[i - 1] - (int32_t)ratio;
+
+            return (TELEMETRY_NTC_FIRST_C + (int32_t)(i - 1) * TELEMETRY_NTC_STEP_C) * 10 +
+                   offset * TELEMETRY_NTC_STEP_C * 10 / span;
+        }
+    }
+
+    return (TELEMETRY_NTC_FIRST_C + (int32_t)last * TELEMETRY_NTC_STEP_C) * 10;
+}
+
+/**
+ * @brief Local function for starting a single conversion of the AMUX output.
+ *        The result arrives in telemetry_sample_done() from the SAADC
+ *        interrupt.
+ *
+ * @returns S1_SUCCESS if started,
+ *          S1_ADC_BUSY if the ADC stream is using the SAADC,
+ *          S1_INIT_ERROR if the SAADC driver couldn't start the conversion.
+ */
+static s1_error_t telemetry_sample_start(void)
+{
+    // The SAADC channels belong to the ADC stream while it's running
+    if (adc_stream_active)
+    {
+        return S1_ADC_BUSY;
+    }
+
+    // 12bit with 1/3 gain against the 0.6V reference gives a 1.8V full scale
+    nrf_saadc_channel_config_t channel_config =
+        NRFX_SAADC_DEFAULT_CHANNEL_CONFIG_SE(PMIC_AMUX_PIN);
+    channel_config.gain = NRF_SAADC_GAIN1_3;
+    channel_config.acq_time = NRF_SAADC_ACQTIME_40US;
+    channel_config.burst = NRF_SAADC_BURST_ENABLED;
+
+    if (nrfx_saadc_channel_init(PMIC_AMUX_CHANNEL, &channel_config) != NRFX_SUCCESS)
+    {
+        return S1_INIT_ERROR;
+    }
+
+    telemetry_converting = true;
+
+    if (nrfx_saadc_buffer_convert(&telemetry_amux_value, 1) != NRFX_SUCCESS ||
+        nrfx_saadc_sample() != NRFX_SUCCESS)
+    {
+        nrfx_saadc_channel_uninit(PMIC_AMUX_CHANNEL);
+        telemetry_converting = false;
+        return S1_INIT_ERROR;
+    }
+
+    return S1_SUCCESS;
+}
+
+/**
+ * @brief Local function for converting the sampled AMUX voltages, and
+ *        publishing them at the end of a round.
+ */
+static void telemetry_finish(void)
+{
+    s1_telemetry_t result;
+
+    result.battery_mv = telemetry_amux_mv[0] * PMIC_AMUX_BATT_FULL_SCALE_MV /
+                        PMIC_AMUX_FULL_SCALE_MV;
+
+    result.chgin_mv = telemetry_amux_mv[1] * PMIC_AMUX_CHGIN_FULL_SCALE_MV /
+                      PMIC_AMUX_FULL_SCALE_MV;
+
+    // Charge current is a fraction of the fast charge setting in 0x24
+    uint32_t fast_charge_ua = (uint32_t)(telemetry_pmic_regs[0] >> 2) * 7500 + 7500;
+    result.charge_ua = (uint32_t)((uint64_t)telemetry_amux_mv[2] * fast_charge_ua /
+                                  PMIC_AMUX_FULL_SCALE_MV);
+
+    // Temperature comes from the thermistor divider ratio
+    uint32_t tbias_mv = telemetry_amux_mv[4] ? telemetry_amux_mv[4] : 1;
+    result.temperature_dc =
+        telemetry_ntc_to_decicelsius(telemetry_amux_mv[3] * 1000 / tbias_mv);
+
+    NRFX_CRITICAL_SECTION_ENTER();
+    telemetry_latest = result;
+    NRFX_CRITICAL_SECTION_EXIT();
+
+    telemetry_rounds++;
+    telemetry_busy = false;
+
+    if (telemetry_handler != NULL)
+    {
+        telemetry_handler(&result);
+    }
+}
+
+static void telemetry_pmic_handler(s1_error_t err, void *context);
+
+/**
+ * @brief Local function for moving a telemetry round on once a channel has
+ *        been sampled. Selects the next channel, or turns off the AMUX once
+ *        they're all done.
+ *
+ * @param err: Result of sampling the channel.
+ */
+static void telemetry_next(s1_error_t err)
+{
+    uint8_t amux_config = telemetry_pmic_regs[0x28 - 0x24] & 0xF0;
+
+    // Give up the round on any error, leaving the AMUX off
+    if (err != S1_SUCCESS)
+    {
+        s1_pmic_write_async(0x28, amux_config | PMIC_AMUX_OFF, NULL, NULL);
+        telemetry_round_err = err;
+        telemetry_busy = false;
+        return;
+    }
+
+    // Once all channels are done, turn off the AMUX to save power
+    if (telemetry_step == sizeof(telemetry_channels))
+    {
+        s1_pmic_write_async(0x28, amux_config | PMIC_AMUX_OFF, NULL, NULL);
+        telemetry_finish();
+        return;
+    }
+
+    // Otherwise select the next channel
+    uint8_t channel = telemetry_channels[telemetry_step++];
+
+    if (s1_pmic_write_async(0x28, amux_config | channel,
+                            telemetry_pmic_handler, NULL) != S1_SUCCESS)
+    {
+        telemetry_round_err = S1_PMIC_COMMUNICATION_ERROR;
+        telemetry_busy = false;
+    }
+}
+
+/**
+ * @brief Handler for when the AMUX output has settled. Runs from the delay
+ *        timer interrupt.
+ */
+static void telemetry_settle_handler(void)
+{
+    s1_error_t err = telemetry_sample_start();
+
+    // Otherwise the round carries on from the SAADC interrupt
+    if (err != S1_SUCCESS)
+    {
+        telemetry_next(err);
+    }
+}
+
+/**
+ * @brief Local function for storing a finished AMUX conversion. Runs from the
+ *        SAADC interrupt.
+ */
+static void telemetry_sample_done(void)
+{
+    // Release the channel so it isn't part of any other conversions
+    nrfx_saadc_channel_uninit(PMIC_AMUX_CHANNEL);
+    telemetry_converting = false;
+
+    telemetry_amux_mv[telemetry_step - 1] =
+        telemetry_amux_value < 0 ? 0
+                                 : (uint32_t)telemetry_amux_value * 1800 / 4096;
+
+    telemetry_next(S1_SUCCESS);
+}
+
+/**
+ * @brief Handler for each PMIC transfer of a telemetry round. Runs from the
+ *        I2C interrupt. Once a channel is selected, the AMUX is given time to
+ *        settle on a timer before it's sampled, so the interrupt isn't held up.
+ *
+ * @param err: Result of the PMIC transfer.
+ *
+ * @param context: Unused context pointer.
+ */
+static void telemetry_pmic_handler(s1_error_t err, void *context)
+{
+    (void)context;
+
+    // The first transfer reads the charger settings. Every other one selects
+    // the channel to sample
+    if (err == S1_SUCCESS && telemetry_step > 0)
+    {
+        delay_start(DELAY_TELEMETRY_CHANNEL, PMIC_AMUX_SETTLE_US,
+                    telemetry_settle_handler);
+        return;
+    }
+
+    telemetry_next(err);
+}
+
+/**
+ * @brief Local function for starting a telemetry round, unless one is already
+ *        running.
+ */
+static void telemetry_start_round(void)
+{
+    bool busy;
+
+    NRFX_CRITICAL_SECTION_ENTER();
+    busy = telemetry_busy;
+    telemetry_busy = true;
+    NRFX_CRITICAL_SECTION_EXIT();
+
+    if (busy)
+    {
+        return;
+    }
+
+    // Start by reading the charge current setting through to the AMUX config
+    telemetry_step = 0;
+    telemetry_round_err = S1_SUCCESS;
+    if (s1_pmic_read_async(0x24, telemetry_pmic_regs, sizeof(telemetry_pmic_regs),
+                           telemetry_pmic_handler, NULL) != S1_SUCCESS)
+    {
+        telemetry_round_err = S1_PMIC_COMMUNICATION_ERROR;
+        telemetry_busy = false;
+    }
+}
+
+/**
+ * @brief App timer handler which starts each periodic telemetry round.
+ *
+ * @param context: Unused context pointer.
+ */
+static void telemetry_timer_handler(void *context)
+{
+    (void)context;
+    telemetry_start_round();
+}
+
+/**
+ * @brief Interrupt routine for the SAADC. Completed buffers belong to the
+ *        ADC stream, apart from the single telemetry AMUX sample.
+ *
+ * @param p_event: Event from the SAADC driver.
+ */
+static void saadc_event_handler(nrfx_saadc_evt_t const *p_event)
+{
+    if (p_event->type == NRFX_SAADC_EVT_DONE &&
+        p_event->data.done.p_buffer == &telemetry_amux_value)
+    {
+        telemetry_sample_done();
+        return;
+    }
+
+    if (p_event->type == NRFX_SAADC_EVT_DONE)
+    {
+        adc_stream_block_done(p_event->data.done.p_buffer,
+                              p_event->data.done.size);
+    }
+}
+
+/**
+ * @brief Interrupt routine for the ADC stream timer. The compare event is only
+ *        used through PPI, so there's nothing to do here.
+ *
+ * @param event_type: The timer event.
+ *
+ * @param p_context: Unused.
+ */
+static void adc_stream_timer_handler(nrf_timer_event_t event_type,
+                                     void *p_context)
+{
+    (void)event_type;
+    (void)p_context;
+}
+
+/**
+ * @brief Local function for initialising the SAADC driver. Oversampling only
+ *        works with one channel, so the ADC stream turns it off.
+ *
+ * @param oversample: The oversampling to use.
+ *
+ * @returns NRFX_SUCCESS if okay, or the driver error.
+ */
+static nrfx_err_t saadc_init(nrf_saadc_oversample_t oversample)
+{
+    nrfx_saadc_config_t saadc_config = NRFX_SAADC_DEFAULT_CONFIG;
+    saadc_config.resolution = NRF_SAADC_RESOLUTION_12BIT;
+    saadc_config.oversample = oversample;
+
+    return nrfx_saadc_init(&saadc_config, saadc_event_handler);
+}
+
+/**
+ * @brief Interrupt routine for when the FPGA configuration is complete, and the
+ *        CDONE pin goes high.
+ *
+ * @param pin: Pin that caused the trigger.
+ *
+ * @param action: The polarity of the interrupt trigger.
+ */
+static void fpga_done_pin_interrupt(nrfx_gpiote_pin_t pin,
+                                    nrf_gpiote_polarity_t action)
+{
+    if (pin == FPGA_DONE_PIN && action == NRF_GPIOTE_POLARITY_LOTOHI)
+    {
+        // After boot, the FPGA application rings the doorbell on the same pin
+        s1_fpga_doorbell_handler_t doorbell_handler = fpga_doorbell_handler;
+
+        if (doorbell_handler != NULL)
+        {
+            fpga_doorbell_count++;
+            doorbell_handler(fpga_doorbell_context);
+            return;
+        }
+
+        fpga_booted = true;
+        fpga_boot_ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(),
+                                                     fpga_reset_release_ticks);
+        fpga_done_flag_pending = true;
+
+        if (fpga_boot_handler != NULL)
+        {
+            fpga_boot_handler(s1_fpga_get_boot_time_us());
+        }
+    }
+}
+
+s1_error_t s1_init(void)
+{
+#if S1_PROFILE
+    // Start the cycle counter used for profiling
+    cycle_counter_start();
+#endif
+
+    // Configure FPGA reset pin as an output. A low signal holds FPGA in reset
+    nrf_gpio_cfg_output(FPGA_RESET_PIN);
+
+    // Set up done pin as an interrupt. It goes high when the FPGA is loaded
+    nrfx_gpiote_in_config_t config = NRFX_GPIOTE_CONFIG_IN_SENSE_LOTOHI(true);
+    config.pull = NRF_GPIO_PIN_PULLUP;
+
+    // Start the GPIOTE driver if not already started
+    nrfx_gpiote_init();
+
+    // Add the pin as an input event
+    nrfx_err_t err =
+        nrfx_gpiote_in_init(FPGA_DONE_PIN, &config, fpga_done_pin_interrupt);
+
+    // If an error occurs, return an initialisation error
+    if (err != NRFX_SUCCESS)
+    {
+        return S1_INIT_ERROR;
+    }
+
+    // Enable the event
+    nrfx_gpiote_in_event_enable(FPGA_DONE_PIN, true);
+
+    // Set up the timer used for delays from within interrupts
+    nrfx_timer_config_t delay_timer_config = NRFX_TIMER_DEFAULT_CONFIG;
+    delay_timer_config.frequency = NRF_TIMER_FREQ_1MHz;
+    delay_timer_config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+    err = nrfx_timer_init(&delay_timer, &delay_timer_config, delay_timer_handler);
+
+    // If an error occurs, return an initialisation error
+    if (err != NRFX_SUCCESS)
+    {
+        return S1_INIT_ERROR;
+    }
+
+    // Configure the I2C
+    nrfx_twim_config_t pmic_twi_config = NRFX_TWIM_DEFAULT_CONFIG;
+    pmic_twi_config.scl = NRF_GPIO_PIN_MAP(0, 17);
+    pmic_twi_config.sda = NRF_GPIO_PIN_MAP(0, 14);
+
+    // Initialise the I2C driver in non-blocking mode
+    err = nrfx_twim_init(&i2c, &pmic_twi_config, pmic_event_handler, NULL);
+
+    // If an error occurs, return an initialisation error
+    if (err != NRFX_SUCCESS)
+    {
+        return S1_INIT_ERROR;
+    }
+
+    // Enable the bus
+    nrfx_twim_enable(&i2c);
+
+    // Anything we remember about the PMIC may be stale after a reset
+    s1_pmic_invalidate_shadow();
+
+    // Check PMIC Chip ID
+    uint8_t pmic_chip_id;
+    s1_error_t s1_err = pmic_bus_read_reg(0x14, &pmic_chip_id);
+
+    // If an error occurs, return a PMIC communication error
+    if (s1_err != S1_SUCCESS)
+    {
+        return S1_PMIC_COMMUNICATION_ERROR;
+    }
+
+    // If the chip ID is incorrect, also return a PMIC communication error
+    if (pmic_chip_id != 0x7A)
+    {
+        return S1_PMIC_COMMUNICATION_ERROR;
+    }
+
+    // Set up the SAADC for sampling the PMIC AMUX, and the ADC pins
+    err = saadc_init(NRF_SAADC_OVERSAMPLE_4X);
+
+    // If an error occurs, return an initialisation error
+    if (err != NRFX_SUCCESS)
+    {
+        return S1_INIT_ERROR;
+    }
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_get_chg_mv_ua(uint32_t *voltage_mv, uint32_t *current_ua)
+{
+    uint8_t regs[3];
+
+    // Read the charge current (0x24) through to the charge voltage (0x26)
+    s1_error_t err = pmic_read_regs(0x24, regs, sizeof(regs));
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Convert the top 6 bits of the register value to a voltage
+    *voltage_mv = (uint32_t)(regs[2] >> 2) * 25 + 3600;
+
+    // Convert the top 6 bits of the register value to a current
+    *current_ua = (uint32_t)(regs[0] >> 2) * 7500 + 7500;
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_set_chg_mv_ua(uint32_t voltage_mv, uint32_t current_ua)
+{
+    // Check if voltage is a valid range
+    if (voltage_mv < 3600 || voltage_mv > 4600)
+    {
+        return S1_PMIC_INVALID_VALUE;
+    }
+
+    // Check if the current is a valid range
+    if (current_ua < 7500 || current_ua > 300000)
+    {
+        return S1_PMIC_INVALID_VALUE;
+    }
+
+    // Set the charging voltage (shifted to be in the top 6 bits of the register)
+    uint8_t voltage_setting = (uint8_t)(((voltage_mv - 3600 + 12) / 25) << 2);
+
+    // Apply the voltage, and ensure charging is allowed
+    s1_error_t err = pmic_write_reg(0x26, voltage_setting | 0b00);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Set the charging current (shifted to be in the top 6 bits of the register)
+    uint8_t current_setting = (uint8_t)(((current_ua - 7500 + 3750) / 7500) << 2);
+
+    // Apply the current, and ensure a 3hr safety timer is set
+    err = pmic_write_reg(0x24, current_setting | 0b01);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_get_vaux_mv(uint32_t *voltage_mv)
+{
+    uint8_t regs[2];
+
+    // Read both SBB2 registers
+    s1_error_t err = pmic_read_regs(0x2D, regs, sizeof(regs));
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Check if SBB2 is enabled
+    bool vaux_en = (regs[1] & 0b110) == 0b110;
+
+    // If SBB2 is off, return 0V
+    if (vaux_en == false)
+    {
+        *voltage_mv = 0;
+        return S1_SUCCESS;
+    }
+
+    // Convert the bottom 7 bits of the register value to a voltage
+    *voltage_mv = (uint32_t)(regs[0] & 0x7F) * 50 + 800;
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_set_vaux_mv(uint32_t voltage_mv)
+{
+    // If 0V, shutdown SBB2
+    if (voltage_mv == 0)
+    {
+        // Write to the SBB2 en register
+        s1_error_t err = pmic_write_reg(0x2E, 0x0C);
+
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+
+        // Return success once complete
+        return S1_SUCCESS;
+    }
+
+    // Disallow voltage settings outside of the normal range
+    if (voltage_mv < 800 || voltage_mv > 5500)
+    {
+        return S1_PMIC_INVALID_VALUE;
+    }
+
+    // If voltage > than 3.45
+    if (voltage_mv > 3450)
+    {
+        uint8_t reg_value;
+
+        // Read the mode of SBB2
+        s1_error_t err = pmic_read_reg(0x39, &reg_value);
+
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+
+        // LDO0 must not be in LSW mode, otherwise it'll blow up the FPGA
+        if ((reg_value & 0x10) == 0x10)
+        {
+            return S1_PMIC_INVALID_VALUE;
+        }
+    }
+
+    // Set the SBB2 target voltage
+    s1_error_t err = pmic_write_reg(0x2D, (uint8_t)((voltage_mv - 800 + 25) / 50));
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Enable SBB2 as buck-boost, with 1A limit, and discharge resistor enabled
+    err = pmic_write_reg(0x2E, 0x0E);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_get_vio_mv(uint32_t *voltage_mv, bool *lsw_mode)
+{
+    // SBB2 (0x2D, 0x2E) through to LDO0 (0x38, 0x39) in one go
+    uint8_t regs[0x39 - 0x2D + 1];
+    uint8_t sbb2_a = 0x2D - 0x2D;
+    uint8_t sbb2_b = 0x2E - 0x2D;
+    uint8_t ldo0_a = 0x38 - 0x2D;
+    uint8_t ldo0_b = 0x39 - 0x2D;
+
+    s1_error_t err = pmic_read_regs(0x2D, regs, sizeof(regs));
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // If in load switch mode
+    if ((regs[ldo0_b] & 0x10) == 0x10)
+    {
+        // Set LSW mode pointer to true
+        *lsw_mode = true;
+
+        // Check if load switch mode is enabled
+        if ((regs[ldo0_b] & 0b110) == 0b110)
+        {
+            // Set voltage to true
+            *voltage_mv = 1;
+
+            // If SBB2 is disabled, notify the user
+            if ((regs[sbb2_b] & 0b110) != 0b110)
+            {
+                return S1_PMIC_VAUX_NOT_ENABLED;
+            }
+
+            // Return success
+            return S1_SUCCESS;
+        }
+
+        // Otherwise set the voltage to false
+        *voltage_mv = 0;
+
+        // Return success
+        return S1_SUCCESS;
+    }
+
+    // If in LDO mode
+    if ((regs[ldo0_b] & 0b110) == 0b110)
+    {
+        // Set LSW mode pointer to false
+        *lsw_mode = false;
+
+        // Convert the register value into a voltage (mask 7 bits)
+        *voltage_mv = (uint32_t)(regs[ldo0_a] & 0x7F) * 25 + 800;
+
+        // Convert the SBB2 register value into a voltage
+        uint32_t sbb2_voltage_mv = (uint32_t)(regs[sbb2_a] & 0x7F) * 50 + 800;
+
+        // If sbb2 voltage is too low (including the 100mV dropout)
+        if (sbb2_voltage_mv < *voltage_mv + 100)
+        {
+            // Notify the user
+            return S1_PMIC_VAUX_TOO_LOW;
+        }
+
+        // If SBB2 is disabled, notify the user
+        if ((regs[sbb2_b] & 0b110) != 0b110)
+        {
+            return S1_PMIC_VAUX_NOT_ENABLED;
+        }
+
+        // Return success once read
+        return S1_SUCCESS;
+    }
+
+    // Otherwise LDO0 is 0V
+    *voltage_mv = 0;
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_set_vio_mv(uint32_t voltage_mv, bool lsw_mode)
+{
+    uint8_t reg_value;
+
+    // Read the SBB1 register
+    s1_error_t err = pmic_read_reg(0x2C, &reg_value);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Check if fpga is powered off
+    if ((reg_value & 0b10) == 0)
+    {
+        // Prevent configuration if FPGA core rail is off
+        return S1_PMIC_VFPGA_NOT_ENABLED;
+    }
+
+    // If the lsw flag was provided
+    if (lsw_mode)
+    {
+        // Read SBB2 set voltage
+        err = pmic_read_reg(0x2D, &reg_value);
+
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+
+        // Ensure it is below the 3.45V limit of the FPGA IO
+        // reg_value = (3.45 - 0.8) / 0.05 = 53
+        if ((reg_value & 0x7F) > 53)
+        {
+            return S1_PMIC_VAUX_TOO_HIGH;
+        }
+
+        // If the voltage value is greater than 0V
+        if (voltage_mv > 0)
+        {
+            // Turn on the regulator with LSW mode with discharge enabled
+            err = pmic_write_reg(0x39, 0x1E);
+
+            // If an error occurs, return it
+            if (err != S1_SUCCESS)
+            {
+                return err;
+            }
+
+            // Return
+            return S1_SUCCESS;
+        }
+
+        // Otherwise, turn off the regulator with LSW mode with discharge enabled
+        err = pmic_write_reg(0x39, 0x1C);
+
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+
+        // Return
+        return S1_SUCCESS;
+    }
+
+    // If user requests 0V
+    if (voltage_mv == 0)
+    {
+        // Turn off the regulator, ensuring LDO mode and discharge resistor is set
+        err = pmic_write_reg(0x39, 0x0C);
+
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+
+        // Return
+        return S1_SUCCESS;
+    }
+
+    // Disallow voltage settings outside of the normal range
+    if (voltage_mv < 800 || voltage_mv > 3450)
+    {
+        return S1_PMIC_INVALID_VALUE;
+    }
+
+    // Set the output voltage
+    err = pmic_write_reg(0x38, (uint8_t)((voltage_mv - 800 + 12) / 25));
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Turn on the regulator with LDO mode set, and discharge enabled
+    err = pmic_write_reg(0x39, 0x0E);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Otherwise, check SBB2 (Vaux) set voltage
+    err = pmic_read_reg(0x2D, &reg_value);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Convert the register value into a voltage (mask 7 bits)
+    uint32_t sbb2_voltage_mv = (uint32_t)(reg_value & 0x7F) * 50 + 800;
+
+    // If sbb2 voltage is too low (including the 100mV dropout)
+    if (sbb2_voltage_mv < voltage_mv + 100)
+    {
+        // Notify the user
+        return S1_PMIC_VAUX_TOO_LOW;
+    }
+
+    // Read SBB2 active register
+    err = pmic_read_reg(0x2E, &reg_value);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // If SBB2 is disabled, notify the user
+    if ((reg_value & 0b110) != 0b110)
+    {
+        return S1_PMIC_VAUX_NOT_ENABLED;
+    }
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+/**
+ * @brief Local function for converting a voltage in volts to millivolts for the
+ *        float based PMIC functions.
+ *
+ * @param voltage: Voltage in volts.
+ *
+ * @returns The voltage rounded to the nearest millivolt. Negative, NaN, huge
+ *          and tiny non-zero voltages return UINT32_MAX, which is out of range
+ *          for every rail.
+ */
+static uint32_t pmic_volts_to_mv(float voltage)
+{
+    // Exactly 0 turns a rail off
+    if (voltage == 0.0f)
+    {
+        return 0;
+    }
+
+    // NaN fails every comparison, so check that it's within range rather than
+    // outside it. The conversion below is undefined for anything else
+    if (!(voltage > 0.0f && voltage < (float)(UINT32_MAX / 1000)))
+    {
+        return UINT32_MAX;
+    }
+
+    uint32_t mv = (uint32_t)(voltage * 1000.0f + 0.5f);
+
+    // Don't let a small voltage round down to 0, and turn the rail off
+    if (mv == 0)
+    {
+        return UINT32_MAX;
+    }
+
+    return mv;
+}
+
+s1_error_t s1_pmic_get_chg(float *voltage, float *current)
+{
+    uint32_t voltage_mv;
+    uint32_t current_ua;
+
+    s1_error_t err = s1_pmic_get_chg_mv_ua(&voltage_mv, &current_ua);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    *voltage = (float)voltage_mv / 1000.0f;
+    *current = (float)current_ua / 1000.0f;
+
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_set_chg(float voltage, float current)
+{
+    // Current is in mA, so convert it the same way as a voltage to get uA
+    return s1_pmic_set_chg_mv_ua(pmic_volts_to_mv(voltage),
+                                 pmic_volts_to_mv(current));
+}
+
+s1_error_t s1_pmic_get_vaux(float *voltage)
+{
+    uint32_t voltage_mv;
+
+    s1_error_t err = s1_pmic_get_vaux_mv(&voltage_mv);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    *voltage = (float)voltage_mv / 1000.0f;
+
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_set_vaux(float voltage)
+{
+    return s1_pmic_set_vaux_mv(pmic_volts_to_mv(voltage));
+}
+
+s1_error_t s1_pmic_get_vio(float *voltage, bool *lsw_mode)
+{
+    uint32_t voltage_mv = 0;
+    bool lsw = false;
+
+    // Vio warnings about Vaux still come with a valid voltage
+    s1_error_t err = s1_pmic_get_vio_mv(&voltage_mv, &lsw);
+
+    if (err == S1_PMIC_COMMUNICATION_ERROR)
+    {
+        return err;
+    }
+
+    // In load switch mode, 1 means on, so it's not scaled
+    *voltage = lsw ? (float)voltage_mv : (float)voltage_mv / 1000.0f;
+
+    // Like before, the mode is only reported when Vio is on, or a load switch
+    if (lsw || voltage_mv != 0)
+    {
+        *lsw_mode = lsw;
+    }
+
+    return err;
+}
+
+s1_error_t s1_pmic_set_vio(float voltage, bool lsw_mode)
+{
+    return s1_pmic_set_vio_mv(pmic_volts_to_mv(voltage), lsw_mode);
+}
+
+s1_error_t s1_pimc_get_vfpga(bool *enable)
+{
+    uint8_t reg_value;
+
+    // Read the SBB1 register
+    s1_error_t err = pmic_read_reg(0x2C, &reg_value);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Return the value. Second bit represents on or off
+    *enable = reg_value & 0b10;
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pimc_set_vfpga(bool enable)
+{
+    // Ensure SBB1 is at the set voltage, 1.2V unless it has been lowered
+    s1_error_t err = pmic_write_reg(0x2B, pmic_vfpga_setting);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // If enable
+    if (enable)
+    {
+        // Enable SBB1 as buck mode with 0.333A limit
+        err = pmic_write_reg(0x2C, 0x7E);
+
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+
+        // Return success once complete
+        return S1_SUCCESS;
+    }
+
+    // Otherwise, first disable LDO0 (Vio) to avoid damaging the FPGA
+    err = pmic_write_reg(0x39, 0x0C);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Finally, disable SBB1
+    err = pmic_write_reg(0x2C, 0x7C);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_get_vfpga_mv(uint32_t *voltage_mv)
+{
+    uint8_t reg_value;
+
+    // Read the SBB1 target voltage
+    s1_error_t err = pmic_read_reg(0x2B, &reg_value);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    // Convert the bottom 7 bits of the register value to a voltage
+    *voltage_mv = (uint32_t)(reg_value & 0x7F) * 50 + 800;
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_pmic_set_vfpga_mv(uint32_t voltage_mv)
+{
+    // Never go above the nominal core voltage, or below the characterised
+    // minimum
+    if (voltage_mv < S1_VFPGA_MIN_MV || voltage_mv > 1200)
+    {
+        return S1_PMIC_INVALID_VALUE;
+    }
+
+    // Round to the nearest 50mV step, and remember it for the next power up
+    pmic_vfpga_setting = (uint8_t)((voltage_mv - 800 + 25) / 50);
+
+    // Apply it straight away. If SBB1 is off, this takes effect when enabled
+    return pmic_write_reg(0x2B, pmic_vfpga_setting);
+}
+
+/**
+ * @brief Local function for resetting the FPGA and booting the same design
+ *        again, either from the flash or from the last configured buffer.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FPGA_BOOT_TIMEOUT if it didn't boot from the flash,
+ *          S1_FPGA_CONFIGURATION_ERROR if it didn't configure from the buffer.
+ */
+static s1_error_t fpga_reboot(void)
+{
+    s1_fpga_hold_reset();
+
+    if (fpga_last_bitstream != NULL)
+    {
+        return s1_fpga_configure_from_buffer(fpga_last_bitstream,
+                                             fpga_last_bitstream_len);
+    }
+
+    s1_fpga_boot();
+    return s1_fpga_wait_booted(FPGA_REBOOT_TIMEOUT_MS);
+}
+
+s1_error_t s1_pmic_vfpga_search(s1_fpga_self_test_t self_test,
+                                void *context,
+                                uint32_t margin_mv,
+                                uint32_t *voltage_mv)
+{
+    bool enabled;
+
+    // The FPGA has to be running to test it
+    s1_error_t err = s1_pimc_get_vfpga(&enabled);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    if (!enabled)
+    {
+        return S1_PMIC_VFPGA_NOT_ENABLED;
+    }
+
+    // Start from the nominal voltage, and step down while the test passes
+    uint32_t passed_mv = 0;
+    bool step_failed = false;
+
+    for (uint32_t test_mv = 1200; test_mv >= S1_VFPGA_MIN_MV; test_mv -= 50)
+    {
+        err = s1_pmic_set_vfpga_mv(test_mv);
+
+        // If an error occurs, go back to nominal and return it
+        if (err != S1_SUCCESS)
+        {
+            s1_pmic_set_vfpga_mv(1200);
+            return err;
+        }
+
+        // Let the buck settle before testing
+        NRFX_DELAY_US(S1_VFPGA_SETTLE_US);
+
+        if (!self_test(context))
+        {
+            step_failed = true;
+            break;
+        }
+
+        passed_mv = test_mv;
+    }
+
+    // If it doesn't even pass at nominal, there's nothing to search for
+    if (passed_mv == 0)
+    {
+        s1_pmic_set_vfpga_mv(1200);
+        return S1_FPGA_SELF_TEST_ERROR;
+    }
+
+    // Back off by the safety margin
+    uint32_t result_mv = passed_mv + margin_mv;
+    if (result_mv > 1200)
+    {
+        result_mv = 1200;
+    }
+
+    err = s1_pmic_set_vfpga_mv(result_mv);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    NRFX_DELAY_US(S1_VFPGA_SETTLE_US);
+
+    // The failing step may have upset the design, so boot it again at the
+    // chosen voltage
+    if (step_failed)
+    {
+        err = fpga_reboot();
+
+        // If an error occurs, go back to nominal and return it
+        if (err != S1_SUCCESS)
+        {
+            s1_pmic_set_vfpga_mv(1200);
+            return err;
+        }
+    }
+
+    // Make sure the design still works at the final voltage
+    if (!self_test(context))
+    {
+        s1_pmic_set_vfpga_mv(1200);
+        return S1_FPGA_SELF_TEST_ERROR;
+    }
+
+    s1_pmic_get_vfpga_mv(voltage_mv);
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+void s1_pmic_invalidate_shadow(void)
+{
+    pmic_shadow_valid = 0;
+}
+
+void s1_pmic_set_shadow_verify(bool verify)
+{
+    pmic_shadow_verify = verify;
+}
+
+void s1_pmic_get_stats(s1_pmic_stats_t *stats)
+{
+    *stats = pmic_stats;
+}
+
+s1_error_t s1_pmic_read_async(uint8_t reg, uint8_t *data, size_t len,
+                              s1_pmic_handler_t handler, void *context)
+{
+    // EasyDMA can only write to RAM
+    if (!nrfx_is_in_ram(data))
+    {
+        return S1_PMIC_INVALID_VALUE;
+    }
+
+    pmic_queue_entry_t entry = {{reg, 0}, data, len, false, handler, context};
+    s1_error_t err = pmic_queue_add(&entry);
+
+    // Only count reads which made it into the queue
+    if (err == S1_SUCCESS)
+    {
+        pmic_stats.bus_reads++;
+    }
+
+    return err;
+}
+
+s1_error_t s1_pmic_write_async(uint8_t reg, uint8_t data,
+                               s1_pmic_handler_t handler, void *context)
+{
+    pmic_queue_entry_t entry = {{reg, data}, NULL, 0, false, handler, context};
+    s1_error_t err = pmic_queue_add(&entry);
+
+    // Only count writes which made it into the queue
+    if (err == S1_SUCCESS)
+    {
+        pmic_stats.bus_writes++;
+    }
+
+    return err;
+}
+
+bool s1_pmic_is_busy(void)
+{
+    return pmic_queue_count > 0;
+}
+
+/**
+ * @brief Register write planned by s1_pmic_apply().
+ */
+typedef struct
+{
+    uint8_t reg;
+    uint8_t value;
+} pmic_write_t;
+
+/**
+ * @brief Local function for adding a write to the s1_pmic_apply() list if the
+ *        register doesn't already hold the target value.
+ *
+ * @param writes: The write list.
+ *
+ * @param count: Number of writes in the list. Incremented if one is added.
+ *
+ * @param current: Current value of the register. Updated to the target.
+ *
+ * @param target: Value the register should hold.
+ *
+ * @param reg: Address of the register.
+ */
+static void pmic_apply_add(pmic_write_t *writes, size_t *count,
+                           uint8_t *current, uint8_t target, uint8_t reg)
+{
+    if (*current == target)
+    {
+        return;
+    }
+
+    writes[*count].reg = reg;
+    writes[*count].value = target;
+    (*count)++;
+    *current = target;
+}
+
+/**
+ * @brief Progress of the write list sent by s1_pmic_apply().
+ */
+typedef struct
+{
+    pmic_write_t const *writes;
+    size_t count;
+    size_t next;
+    volatile bool done;
+    volatile s1_error_t err;
+} pmic_batch_t;
+
+/**
+ * @brief Handler for each write in an s1_pmic_apply() list. Queues the next
+ *        write straight from the interrupt, so there's no round-trip between
+ *        them. The list stops at the first error, so rails that depend on a
+ *        failed write are left alone.
+ *
+ * @param err: Result of the write.
+ *
+ * @param context: The pmic_batch_t being tracked.
+ */
+static void pmic_batch_handler(s1_error_t err, void *context)
+{
+    pmic_batch_t *batch = context;
+
+    if (err == S1_SUCCESS && batch->next < batch->count)
+    {
+        pmic_write_t const *write = &batch->writes[batch->next];
+        err = s1_pmic_write_async(write->reg, write->value,
+                                  pmic_batch_handler, batch);
+
+        // Otherwise wait for this one to complete
+        if (err == S1_SUCCESS)
+        {
+            batch->next++;
+            return;
+        }
+    }
+
+    batch->err = err;
+    batch->done = true;
+}
+
+s1_error_t s1_pmic_apply(s1_pmic_state_t const *state)
+{
+    bool vaux_on = state->vaux_mv != 0;
+    bool vio_on = state->vio_mv != 0;
+
+    // Same voltage limits as s1_pmic_set_vaux() and s1_pmic_set_vio()
+    if (vaux_on && (state->vaux_mv < 800 || state->vaux_mv > 5500))
+    {
+        return S1_PMIC_INVALID_VALUE;
+    }
+
+    if (vio_on && !state->vio_lsw_mode &&
+        (state->vio_mv < 800 || state->vio_mv > 3450))
+    {
+        return S1_PMIC_INVALID_VALUE;
+    }
+
+    // Vio can't be powered without the FPGA core rail
+    if (vio_on && !state->vfpga_enable)
+    {
+        return S1_PMIC_VFPGA_NOT_ENABLED;
+    }
+
+    // Vio is fed from Vaux, so it needs to be on, and high enough for the LDO
+    if (vio_on && !vaux_on)
+    {
+        return S1_PMIC_VAUX_NOT_ENABLED;
+    }
+
+    if (vio_on && !state->vio_lsw_mode &&
+        state->vaux_mv < state->vio_mv + 100)
+    {
+        return S1_PMIC_VAUX_TOO_LOW;
+    }
+
+    // The writes are waited on, which needs the PMIC interrupts to run
+    if (pmic_wait_would_block())
+    {
+        return S1_BLOCKED_IN_INTERRUPT;
+    }
+
+    // SBB1 (0x2B) through to LDO0 (0x39), from the shadow if possible
+    uint8_t regs[0x39 - 0x2B + 1];
+    s1_error_t err = pmic_read_regs(0x2B, regs, sizeof(regs));
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
+    {
+        return err;
+    }
+
+    uint8_t *sbb1_a = &regs[0x2B - 0x2B];
+    uint8_t *sbb1_b = &regs[0x2C - 0x2B];
+    uint8_t *sbb2_a = &regs[0x2D - 0x2B];
+    uint8_t *sbb2_b = &regs[0x2E - 0x2B];
+    uint8_t *ldo0_a = &regs[0x38 - 0x2B];
+    uint8_t *ldo0_b = &regs[0x39 - 0x2B];
+
+    // Work out the target register values, keeping voltages of disabled rails
+    uint8_t sbb2_a_target = vaux_on
+                                ? (uint8_t)((state->vaux_mv - 800 + 25) / 50)
+                                : *sbb2_a;
+    uint8_t sbb2_b_target = vaux_on ? 0x0E : 0x0C;
+    uint8_t ldo0_a_target = vio_on && !state->vio_lsw_mode
+                                ? (uint8_t)((state->vio_mv - 800 + 12) / 25)
+                                : *ldo0_a;
+    uint8_t ldo0_b_target = (uint8_t)((state->vio_lsw_mode ? 0x1C : 0x0C) |
+                                      (vio_on ? 0x02 : 0x00));
+
+    // The load switch passes Vaux straight to the FPGA IO, which is limited to
+    // 3.45V. reg_value = (3.45 - 0.8) / 0.05 = 53
+    if (state->vio_lsw_mode && (sbb2_a_target & 0x7F) > 53)
+    {
+        return S1_PMIC_VAUX_TOO_HIGH;
+    }
 
-    // Initiate the transfer
-    nrfx_err_t err = nrfx_twim_xfer(&i2c, &i2c_xfer, 0);
+    // Build the ordered write list. Rails come down from the IO inwards, and go
+    // up from the core outwards
+    pmic_write_t writes[8];
+    size_t write_count = 0;
 
-    // Wait until the transfer is complete
-    while (nrfx_twim_is_busy(&i2c))
+    // Turn Vio off first if it's going off, or if it's changing mode while on.
+    // Otherwise a higher Vaux could briefly reach the FPGA IO
+    bool vio_was_on = (*ldo0_b & 0b110) == 0b110;
+    bool mode_changes = (*ldo0_b & 0x10) != (ldo0_b_target & 0x10);
+    if (vio_was_on && (!vio_on || mode_changes))
     {
+        pmic_apply_add(writes, &write_count, ldo0_b, (uint8_t)(*ldo0_b & ~0x02), 0x39);
     }
 
-    // If an error occurs, try again after 100us. This can be needed if the
-    // PMIC is under load, and the power fluctuates
-    if (err != NRFX_SUCCESS)
+    // The FPGA core rail goes off once Vio is off, or on before anything else
+    if (state->vfpga_enable)
     {
-        NRFX_DELAY_US(100);
-        err = nrfx_twim_xfer(&i2c, &i2c_xfer, 0);
+        pmic_apply_add(writes, &write_count, sbb1_a, pmic_vfpga_setting, 0x2B);
+    }
+    pmic_apply_add(writes, &write_count, sbb1_b, state->vfpga_enable ? 0x7E : 0x7C, 0x2C);
 
-        // Wait until the transfer is complete
-        while (nrfx_twim_is_busy(&i2c))
-        {
-        }
+    // Then Vaux, and finally Vio
+    pmic_apply_add(writes, &write_count, sbb2_a, sbb2_a_target, 0x2D);
+    pmic_apply_add(writes, &write_count, sbb2_b, sbb2_b_target, 0x2E);
+    pmic_apply_add(writes, &write_count, ldo0_a, ldo0_a_target, 0x38);
+    pmic_apply_add(writes, &write_count, ldo0_b, ldo0_b_target, 0x39);
 
-        // If another error occurs, return a communication error
-        if (err != NRFX_SUCCESS)
-        {
-            return S1_PMIC_COMMUNICATION_ERROR;
-        }
+    // Nothing to do if the rails are already in this state
+    if (write_count == 0)
+    {
+        return S1_SUCCESS;
     }
 
-    // If transfer was okay, return success
-    return S1_SUCCESS;
-}
+    // Queue the first write. Each one queues the next as it completes
+    pmic_batch_t batch = {writes, write_count, 1, false, S1_SUCCESS};
 
-/**
- * @brief Local function for writing a register of the PMIC. Should not be
- *        directly accessed, instead use the relevant s1_pmic_...() functions
- *        to write data.
- *
- * @param reg: Address of the 8bit register that should be written to.
- *
- * @param data: Value which should be written in the register.
- *
- * @returns S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC did
- *          not respond.
- */
-static s1_error_t pmic_write_reg(uint8_t reg, uint8_t data)
-{
-    // Create a two byte buffer with the register and value
-    uint8_t buffer[2] = {reg, data};
+    // The queue may be full of other transfers, so retry until it fits
+    while (s1_pmic_write_async(writes[0].reg, writes[0].value,
+                               pmic_batch_handler, &batch) != S1_SUCCESS)
+    {
+    }
 
-    // Transfer descriptor configured for a 2 byte write
-    nrfx_twim_xfer_desc_t i2c_xfer =
-        NRFX_TWIM_XFER_DESC_TX(0x48, buffer, 2);
+    while (!batch.done)
+    {
+    }
 
-    // Initiate the transfer
-    nrfx_err_t err = nrfx_twim_xfer(&i2c, &i2c_xfer, 0);
+    // Return the first error, or success once complete
+    return batch.err;
+}
 
-    // Wait until the transfer is complete
-    while (nrfx_twim_is_busy(&i2c))
+s1_error_t s1_telemetry_start(uint32_t period_ms, s1_telemetry_handler_t handler)
+{
+    // Create the timer the first time
+    if (!telemetry_timer_created)
     {
+        if (app_timer_create(&telemetry_timer, APP_TIMER_MODE_REPEATED,
+                             telemetry_timer_handler) != NRF_SUCCESS)
+        {
+            return S1_INIT_ERROR;
+        }
+
+        telemetry_timer_created = true;
     }
 
-    // If an error occurs, return a communication error
-    if (err != NRFX_SUCCESS)
+    telemetry_handler = handler;
+
+    // Restart the timer in case the period changed
+    app_timer_stop(telemetry_timer);
+    if (app_timer_start(telemetry_timer, APP_TIMER_TICKS(period_ms), NULL) !=
+        NRF_SUCCESS)
     {
-        return S1_PMIC_COMMUNICATION_ERROR;
+        return S1_INIT_ERROR;
     }
 
-    // If transfer was okay, return success
+    // Return success once complete
     return S1_SUCCESS;
 }
 
-/**
- * @brief Performs a transfer on the SPI bus to the flash or FPGA.
- *
- * @param tx_buffer: A pointer to where the transmit data is stored.
- *
- * @param tx_len: Length of the transmit data buffer in bytes. i.e how many
- *                bytes to write.
- *
- * @param rx_buffer: A pointer to to where the receive data will be stored.
- *
- * @param rx_len: Length of the receive buffer in bytes. i.e how many bytes to
- *                read.
- *
- * @param sel_fpga: If true, selects the FPGA. If false, selects the flash.
- *
- * @returns S1_SUCCESS if okay,
- *          S1_FLASH_FPGA_COMMUNICATION_ERROR if spi bus is busy, or the buffers
- *          are not within the ram region. i.e not writable.
- */
-static s1_error_t spi_tx_rx(uint8_t *tx_buffer, size_t tx_len,
-                            uint8_t *rx_buffer, size_t rx_len, bool sel_fpga)
+void s1_telemetry_stop(void)
 {
-    // SPI hardware configuration
-    nrfx_spim_config_t spi_config = NRFX_SPIM_DEFAULT_CONFIG;
-    spi_config.mosi_pin = SPI_SO_PIN;
-    spi_config.miso_pin = SPI_SI_PIN;
-    spi_config.sck_pin = SPI_CLK_PIN;
-    spi_config.ss_pin = SPI_CS_PIN;
-
-    // If selecting the FPGA, invert the chip select line
-    if (sel_fpga)
+    if (telemetry_timer_created)
     {
-        spi_config.ss_active_high = true;
+        app_timer_stop(telemetry_timer);
     }
+}
+
+void s1_telemetry_get(s1_telemetry_t *telemetry)
+{
+    NRFX_CRITICAL_SECTION_ENTER();
+    *telemetry = telemetry_latest;
+    NRFX_CRITICAL_SECTION_EXIT();
+}
 
-    // Initialise the SPI if it was not already
-    nrfx_spim_init(&spi, &spi_config, NULL, NULL);
+s1_error_t s1_telemetry_sample(s1_telemetry_t *telemetry)
+{
+    // Let any periodic round finish first
+    while (telemetry_busy)
+    {
+    }
 
-    // Transfer descriptor for how many bytes to read and write
-    nrfx_spim_xfer_desc_t spi_xfer = NRFX_SPIM_XFER_TRX(tx_buffer, tx_len,
-                                                        rx_buffer, rx_len);
+    uint32_t rounds = telemetry_rounds;
+    telemetry_start_round();
 
-    // Initiate the transfer
-    nrfx_err_t err = nrfx_spim_xfer(&spi, &spi_xfer, 0);
+    // Wait until the round either completes, or gives up
+    while (telemetry_busy)
+    {
+    }
 
-    // If an error occurs, return a flash error
-    if (err != NRFX_SUCCESS)
+    // If the round gave up, return why
+    if (telemetry_rounds == rounds)
     {
-        return S1_FLASH_FPGA_COMMUNICATION_ERROR;
+        return telemetry_round_err;
     }
 
-    // If transfer was okay, return success
+    s1_telemetry_get(telemetry);
+
+    // Return success once complete
     return S1_SUCCESS;
 }
 
-/**
- * @brief Interrupt routine for when the FPGA configuration is complete, and the
- *        CDONE pin goes high.
- *
- * @param pin: Pin that caused the trigger.
- *
- * @param action: The polarity of the interrupt trigger.
- */
-static void fpga_done_pin_interrupt(nrfx_gpiote_pin_t pin,
-                                    nrf_gpiote_polarity_t action)
+s1_error_t s1_adc_stream_start(s1_adc_stream_config_t const *config)
 {
-    if (pin == FPGA_DONE_PIN && action == NRF_GPIOTE_POLARITY_LOTOHI)
+    // Only one stream can run at a time
+    if (adc_stream_active)
     {
-        fpga_done_flag_pending = true;
+        return S1_INIT_ERROR;
     }
-}
 
-s1_error_t s1_init(void)
-{
-    // Configure FPGA reset pin as an output. A low signal holds FPGA in reset
-    nrf_gpio_cfg_output(FPGA_RESET_PIN);
+    size_t channels = (config->adc1 ? 1u : 0u) + (config->adc2 ? 1u : 0u);
 
-    // Set up done pin as an interrupt. It goes high when the FPGA is loaded
-    nrfx_gpiote_in_config_t config = NRFX_GPIOTE_CONFIG_IN_SENSE_LOTOHI(true);
-    config.pull = NRF_GPIO_PIN_PULLUP;
+    // Check there's something to sample, and somewhere to put it
+    if (channels == 0 || config->handler == NULL || config->buffers == NULL)
+    {
+        return S1_ADC_INVALID_VALUE;
+    }
 
-    // Start the GPIOTE driver if not already started
-    nrfx_gpiote_init();
+    // Each block must hold whole scans, and the free blocks fit in a bitmask
+    if (config->block_len == 0 ||
+        config->block_len > ADC_STREAM_MAX_BLOCK_LEN ||
+        config->block_len % channels != 0 ||
+        config->block_count < 2 ||
+        config->block_count > 32)
+    {
+        return S1_ADC_INVALID_VALUE;
+    }
 
-    // Add the pin as an input event
-    nrfx_err_t err =
-        nrfx_gpiote_in_init(FPGA_DONE_PIN, &config, fpga_done_pin_interrupt);
+    // Every channel must be converted before the next sample is triggered
+    if (config->sample_rate_hz == 0 ||
+        config->sample_rate_hz >
+            1000000 / (ADC_STREAM_CONVERSION_US * channels))
+    {
+        return S1_ADC_INVALID_VALUE;
+    }
+
+    // Set up the timer to fire once per sample, and clear itself
+    nrfx_timer_config_t timer_config = NRFX_TIMER_DEFAULT_CONFIG;
+    timer_config.frequency = NRF_TIMER_FREQ_16MHz;
+    timer_config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+
+    nrfx_err_t err = nrfx_timer_init(&adc_stream_timer,
+                                     &timer_config,
+                                     adc_stream_timer_handler);
 
     // If an error occurs, return an initialisation error
     if (err != NRFX_SUCCESS)
@@ -234,69 +3551,180 @@ s1_error_t s1_init(void)
         return S1_INIT_ERROR;
     }
 
-    // Enable the event
-    nrfx_gpiote_in_event_enable(FPGA_DONE_PIN, true);
-
-    // Configure the I2C
-    nrfx_twim_config_t pmic_twi_config = NRFX_TWIM_DEFAULT_CONFIG;
-    pmic_twi_config.scl = NRF_GPIO_PIN_MAP(0, 17);
-    pmic_twi_config.sda = NRF_GPIO_PIN_MAP(0, 14);
+    nrfx_timer_extended_compare(&adc_stream_timer,
+                                NRF_TIMER_CC_CHANNEL0,
+                                16000000 / config->sample_rate_hz,
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK,
+                                false);
 
-    // Initialise the I2C driver
-    err = nrfx_twim_init(&i2c, &pmic_twi_config, NULL, NULL);
+    // Connect the timer to the SAADC sample task
+    err = nrfx_ppi_channel_alloc(&adc_stream_ppi_channel);
 
     // If an error occurs, return an initialisation error
     if (err != NRFX_SUCCESS)
     {
+        nrfx_timer_uninit(&adc_stream_timer);
         return S1_INIT_ERROR;
     }
 
-    // Enable the bus
-    nrfx_twim_enable(&i2c);
+    nrfx_ppi_channel_assign(
+        adc_stream_ppi_channel,
+        nrfx_timer_compare_event_address_get(&adc_stream_timer,
+                                             NRF_TIMER_CC_CHANNEL0),
+        nrfx_saadc_sample_task_get());
 
-    // Check PMIC Chip ID
-    uint8_t pmic_chip_id;
-    s1_error_t s1_err = pmic_read_reg(0x14, &pmic_chip_id);
+    adc_stream_config = *config;
+    adc_stream_free_blocks = UINT32_MAX >> (32 - config->block_count);
+    adc_stream_queued_blocks = 0;
+    adc_stream_overruns = 0;
 
-    // If an error occurs, return a PMIC communication error
-    if (s1_err != S1_SUCCESS)
+    // Keep telemetry off the SAADC from here on, and let any conversion it
+    // already started finish
+    adc_stream_active = true;
+
+    while (telemetry_converting)
     {
-        return S1_PMIC_COMMUNICATION_ERROR;
     }
 
-    // If the chip ID is incorrect, also return a PMIC communication error
-    if (pmic_chip_id != 0x7A)
+    // Restart the SAADC without oversampling, and add the ADC pins
+    nrfx_saadc_uninit();
+    err = saadc_init(NRF_SAADC_OVERSAMPLE_DISABLED);
+
+    if (err == NRFX_SUCCESS && config->adc1)
     {
-        return S1_PMIC_COMMUNICATION_ERROR;
+        nrf_saadc_channel_config_t channel_config =
+            NRFX_SAADC_DEFAULT_CHANNEL_CONFIG_SE(ADC1_PIN);
+
+        err = nrfx_saadc_channel_init(ADC1_CHANNEL, &channel_config);
+    }
+
+    if (err == NRFX_SUCCESS && config->adc2)
+    {
+        nrf_saadc_channel_config_t channel_config =
+            NRFX_SAADC_DEFAULT_CHANNEL_CONFIG_SE(ADC2_PIN);
+
+        err = nrfx_saadc_channel_init(ADC2_CHANNEL, &channel_config);
+    }
+
+    // Give the SAADC its first two blocks
+    NRFX_CRITICAL_SECTION_ENTER();
+
+    if (err == NRFX_SUCCESS)
+    {
+        adc_stream_queue_blocks();
+    }
+
+    NRFX_CRITICAL_SECTION_EXIT();
+
+    // If an error occurs, undo everything and return an initialisation error
+    if (err != NRFX_SUCCESS || adc_stream_queued_blocks != 2)
+    {
+        s1_adc_stream_stop();
+        return S1_INIT_ERROR;
     }
 
-    // TODO setup analog pins here
+    // Start sampling
+    adc_stream_running = true;
+    nrfx_ppi_channel_enable(adc_stream_ppi_channel);
+    nrfx_timer_enable(&adc_stream_timer);
 
     // Return success once complete
     return S1_SUCCESS;
 }
 
-s1_error_t s1_pmic_get_chg(float *voltage, float *current)
+void s1_adc_stream_release(int16_t const *block)
 {
-    uint8_t reg_value;
+    NRFX_CRITICAL_SECTION_ENTER();
 
-    // Read the charge voltage register
-    s1_error_t err = pmic_read_reg(0x26, &reg_value);
+    if (adc_stream_running)
+    {
+        adc_stream_free_block(block);
+    }
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+    NRFX_CRITICAL_SECTION_EXIT();
+}
+
+uint32_t s1_adc_stream_get_overruns(void)
+{
+    return adc_stream_overruns;
+}
+
+void s1_adc_stream_stop(void)
+{
+    if (!adc_stream_active)
     {
-        return err;
+        return;
+    }
+
+    // Stop triggering samples
+    adc_stream_running = false;
+    nrfx_timer_disable(&adc_stream_timer);
+    nrfx_ppi_channel_disable(adc_stream_ppi_channel);
+    nrfx_ppi_channel_free(adc_stream_ppi_channel);
+    nrfx_timer_uninit(&adc_stream_timer);
+
+    // Drop the queued blocks, and go back to the oversampled configuration
+    nrfx_saadc_uninit();
+    adc_stream_queued_blocks = 0;
+    adc_stream_free_blocks = 0;
+    (void)saadc_init(NRF_SAADC_OVERSAMPLE_4X);
+
+    // Telemetry can use the SAADC again
+    adc_stream_active = false;
+}
+
+s1_error_t s1_adc_fpga_start(s1_adc_stream_config_t const *config)
+{
+    // Each block is sent as a single SPI transfer
+    if (config->block_len * sizeof(int16_t) > SPI_MAX_XFER_LEN)
+    {
+        return S1_ADC_INVALID_VALUE;
+    }
+
+    // Open the bus now, rather than from the first block's interrupt
+    if (!spi_session_open)
+    {
+        if (s1_spi_open() != S1_SUCCESS)
+        {
+            return S1_INIT_ERROR;
+        }
     }
 
-    // Shift down to get only the top 6 bits
-    reg_value = reg_value >> 2;
+    adc_fpga_blocks_sent = 0;
+    adc_fpga_blocks_dropped = 0;
+
+    // Run the stream with the blocks going to the FPGA
+    s1_adc_stream_config_t stream_config = *config;
+    stream_config.handler = adc_fpga_block_handler;
+    stream_config.context = NULL;
+
+    return s1_adc_stream_start(&stream_config);
+}
+
+void s1_adc_fpga_get_stats(s1_adc_fpga_stats_t *stats)
+{
+    stats->blocks_sent = adc_fpga_blocks_sent;
+    stats->blocks_dropped = adc_fpga_blocks_dropped;
+    stats->adc_overruns = s1_adc_stream_get_overruns();
+}
+
+void s1_adc_fpga_stop(void)
+{
+    s1_adc_stream_stop();
+
+    // Blocks already queued on the bus still point into the buffers
+    while (s1_spi_is_busy())
+    {
+    }
+}
 
-    // Convert the register value to a voltage
-    *voltage = (reg_value * 0.025f) + 3.6f;
+s1_error_t s1_pmic_snapshot(s1_pmic_snapshot_t *snapshot)
+{
+    uint8_t regs[PMIC_SHADOW_LAST - PMIC_SHADOW_FIRST + 1];
 
-    // Read the charge current register
-    err = pmic_read_reg(0x24, &reg_value);
+    // Read every configuration register in one burst. This refreshes the
+    // whole shadow with what the PMIC really holds
+    s1_error_t err = pmic_bus_read_regs(PMIC_SHADOW_FIRST, regs, sizeof(regs));
 
     // If an error occurs, return it
     if (err != S1_SUCCESS)
@@ -304,107 +3732,194 @@ s1_error_t s1_pmic_get_chg(float *voltage, float *current)
         return err;
     }
 
-    // Shift down to get only the top 6 bits
-    reg_value = reg_value >> 2;
+    // Load switch mode is only reported when LDO0 is on
+    snapshot->vio_lsw_mode = false;
 
-    // Convert the register value to a current (mA)
-    *current = (reg_value * 7.5f) + 7.5f;
+    // The getters are now all served from the shadow. Vio warnings about Vaux
+    // are still reflected in the returned values, so they're not errors here
+    s1_pmic_get_chg_mv_ua(&snapshot->chg_mv, &snapshot->chg_ua);
+    s1_pmic_get_vaux_mv(&snapshot->vaux_mv);
+    s1_pmic_get_vio_mv(&snapshot->vio_mv, &snapshot->vio_lsw_mode);
+    s1_pimc_get_vfpga(&snapshot->vfpga_enable);
 
     // Return success once complete
     return S1_SUCCESS;
 }
 
-s1_error_t s1_pmic_set_chg(float voltage, float current)
+s1_error_t s1_spi_open(void)
 {
-    // Check if voltage is a valid range
-    if (voltage < 3.6f || voltage > 4.6f)
+    // Nothing to do if the session is already open
+    if (spi_session_open)
     {
-        return S1_PMIC_INVALID_VALUE;
+        return S1_SUCCESS;
     }
 
-    // Check if the current is a valid range
-    if (current < 7.5f || current > 300.0f)
+    // Normal layout where the nRF is the controller of the flash and FPGA
+    return spi_session_start(SPI_SO_PIN, SPI_SI_PIN, NRF_SPIM_MODE_0);
+}
+
+void s1_spi_select(s1_spi_target_t target)
+{
+    spi_target = target;
+
+    // Drive the idle level for the new polarity
+    if (spi_session_open)
     {
-        return S1_PMIC_INVALID_VALUE;
+        spi_cs_set(false);
     }
+}
 
-    // Set the charging voltage (shifted to be in the top 6 bits of the register)
-    uint8_t voltage_setting = (uint8_t)round((voltage - 3.6f) / 0.025f) << 2;
+s1_error_t s1_spi_queue(s1_spi_xfer_t const *xfers, size_t count,
+                        s1_spi_handler_t handler, void *context)
+{
+    // The chip select must be free for whatever is queued next
+    if (count > 0 && xfers[count - 1].cs_hold)
+    {
+        return S1_FLASH_FPGA_COMMUNICATION_ERROR;
+    }
 
-    // Apply the voltage, and ensure charging is allowed
-    s1_error_t err = pmic_write_reg(0x26, voltage_setting | 0b00);
+    return spi_queue_add(xfers, count, handler, context, false);
+}
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+bool s1_spi_is_busy(void)
+{
+    return spi_queue_count > 0;
+}
+
+void s1_spi_close(void)
+{
+    // Wait for any queued transfers to finish
+    while (s1_spi_is_busy())
     {
-        return err;
     }
 
-    // Set the charging current (shifted to be in the top 6 bits of the register)
-    uint8_t current_setting = (uint8_t)round((current - 7.5f) / 7.5f) << 2;
+    // Release SPI
+    if (spi_session_open)
+    {
+        nrfx_spim_uninit(&spi);
+        spi_session_open = false;
+    }
 
-    // Apply the current, and ensure a 3hr safety timer is set
-    err = pmic_write_reg(0x24, current_setting | 0b01);
+    // Set the SPI pins as inputs
+    // CS needs a pullup
+    nrf_gpio_cfg_input(SPI_CS_PIN, NRF_GPIO_PIN_PULLUP);
+    nrf_gpio_cfg_input(SPI_CLK_PIN, NRF_GPIO_PIN_NOPULL);
+    nrf_gpio_cfg_input(SPI_SI_PIN, NRF_GPIO_PIN_NOPULL);
+    nrf_gpio_cfg_input(SPI_SO_PIN, NRF_GPIO_PIN_NOPULL);
+}
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+s1_error_t s1_flash_wakeup(void)
+{
+    // Wake up the flash
+    uint8_t wake_seq[4] = {0xAB, 0, 0, 0};
+    uint8_t wake_res[5] = {0};
+    spi_tx_rx((uint8_t *)&wake_seq, 4, (uint8_t *)&wake_res, 5, S1_SPI_FLASH);
+    NRFX_DELAY_US(3); // tRES1 required to come out of sleep
+
+    // Reset sequence has to happen as two transfers
+    uint8_t reset_seq[2] = {0x66, 0x99};
+    s1_spi_xfer_t reset_xfers[2] = {
+        {&reset_seq[0], 1, NULL, 0, S1_SPI_FLASH, false},
+        {&reset_seq[1], 1, NULL, 0, S1_SPI_FLASH, false},
+    };
+    spi_queue_wait(reset_xfers, 2);
+    NRFX_DELAY_US(30); // tRST to fully reset
+
+    // Check if the capacity ID corresponds to 32M
+    uint8_t cap_id_reg[1] = {0x9F};
+    uint8_t cap_id_res[4] = {0};
+    spi_tx_rx((uint8_t *)&cap_id_reg, 1, (uint8_t *)&cap_id_res, 4, S1_SPI_FLASH);
+
+    if (cap_id_res[3] != 0x16)
+    {
+        return S1_FLASH_ERROR;
+    }
+
+    return S1_SUCCESS;
+}
+
+void s1_flash_erase_all(void)
+{
+    // Issue erase sequence
+    uint8_t erase_seq[2] = {0x06, 0x60};
+    s1_spi_xfer_t erase_xfers[2] = {
+        {&erase_seq[0], 1, NULL, 0, S1_SPI_FLASH, false},
+        {&erase_seq[1], 1, NULL, 0, S1_SPI_FLASH, false},
+    };
+    spi_queue_wait(erase_xfers, 2);
+}
+
+s1_error_t s1_flash_erase(uint32_t address, uint32_t size)
+{
+    uint8_t opcode;
+
+    switch (size)
+    {
+    case FLASH_SECTOR_SIZE:
+        opcode = 0x20;
+        break;
+
+    case FLASH_HALF_BLOCK_SIZE:
+        opcode = 0x52;
+        break;
+
+    case FLASH_BLOCK_SIZE:
+        opcode = 0xD8;
+        break;
+
+    default:
+        return S1_FLASH_INVALID_VALUE;
+    }
+
+    // The erase must be within the flash, and aligned to its own size
+    if (address >= FLASH_SIZE || address % size != 0)
     {
-        return err;
+        return S1_FLASH_INVALID_VALUE;
     }
 
-    // Return success once complete
-    return S1_SUCCESS;
+    // Return success once started
+    return flash_erase(opcode, address);
 }
 
-s1_error_t s1_pmic_get_vaux(float *voltage)
+size_t s1_flash_erase_plan(uint32_t address, size_t len,
+                           s1_flash_erase_t *plan, size_t plan_len)
 {
-    uint8_t reg_value;
-
-    // Read the SBB2 register
-    s1_error_t err = pmic_read_reg(0x2E, &reg_value);
+    uint32_t end = flash_erase_bounds(&address, len);
+    size_t count = 0;
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+    // Largest aligned erase first. This gives the fewest erases without
+    // touching any sector outside of the range
+    while (address < end)
     {
-        return err;
-    }
+        uint32_t size = flash_erase_size(address, end);
 
-    // Check if SBB2 is enabled
-    bool vaux_en = (reg_value & 0b110) == 0b110;
+        if (count < plan_len)
+        {
+            plan[count].address = address;
+            plan[count].size = size;
+        }
 
-    // If SBB2 is off, return 0V
-    if (vaux_en == false)
-    {
-        *voltage = 0.0f;
-        return S1_SUCCESS;
+        address += size;
+        count++;
     }
 
-    // Otherwise read the current set value
-    err = pmic_read_reg(0x2D, &reg_value);
+    return count;
+}
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+s1_error_t s1_flash_erase_range(uint32_t address, size_t len)
+{
+    // The range must fit within the flash
+    if (address > FLASH_SIZE || len > FLASH_SIZE - address)
     {
-        return err;
+        return S1_FLASH_INVALID_VALUE;
     }
 
-    // We only need the bottom 7 bits
-    reg_value = reg_value & 0x7F;
-
-    // Convert the register value to a voltage
-    *voltage = (reg_value * 0.05f) + 0.8f;
+    uint32_t end = flash_erase_bounds(&address, len);
 
-    // Return success once complete
-    return S1_SUCCESS;
-}
-
-s1_error_t s1_pmic_set_vaux(float voltage)
-{
-    // If 0V, shutdown SBB2
-    if (voltage == 0.0f)
+    while (address < end)
     {
-        // Write to the SBB2 en register
-        s1_error_t err = pmic_write_reg(0x2E, 0x0C);
+        uint32_t size = flash_erase_size(address, end);
+        s1_error_t err = s1_flash_erase(address, size);
 
         // If an error occurs, return it
         if (err != S1_SUCCESS)
@@ -412,23 +3927,80 @@ s1_error_t s1_pmic_set_vaux(float voltage)
             return err;
         }
 
-        // Return success once complete
-        return S1_SUCCESS;
+        address += size;
+
+        // Wait until the erase is complete
+        while (s1_flash_is_busy())
+        {
+        }
     }
 
-    // Disallow voltage settings outside of the normal range
-    if (voltage < 0.8f || voltage > 5.5f)
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+bool s1_flash_is_busy(void)
+{
+    // Read status register
+    uint8_t status_reg[1] = {0x05};
+    uint8_t status_res[2] = {0};
+    spi_tx_rx((uint8_t *)&status_reg, 1, (uint8_t *)&status_res, 2, S1_SPI_FLASH);
+
+    if (!(status_res[1] & 0x01))
     {
-        return S1_PMIC_INVALID_VALUE;
+        return false;
     }
 
-    // If voltage > than 3.45
-    if (voltage > 3.45f)
+    return true;
+}
+
+void s1_flash_page_from_image(uint32_t offset,
+                              unsigned char *image)
+{
+    PROFILE_FUNCTION(S1_PROFILE_FLASH_PAGE_FROM_IMAGE);
+
+    uint8_t wren[1] = {0x06};
+    uint8_t tx[4 + FLASH_PAGE_SIZE];
+
+    // Copy page from image
+    size_t tx_len = flash_stage_page(tx, offset, image + offset, FLASH_PAGE_SIZE);
+
+    // Disable write protection, and then transfer the page
+    s1_spi_xfer_t page_xfers[2] = {
+        {wren, 1, NULL, 0, S1_SPI_FLASH, false},
+        {tx, tx_len, NULL, 0, S1_SPI_FLASH, false},
+    };
+    spi_queue_wait(page_xfers, 2);
+}
+
+void s1_flash_set_benchmark_handler(s1_flash_benchmark_handler_t handler)
+{
+    flash_benchmark_handler = handler;
+}
+
+s1_error_t s1_flash_program(uint32_t address, unsigned char const *image,
+                            size_t len)
+{
+    // The image must start on a sector, and fit within the flash
+    if (address % FLASH_SECTOR_SIZE != 0 ||
+        address > FLASH_SIZE ||
+        len > FLASH_SIZE - address)
     {
-        uint8_t reg_value;
+        return S1_FLASH_INVALID_VALUE;
+    }
 
-        // Read the mode of SBB2
-        s1_error_t err = pmic_read_reg(0x39, &reg_value);
+    cycle_counter_start();
+    uint32_t last_cycles = DWT->CYCCNT;
+    uint64_t total_cycles = 0;
+
+    // Erase only the area covered by the image, so erase time follows the
+    // image size rather than the flash size
+    uint32_t erase_address = address;
+    uint32_t end = flash_erase_bounds(&erase_address, len);
+    while (erase_address < end)
+    {
+        uint32_t size = flash_erase_size(erase_address, end);
+        s1_error_t err = s1_flash_erase(erase_address, size);
 
         // If an error occurs, return it
         if (err != S1_SUCCESS)
@@ -436,15 +4008,18 @@ s1_error_t s1_pmic_set_vaux(float voltage)
             return err;
         }
 
-        // LDO0 must not be in LSW mode, otherwise it'll blow up the FPGA
-        if ((reg_value & 0x10) == 0x10)
+        erase_address += size;
+
+        while (s1_flash_is_busy())
         {
-            return S1_PMIC_INVALID_VALUE;
         }
+
+        cycle_counter_lap(&last_cycles, &total_cycles);
     }
 
-    // Set the SBB2 target voltage
-    s1_error_t err = pmic_write_reg(0x2D, (uint8_t)round((voltage - 0.8f) / 0.05f));
+    // Program the image
+    s1_error_t err = flash_program_range(address, image, 0, (uint32_t)len,
+                                         &last_cycles, &total_cycles);
 
     // If an error occurs, return it
     if (err != S1_SUCCESS)
@@ -452,78 +4027,58 @@ s1_error_t s1_pmic_set_vaux(float voltage)
         return err;
     }
 
-    // Enable SBB2 as buck-boost, with 1A limit, and discharge resistor enabled
-    err = pmic_write_reg(0x2E, 0x0E);
-
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+    // Report the throughput of the whole erase and program cycle
+    if (flash_benchmark_handler != NULL && total_cycles > 0)
     {
-        return err;
+        uint32_t bytes_per_second =
+            (uint32_t)(((uint64_t)len * SystemCoreClock) / total_cycles);
+        flash_benchmark_handler(len, bytes_per_second);
     }
 
     // Return success once complete
     return S1_SUCCESS;
 }
 
-s1_error_t s1_pmic_get_vio(float *voltage, bool *lsw_mode)
+s1_error_t s1_flash_program_image(unsigned char const *image, size_t len)
 {
-    uint8_t reg_value;
+    PROFILE_FUNCTION(S1_PROFILE_FLASH_PROGRAM_IMAGE);
 
-    // Read the LSW/LDO mode
-    s1_error_t err = pmic_read_reg(0x39, &reg_value);
+    return s1_flash_program(0, image, len);
+}
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+s1_error_t s1_flash_update(uint32_t address, unsigned char const *image,
+                           size_t len, s1_flash_update_stats_t *stats)
+{
+    // The image must start on a sector, and fit within the flash
+    if (address % FLASH_SECTOR_SIZE != 0 ||
+        address > FLASH_SIZE ||
+        len > FLASH_SIZE - address)
     {
-        return err;
+        return S1_FLASH_INVALID_VALUE;
     }
 
-    // If in load switch mode
-    if ((reg_value & 0x10) == 0x10)
-    {
-        // Set LSW mode pointer to true
-        *lsw_mode = true;
-
-        // Check if load switch mode is enabled
-        if ((reg_value & 0b110) == 0b110)
-        {
-            // Set voltage to true
-            *voltage = 1.0f;
-
-            // Read SBB2 active register
-            err = pmic_read_reg(0x2E, &reg_value);
-
-            // If an error occurs, return it
-            if (err != S1_SUCCESS)
-            {
-                return err;
-            }
+    cycle_counter_start();
+    uint32_t last_cycles = DWT->CYCCNT;
+    uint64_t total_cycles = 0;
 
-            // If SBB2 is disabled, notify the user
-            if ((reg_value & 0b110) != 0b110)
-            {
-                return S1_PMIC_VAUX_NOT_ENABLED;
-            }
+    stats->sectors_skipped = 0;
+    stats->sectors_written = 0;
 
-            // Return success
-            return S1_SUCCESS;
+    for (uint32_t sector = 0; sector < len; sector += FLASH_SECTOR_SIZE)
+    {
+        uint32_t sector_end = sector + FLASH_SECTOR_SIZE;
+        if (sector_end > len)
+        {
+            sector_end = (uint32_t)len;
         }
 
-        // Otherwise set the voltage to false
-        *voltage = 0.0f;
-
-        // Return success
-        return S1_SUCCESS;
-    }
-
-    // If in LDO mode
-    if ((reg_value & 0b110) == 0b110)
-    {
-        // Set LSW mode pointer to false
-        *lsw_mode = false;
+        // Compare what's in the flash against the new image
+        uint32_t image_crc = ~crc32_update(0xFFFFFFFF, image + sector,
+                                           sector_end - sector);
 
-        // Read the LDO set voltage
-        err = pmic_read_reg(0x38, &reg_value);
+        uint32_t flash_crc;
+        s1_error_t err = flash_crc32(address + sector, sector_end - sector,
+                                     &flash_crc);
 
         // If an error occurs, return it
         if (err != S1_SUCCESS)
@@ -531,11 +4086,15 @@ s1_error_t s1_pmic_get_vio(float *voltage, bool *lsw_mode)
             return err;
         }
 
-        // Convert the register value into a voltage (mask 7 bits)
-        *voltage = ((float)(reg_value & 0x7F) * 0.025f) + 0.8f;
+        if (flash_crc == image_crc)
+        {
+            stats->sectors_skipped++;
+            cycle_counter_lap(&last_cycles, &total_cycles);
+            continue;
+        }
 
-        // Read the SBB2 (Vaux) register
-        err = pmic_read_reg(0x2D, &reg_value);
+        // Otherwise rewrite the sector
+        err = flash_erase(0x20, address + sector);
 
         // If an error occurs, return it
         if (err != S1_SUCCESS)
@@ -543,18 +4102,12 @@ s1_error_t s1_pmic_get_vio(float *voltage, bool *lsw_mode)
             return err;
         }
 
-        // Convert the register value into a voltage
-        float sbb2_voltage = ((float)(reg_value & 0x7F) * 0.05f) + 0.8f;
-
-        // If sbb2 voltage is too low (including the 100mV dropout)
-        if (sbb2_voltage < *voltage + 0.1f)
+        while (s1_flash_is_busy())
         {
-            // Notify the user
-            return S1_PMIC_VAUX_TOO_LOW;
         }
 
-        // Read SBB2 active register
-        err = pmic_read_reg(0x2E, &reg_value);
+        err = flash_program_range(address, image, sector, sector_end,
+                                  &last_cycles, &total_cycles);
 
         // If an error occurs, return it
         if (err != S1_SUCCESS)
@@ -562,29 +4115,131 @@ s1_error_t s1_pmic_get_vio(float *voltage, bool *lsw_mode)
             return err;
         }
 
-        // If SBB2 is disabled, notify the user
-        if ((reg_value & 0b110) != 0b110)
+        stats->sectors_written++;
+    }
+
+    // Report the throughput of the whole update
+    if (flash_benchmark_handler != NULL && total_cycles > 0)
+    {
+        uint32_t bytes_per_second =
+            (uint32_t)(((uint64_t)len * SystemCoreClock) / total_cycles);
+        flash_benchmark_handler(len, bytes_per_second);
+    }
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
+
+s1_error_t s1_flash_update_image(unsigned char const *image, size_t len,
+                                 s1_flash_update_stats_t *stats)
+{
+    return s1_flash_update(0, image, len, stats);
+}
+
+s1_error_t s1_flash_read(uint32_t address, uint8_t *buffer, size_t len)
+{
+    PROFILE_FUNCTION(S1_PROFILE_FLASH_READ);
+
+    // The read must be within the flash
+    if (address > FLASH_SIZE || len > FLASH_SIZE - address)
+    {
+        return S1_FLASH_INVALID_VALUE;
+    }
+
+    s1_spi_xfer_t read_xfers[S1_SPI_QUEUE_SIZE];
+    uint8_t read_seq[5];
+
+    // Reads are queued in batches as large as the queue allows. Each batch
+    // starts its own fast read and releases chip select at the end, so a
+    // transfer queued by an interrupt can't land in the middle of a read
+    do
+    {
+        // Fast read command with 24bit address, followed by a dummy byte
+        read_seq[0] = 0x0B;
+        read_seq[1] = (uint8_t)(address >> 16);
+        read_seq[2] = (uint8_t)(address >> 8);
+        read_seq[3] = (uint8_t)address;
+        read_seq[4] = 0x00;
+
+        // The command is sent on its own, so the echo doesn't end up in the
+        // buffer. A zero length read still needs the chip select released
+        read_xfers[0] = (s1_spi_xfer_t){read_seq, 5, NULL, 0, S1_SPI_FLASH, len > 0};
+        size_t count = 1;
+
+        // Chip select stays active, so the flash keeps streaming sequential
+        // data for each chunk
+        while (len > 0 && count < S1_SPI_QUEUE_SIZE)
         {
-            return S1_PMIC_VAUX_NOT_ENABLED;
+            size_t chunk = len < SPI_MAX_XFER_LEN ? len : SPI_MAX_XFER_LEN;
+            len -= chunk;
+
+            bool more = len > 0 && count + 1 < S1_SPI_QUEUE_SIZE;
+            read_xfers[count] = (s1_spi_xfer_t){NULL, 0, buffer, chunk,
+                                                S1_SPI_FLASH, more};
+            count++;
+
+            buffer += chunk;
+            address += (uint32_t)chunk;
         }
 
-        // Return success once read
-        return S1_SUCCESS;
-    }
+        s1_error_t err = spi_queue_wait(read_xfers, count);
 
-    // Otherwise LDO0 is 0V
-    *voltage = 0.0f;
+        // If an error occurs, return it
+        if (err != S1_SUCCESS)
+        {
+            return err;
+        }
+    } while (len > 0);
 
     // Return success once complete
     return S1_SUCCESS;
 }
 
-s1_error_t s1_pmic_set_vio(float voltage, bool lsw_mode)
+s1_error_t flash_tx_rx(uint8_t *tx_buffer, size_t tx_len,
+                       uint8_t *rx_buffer, size_t rx_len)
 {
-    uint8_t reg_value;
+    return spi_tx_rx(tx_buffer, tx_len, rx_buffer, rx_len, S1_SPI_FLASH);
+}
 
-    // Read the SBB1 register
-    s1_error_t err = pmic_read_reg(0x2C, &reg_value);
+s1_error_t flash_tx_rx_async(uint8_t *tx_buffer, size_t tx_len,
+                             uint8_t *rx_buffer, size_t rx_len,
+                             s1_spi_handler_t handler, void *context)
+{
+    s1_spi_xfer_t xfer = {tx_buffer, tx_len, rx_buffer, rx_len, S1_SPI_FLASH, false};
+    return s1_spi_queue(&xfer, 1, handler, context);
+}
+
+void s1_fpga_hold_reset(void)
+{
+    s1_fpga_doorbell_disable();
+    fpga_booted = false;
+    nrf_gpio_pin_clear(FPGA_RESET_PIN);
+}
+
+void s1_fpga_boot(void)
+{
+    fpga_last_bitstream = NULL;
+
+    // Release SPI so the FPGA can read its image from the flash
+    s1_spi_close();
+
+    // Bring FPGA out of reset
+    fpga_release_reset();
+}
+
+s1_error_t s1_fpga_configure_from_buffer(unsigned char const *bitstream,
+                                         size_t len)
+{
+    // Hold the FPGA in reset so it lets go of the flash bus. The previous
+    // design is gone, so there's nothing to reboot until this one configures
+    s1_fpga_hold_reset();
+    fpga_last_bitstream = NULL;
+    fpga_last_bitstream_len = 0;
+
+    // Put the flash into deep power down so it ignores the configuration
+    // traffic, and doesn't drive the data line the FPGA is listening on
+    uint8_t sleep_cmd[1] = {0xB9};
+    s1_error_t err = spi_tx_rx(sleep_cmd, 1, NULL, 0, S1_SPI_FLASH);
 
     // If an error occurs, return it
     if (err != S1_SUCCESS)
@@ -592,103 +4247,190 @@ s1_error_t s1_pmic_set_vio(float voltage, bool lsw_mode)
         return err;
     }
 
-    // Check if fpga is powered off
-    if ((reg_value & 0b10) == 0)
+    // Keep everyone else off the bus until it's back in the normal layout
+    spi_queue_lock();
+    s1_spi_close();
+
+    // In slave mode the FPGA receives on the line it normally reads the flash
+    // from, so the nRF transmits on SPI_SI_PIN. Clock idles high in mode 3
+    err = spi_session_start(SPI_SI_PIN, NRFX_SPIM_PIN_NOT_USED,
+                            NRF_SPIM_MODE_3);
+
+    // If an error occurs, return it
+    if (err != S1_SUCCESS)
     {
-        // Prevent configuration if FPGA core rail is off
-        return S1_PMIC_VFPGA_NOT_ENABLED;
+        spi_queue_unlock();
+        return err;
     }
 
-    // If the lsw flag was provided
-    if (lsw_mode)
+    // Holding slave select low while CRESET rises selects slave mode
+    s1_spi_select(S1_SPI_FLASH);
+    spi_cs_set(true);
+    NRFX_DELAY_US(FPGA_CONFIG_RESET_LOW_US);
+    fpga_release_reset();
+    NRFX_DELAY_US(FPGA_CONFIG_CLEAR_US);
+
+    // 8 dummy clocks with slave select high, then send the image
+    spi_cs_set(false);
+    fpga_config_clocks(1);
+    err = fpga_config_stream(bitstream, len);
+
+    // Clock until CDONE goes high, then a little more to start the user IO
+    if (err == S1_SUCCESS)
     {
-        // Read SBB2 set voltage
-        err = pmic_read_reg(0x2D, &reg_value);
+        fpga_config_clocks(FPGA_CONFIG_DONE_CLOCK_BYTES);
 
-        // If an error occurs, return it
-        if (err != S1_SUCCESS)
+        if (!nrf_gpio_pin_read(FPGA_DONE_PIN))
         {
-            return err;
+            err = S1_FPGA_CONFIGURATION_ERROR;
         }
 
-        // Ensure it is below the 3.45V limit of the FPGA IO
-        // reg_value = (3.45 - 0.8) / 0.05 = 53
-        if ((reg_value & 0x7F) > 53)
+        fpga_config_clocks(FPGA_CONFIG_WAKE_CLOCK_BYTES);
+    }
+
+    // Release the bus. The next transfer reopens it in the normal layout
+    s1_spi_close();
+    spi_queue_unlock();
+
+    // Remember the image so the same design can be rebooted
+    if (err == S1_SUCCESS)
+    {
+        fpga_last_bitstream = bitstream;
+        fpga_last_bitstream_len = len;
+    }
+
+    return err;
+}
+
+bool s1_fpga_is_booted(void)
+{
+    if (fpga_done_flag_pending)
+    {
+        fpga_done_flag_pending = false;
+        return true;
+    }
+    return false;
+}
+
+s1_error_t s1_fpga_wait_booted(uint32_t timeout_ms)
+{
+    // Poll the interrupt flag in small steps until the timeout runs out. Count
+    // in 64 bits so that long timeouts don't wrap
+    for (uint64_t waited_us = 0; !fpga_done_flag_pending; waited_us += 10)
+    {
+        if (waited_us >= (uint64_t)timeout_ms * 1000)
         {
-            return S1_PMIC_VAUX_TOO_HIGH;
+            return S1_FPGA_BOOT_TIMEOUT;
         }
 
-        // If the voltage value is greater than 0V
-        if (voltage > 0.0f)
-        {
-            // Turn on the regulator with LSW mode with discharge enabled
-            err = pmic_write_reg(0x39, 0x1E);
+        NRFX_DELAY_US(10);
+    }
+
+    fpga_done_flag_pending = false;
+
+    return S1_SUCCESS;
+}
+
+void s1_fpga_set_boot_handler(s1_fpga_boot_handler_t handler)
+{
+    fpga_boot_handler = handler;
+}
+
+uint32_t s1_fpga_get_boot_time_us(void)
+{
+    return (uint32_t)(((uint64_t)fpga_boot_ticks * 1000000) /
+                      APP_TIMER_CLOCK_FREQ);
+}
+
+s1_error_t s1_fpga_doorbell_enable(s1_fpga_doorbell_handler_t handler,
+                                   void *context)
+{
+    // Until CDONE has gone high, an edge on the pin still means boot
+    if (!fpga_booted)
+    {
+        return S1_FPGA_NOT_BOOTED;
+    }
+
+    fpga_doorbell_count = 0;
+    fpga_doorbell_context = context;
+    fpga_doorbell_handler = handler;
+
+    // Return success once complete
+    return S1_SUCCESS;
+}
 
-            // If an error occurs, return it
-            if (err != S1_SUCCESS)
-            {
-                return err;
-            }
+void s1_fpga_doorbell_disable(void)
+{
+    fpga_doorbell_handler = NULL;
+}
 
-            // Return
-            return S1_SUCCESS;
-        }
+uint32_t s1_fpga_doorbell_get_count(void)
+{
+    return fpga_doorbell_count;
+}
 
-        // Otherwise, turn off the regulator with LSW mode with discharge enabled
-        err = pmic_write_reg(0x39, 0x1C);
+s1_error_t fpga_tx_rx(uint8_t *tx_buffer, size_t tx_len,
+                      uint8_t *rx_buffer, size_t rx_len)
+{
+    return spi_tx_rx(tx_buffer, tx_len, rx_buffer, rx_len, S1_SPI_FPGA);
+}
 
-        // If an error occurs, return it
-        if (err != S1_SUCCESS)
-        {
-            return err;
-        }
+s1_error_t fpga_tx_rx_async(uint8_t *tx_buffer, size_t tx_len,
+                            uint8_t *rx_buffer, size_t rx_len,
+                            s1_spi_handler_t handler, void *context)
+{
+    s1_spi_xfer_t xfer = {tx_buffer, tx_len, rx_buffer, rx_len, S1_SPI_FPGA, false};
+    return s1_spi_queue(&xfer, 1, handler, context);
+}
 
-        // Return
-        return S1_SUCCESS;
-    }
+s1_error_t s1_fpga_reg_batch(s1_fpga_reg_access_t const *accesses,
+                             size_t count)
+{
+    PROFILE_FUNCTION(S1_PROFILE_FPGA_REG_BATCH);
 
-    // If user requests 0V
-    if (voltage == 0.0f)
+    size_t len = 0;
+
+    // Pack the header and data of each access into the frame
+    for (size_t i = 0; i < count; i++)
     {
-        // Turn off the regulator, ensuring LDO mode and discharge resistor is set
-        err = pmic_write_reg(0x39, 0x0C);
+        s1_fpga_reg_access_t const *access = &accesses[i];
 
-        // If an error occurs, return it
-        if (err != S1_SUCCESS)
+        if ((access->op != S1_FPGA_REG_WRITE && access->op != S1_FPGA_REG_READ) ||
+            access->len == 0 ||
+            len + FPGA_FRAME_HEADER_LEN + access->len + FPGA_FRAME_TRAILER_LEN >
+                S1_FPGA_FRAME_SIZE)
         {
-            return err;
+            return S1_FPGA_FRAME_ERROR;
         }
 
-        // Return
-        return S1_SUCCESS;
-    }
-
-    // Disallow voltage settings outside of the normal range
-    if (voltage < 0.8f || voltage > 3.45f)
-    {
-        return S1_PMIC_INVALID_VALUE;
-    }
+        fpga_frame_tx[len++] = (uint8_t)access->op;
+        fpga_frame_tx[len++] = access->address;
+        fpga_frame_tx[len++] = access->len;
 
-    // Set the output voltage
-    err = pmic_write_reg(0x38, (uint8_t)round((voltage - 0.8f) / 0.025f));
+        // Reads send dummy bytes while the FPGA returns the data
+        if (access->op == S1_FPGA_REG_WRITE)
+        {
+            memcpy(&fpga_frame_tx[len], access->data, access->len);
+        }
+        else
+        {
+            memset(&fpga_frame_tx[len], 0, access->len);
+        }
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
-    {
-        return err;
+        len += access->len;
     }
 
-    // Turn on the regulator with LDO mode set, and discharge enabled
-    err = pmic_write_reg(0x39, 0x0E);
+    // End the frame, and protect everything so far with the CRC
+    fpga_frame_tx[len++] = FPGA_FRAME_OP_END;
+    uint16_t crc = crc16_update(0xFFFF, fpga_frame_tx, len);
+    fpga_frame_tx[len++] = (uint8_t)(crc >> 8);
+    fpga_frame_tx[len++] = (uint8_t)crc;
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
-    {
-        return err;
-    }
+    // Clock out the status and the FPGA's CRC
+    memset(&fpga_frame_tx[len], 0, 3);
+    len += 3;
 
-    // Otherwise, check SBB2 (Vaux) set voltage
-    err = pmic_read_reg(0x2D, &reg_value);
+    s1_error_t err = fpga_tx_rx(fpga_frame_tx, len, fpga_frame_rx, len);
 
     // If an error occurs, return it
     if (err != S1_SUCCESS)
@@ -696,214 +4438,398 @@ s1_error_t s1_pmic_set_vio(float voltage, bool lsw_mode)
         return err;
     }
 
-    // Convert the register value into a voltage (mask 7 bits)
-    float sbb2_voltage = ((float)(reg_value & 0x7F) * 0.05f) + 0.8f;
+    // The FPGA's CRC covers everything it sent, including the status
+    crc = crc16_update(0xFFFF, fpga_frame_rx, len - 2);
 
-    // If sbb2 voltage is too low (including the 100mV dropout)
-    if (sbb2_voltage < voltage + 0.1f)
+    if (fpga_frame_rx[len - 3] != FPGA_FRAME_STATUS_OK ||
+        fpga_frame_rx[len - 2] != (uint8_t)(crc >> 8) ||
+        fpga_frame_rx[len - 1] != (uint8_t)crc)
     {
-        // Notify the user
-        return S1_PMIC_VAUX_TOO_LOW;
+        return S1_FPGA_CRC_ERROR;
     }
 
-    // Read SBB2 active register
-    err = pmic_read_reg(0x2E, &reg_value);
+    // Copy out the read data, which lines up with the dummy bytes
+    size_t offset = 0;
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+    for (size_t i = 0; i < count; i++)
     {
-        return err;
-    }
+        offset += FPGA_FRAME_HEADER_LEN;
 
-    // If SBB2 is disabled, notify the user
-    if ((reg_value & 0b110) != 0b110)
-    {
-        return S1_PMIC_VAUX_NOT_ENABLED;
+        if (accesses[i].op == S1_FPGA_REG_READ)
+        {
+            memcpy(accesses[i].data, &fpga_frame_rx[offset], accesses[i].len);
+        }
+
+        offset += accesses[i].len;
     }
 
     // Return success once complete
     return S1_SUCCESS;
 }
 
-s1_error_t s1_pimc_get_vfpga(bool *enable)
+s1_error_t s1_fpga_reg_write(uint8_t address, uint8_t const *data, uint8_t len)
 {
-    uint8_t reg_value;
+    s1_fpga_reg_access_t access = {S1_FPGA_REG_WRITE, address, (uint8_t *)data, len};
+    return s1_fpga_reg_batch(&access, 1);
+}
 
-    // Read the SBB1 register
-    s1_error_t err = pmic_read_reg(0x2C, &reg_value);
+s1_error_t s1_fpga_reg_read(uint8_t address, uint8_t *data, uint8_t len)
+{
+    s1_fpga_reg_access_t access = {S1_FPGA_REG_READ, address, data, len};
+    return s1_fpga_reg_batch(&access, 1);
+}
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+/**
+ * @brief Stream channels which have been set up, and the number of blocks
+ *        dropped from each of them.
+ */
+static bool stream_open[SEGGER_RTT_CONFIG_MAX_NUM_UP_BUFFERS];
+static volatile uint32_t stream_dropped[SEGGER_RTT_CONFIG_MAX_NUM_UP_BUFFERS];
+
+s1_error_t s1_stream_open(uint8_t channel, char const *name, void *buffer,
+                          size_t size)
+{
+    // Channel 0 is kept for logs
+    if (channel == 0 ||
+        channel >= SEGGER_RTT_CONFIG_MAX_NUM_UP_BUFFERS ||
+        buffer == NULL ||
+        size == 0)
     {
-        return err;
+        return S1_STREAM_INVALID_CHANNEL;
     }
 
-    // Return the value. Second bit represents on or off
-    *enable = reg_value & 0b10;
+    // Skip mode makes each write all or nothing, and never waits on the host
+    if (SEGGER_RTT_ConfigUpBuffer(channel, name, buffer, size,
+                                  SEGGER_RTT_MODE_NO_BLOCK_SKIP) < 0)
+    {
+        return S1_STREAM_INVALID_CHANNEL;
+    }
+
+    stream_dropped[channel] = 0;
+    stream_open[channel] = true;
 
     // Return success once complete
     return S1_SUCCESS;
 }
 
-s1_error_t s1_pimc_set_vfpga(bool enable)
+s1_error_t s1_stream_write(uint8_t channel, void const *data, size_t len)
 {
-    // Ensure SBB1 is 1.2V (TODO later we can do undervolting tricks)
-    s1_error_t err = pmic_write_reg(0x2B, 0x08);
-
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+    if (channel >= SEGGER_RTT_CONFIG_MAX_NUM_UP_BUFFERS || !stream_open[channel])
     {
-        return err;
+        return S1_STREAM_INVALID_CHANNEL;
     }
 
-    // If enable
-    if (enable)
+    if (len == 0)
     {
-        // Enable SBB1 as buck mode with 0.333A limit
-        err = pmic_write_reg(0x2C, 0x7E);
-
-        // If an error occurs, return it
-        if (err != S1_SUCCESS)
-        {
-            return err;
-        }
-
-        // Return success once complete
         return S1_SUCCESS;
     }
 
-    // Otherwise, first disable LDO0 (Vio) to avoid damaging the FPGA
-    err = pmic_write_reg(0x39, 0x0C);
-
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+    // Nothing is written if the block doesn't fit
+    if (SEGGER_RTT_Write(channel, data, len) == 0)
     {
-        return err;
+        __atomic_fetch_add(&stream_dropped[channel], 1, __ATOMIC_RELAXED);
+        return S1_STREAM_FULL;
     }
 
-    // Finally, disable SBB1
-    err = pmic_write_reg(0x2C, 0x7C);
+    // Return success once complete
+    return S1_SUCCESS;
+}
 
-    // If an error occurs, return it
-    if (err != S1_SUCCESS)
+uint32_t s1_stream_get_dropped(uint8_t channel)
+{
+    if (channel >= SEGGER_RTT_CONFIG_MAX_NUM_UP_BUFFERS)
     {
-        return err;
+        return 0;
     }
 
-    // Return success once complete
-    return S1_SUCCESS;
+    return stream_dropped[channel];
 }
 
-s1_error_t s1_flash_wakeup(void)
+_Static_assert(S1_LOG_DEFERRED_MAX_ARGS == 6,
+               "s1_log_flush() passes exactly six argument words to snprintf()");
+
+/**
+ * @brief One deferred log message. The ready flag is set once the producer
+ *        has finished filling it in.
+ */
+typedef struct
 {
-    // Wake up the flash
-    uint8_t wake_seq[4] = {0xAB, 0, 0, 0};
-    uint8_t wake_res[5] = {0};
-    spi_tx_rx((uint8_t *)&wake_seq, 4, (uint8_t *)&wake_res, 5, false);
-    NRFX_DELAY_US(3); // tRES1 required to come out of sleep
+    char const *format;
+    uint32_t args[S1_LOG_DEFERRED_MAX_ARGS];
+    uint8_t argc;
+    volatile bool ready;
+} log_entry_t;
 
-    // Reset sequence has to happen as two transfers
-    uint8_t reset_seq[3] = {0x66, 0x99};
-    spi_tx_rx((uint8_t *)&reset_seq, 1, NULL, 0, false);
-    spi_tx_rx((uint8_t *)&reset_seq + 1, 1, NULL, 0, false);
-    NRFX_DELAY_US(30); // tRST to fully reset
+/**
+ * @brief Ring of deferred log messages. Producers reserve entries by moving the
+ *        head with a compare and swap, so any interrupt can log without
+ *        locking. s1_log_flush() is the only consumer, and moves the tail.
+ */
+_Static_assert(S1_LOG_DEFERRED_ENTRIES > 0 &&
+                   (S1_LOG_DEFERRED_ENTRIES & (S1_LOG_DEFERRED_ENTRIES - 1)) == 0,
+               "S1_LOG_DEFERRED_ENTRIES must be a power of two");
 
-    // Check if the capacity ID corresponds to 32M
-    uint8_t cap_id_reg[1] = {0x9F};
-    uint8_t cap_id_res[4] = {0};
-    spi_tx_rx((uint8_t *)&cap_id_reg, 1, (uint8_t *)&cap_id_res, 4, false);
+static log_entry_t log_ring[S1_LOG_DEFERRED_ENTRIES];
+static volatile uint32_t log_head = 0;
+static volatile uint32_t log_tail = 0;
+static volatile uint32_t log_dropped = 0;
 
-    if (cap_id_res[3] != 0x16)
+/**
+ * @brief Token of tokenised text records, and the start of the section holding
+ *        the format strings of tokenised deferred logs.
+ */
+#define LOG_TOKEN_TEXT 0xFFFF
+
+#if S1_LOG_TOKENISED
+extern char const __start_s1_log_fmt[];
+#endif
+
+/**
+ * @brief Local function for writing a span of a tokenised log record to RTT.
+ *        The record is the 16 bit token, followed by the data.
+ *
+ * @param token_bytes: The token, least significant byte first.
+ *
+ * @param data: The rest of the record.
+ *
+ * @param start: Offset into the record of the first byte to write.
+ *
+ * @param end: Offset into the record to stop at.
+ */
+static void log_write_record_bytes(uint8_t const *token_bytes,
+                                   uint8_t const *data,
+                                   size_t start,
+                                   size_t end)
+{
+    if (start < 2)
     {
-        return S1_FLASH_ERROR;
+        size_t token_end = end < 2 ? end : 2;
+        SEGGER_RTT_WriteNoLock(0, &token_bytes[start], (unsigned)(token_end - start));
+        start = token_end;
     }
 
-    return S1_SUCCESS;
+    if (end > start)
+    {
+        SEGGER_RTT_WriteNoLock(0, &data[start - 2], (unsigned)(end - start));
+    }
 }
 
-void s1_flash_erase_all(void)
+/**
+ * @brief Local function for writing a tokenised log record to RTT, framed with
+ *        COBS so that it contains no zeros, and ends with a zero. The decoder
+ *        can then find the start of the next record even if some bytes are
+ *        lost. Each block is written straight from the data, so no copy of
+ *        the frame is needed. Like SEGGER_RTT_Write(), the whole frame is
+ *        dropped if there isn't room for it.
+ *
+ * @param token: The token of the record.
+ *
+ * @param data: The rest of the record.
+ *
+ * @param len: Length of the data.
+ */
+static void log_write_record(uint16_t token, uint8_t const *data, size_t len)
 {
-    // Issue erase sequence
-    uint8_t erase_seq[2] = {0x06, 0x60};
-    spi_tx_rx((uint8_t *)&erase_seq, 1, NULL, 0, false);
-    spi_tx_rx((uint8_t *)&erase_seq + 1, 1, NULL, 0, false);
+    uint8_t token_bytes[2] = {(uint8_t)token, (uint8_t)(token >> 8)};
+    size_t record_len = len + 2;
+    uint8_t delimiter = 0;
+
+    // Keep other writers out until the frame is complete
+    SEGGER_RTT_LOCK();
+
+    if (SEGGER_RTT_GetAvailWriteSpace(0) >= record_len + record_len / 254 + 2)
+    {
+        size_t i = 0;
+
+        for (;;)
+        {
+            // Each block runs up to the next zero, for 254 bytes, or to the end
+            size_t start = i;
+            while (i < record_len && i - start < 254 &&
+                   (i < 2 ? token_bytes[i] : data[i - 2]) != 0)
+            {
+                i++;
+            }
+
+            uint8_t code = (uint8_t)(i - start + 1);
+            SEGGER_RTT_WriteNoLock(0, &code, 1);
+            log_write_record_bytes(token_bytes, data, start, i);
+
+            // A full block isn't followed by a zero, so carry straight on
+            if (code == 0xFF)
+            {
+                continue;
+            }
+
+            if (i == record_len)
+            {
+                break;
+            }
+
+            // Skip the zero which ended the block
+            i++;
+        }
+
+        SEGGER_RTT_WriteNoLock(0, &delimiter, 1);
+    }
+
+    SEGGER_RTT_UNLOCK();
 }
 
-bool s1_flash_is_busy(void)
+void s1_log_deferred(char const *format, size_t argc, uint32_t const *args)
 {
-    // Read status register
-    uint8_t status_reg[1] = {0x05};
-    uint8_t status_res[2] = {0};
-    spi_tx_rx((uint8_t *)&status_reg, 1, (uint8_t *)&status_res, 2, false);
+    uint32_t head = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
 
-    if (!(status_res[1] & 0x01))
+    // Reserve an entry, or drop the message if there's no room
+    do
     {
-        return false;
+        if (head - log_tail >= S1_LOG_DEFERRED_ENTRIES)
+        {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&log_head, &head, head + 1, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    log_entry_t *entry = &log_ring[head % S1_LOG_DEFERRED_ENTRIES];
+
+    if (argc > S1_LOG_DEFERRED_MAX_ARGS)
+    {
+        argc = S1_LOG_DEFERRED_MAX_ARGS;
     }
 
-    return true;
+    entry->format = format;
+    entry->argc = (uint8_t)argc;
+    memset(entry->args, 0, sizeof(entry->args));
+    memcpy(entry->args, args, argc * sizeof(uint32_t));
+
+    // Only now can the flush print it
+    __atomic_store_n(&entry->ready, true, __ATOMIC_RELEASE);
 }
 
-void s1_flash_page_from_image(uint32_t offset,
-                              unsigned char *image)
+void s1_log_flush(void)
 {
-    uint8_t tx[260];
+    while (log_tail != __atomic_load_n(&log_head, __ATOMIC_ACQUIRE))
+    {
+        log_entry_t *entry = &log_ring[log_tail % S1_LOG_DEFERRED_ENTRIES];
 
-    // Disable write protection
-    tx[0] = 0x06;
-    spi_tx_rx((uint8_t *)&tx, 1, NULL, 0, false);
+        // An interrupted producer may not have filled in its entry yet
+        if (!__atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE))
+        {
+            return;
+        }
 
-    // Write page command with 24bit address
-    // Lowest byte of address is always 0
-    tx[0] = 0x02;
-    tx[1] = (uint8_t)(offset >> 16);
-    tx[2] = (uint8_t)(offset >> 8);
-    tx[3] = 0x00; // Lower byte 0 to avoid partial pages
+#if S1_LOG_TOKENISED
+        // The token is where the format string is within its section, which
+        // s1.ld checks is small enough. Each argument is sent as a variable
+        // length integer
+        uint16_t token = (uint16_t)(entry->format - __start_s1_log_fmt);
+        uint8_t record[S1_LOG_DEFERRED_MAX_ARGS * 5];
+        size_t record_len = 0;
+
+        for (uint8_t i = 0; i < entry->argc; i++)
+        {
+            uint32_t word = entry->args[i];
+
+            while (word >= 0x80)
+            {
+                record[record_len++] = (uint8_t)(word | 0x80);
+                word >>= 7;
+            }
 
-    // Copy page from image and transfer
-    memcpy(tx + 4, image + offset, 256);
-    spi_tx_rx((uint8_t *)&tx, 260, NULL, 0, false);
+            record[record_len++] = (uint8_t)word;
+        }
+
+        // Free the entry before the slow part
+        entry->ready = false;
+        __atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELEASE);
+
+        log_write_record(token, record, record_len);
+#else
+        // The format comes from LOG_DEFERRED(), so it's always a literal.
+        // Unused argument words are ignored by snprintf()
+        char buffer[S1_LOG_BUFFER_SIZE];
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+        snprintf(buffer, sizeof(buffer), entry->format,
+                 entry->args[0], entry->args[1], entry->args[2],
+                 entry->args[3], entry->args[4], entry->args[5]);
+#pragma GCC diagnostic pop
+
+        // Free the entry before the slow part
+        entry->ready = false;
+        __atomic_store_n(&log_tail, log_tail + 1, __ATOMIC_RELEASE);
+
+        SEGGER_RTT_Write(0, buffer, strnlen(buffer, sizeof(buffer)));
+#endif
+    }
 }
 
-s1_error_t flash_tx_rx(uint8_t *tx_buffer, size_t tx_len,
-                       uint8_t *rx_buffer, size_t rx_len)
+void s1_log_text(char const *text, size_t len)
 {
-    return spi_tx_rx(tx_buffer, tx_len, rx_buffer, rx_len, false);
+    if (len > S1_LOG_BUFFER_SIZE)
+    {
+        len = S1_LOG_BUFFER_SIZE;
+    }
+
+    log_write_record(LOG_TOKEN_TEXT, (uint8_t const *)text, len);
 }
 
-void s1_fpga_hold_reset(void)
+uint32_t s1_log_get_dropped(void)
 {
-    nrf_gpio_pin_clear(FPGA_RESET_PIN);
+    return log_dropped;
 }
 
-void s1_fpga_boot(void)
+#if S1_PROFILE
+
+void s1_profile_get(s1_profile_point_t point, s1_profile_stats_t *stats)
 {
-    // Release SPI
-    nrfx_spim_uninit(&spi);
+    if (point >= S1_PROFILE_POINTS)
+    {
+        memset(stats, 0, sizeof(s1_profile_stats_t));
+        return;
+    }
 
-    // Set the SPI pins as inputs
-    // CS needs a pullup
-    nrf_gpio_cfg_input(SPI_CS_PIN, NRF_GPIO_PIN_PULLUP);
-    nrf_gpio_cfg_input(SPI_CLK_PIN, NRF_GPIO_PIN_NOPULL);
-    nrf_gpio_cfg_input(SPI_SI_PIN, NRF_GPIO_PIN_NOPULL);
-    nrf_gpio_cfg_input(SPI_SO_PIN, NRF_GPIO_PIN_NOPULL);
+    // Copy atomically, as an interrupt may be recording a timing
+    NRFX_CRITICAL_SECTION_ENTER();
+    *stats = profile_stats[point];
+    NRFX_CRITICAL_SECTION_EXIT();
+}
 
-    // Bring FPGA out of reset
-    nrf_gpio_pin_set(FPGA_RESET_PIN);
+void s1_profile_reset(void)
+{
+    NRFX_CRITICAL_SECTION_ENTER();
+    memset(profile_stats, 0, sizeof(profile_stats));
+    NRFX_CRITICAL_SECTION_EXIT();
 }
 
-bool s1_fpga_is_booted(void)
+void s1_profile_dump(void)
 {
-    if (fpga_done_flag_pending)
+    uint32_t cycles_per_us = SystemCoreClock / 1000000;
+
+    LOG("[PROFILE] Function                  Calls     Min     Max    Mean (cycles)");
+
+    for (size_t i = 0; i < S1_PROFILE_POINTS; i++)
     {
-        fpga_done_flag_pending = false;
-        return true;
+        s1_profile_stats_t stats;
+        s1_profile_get((s1_profile_point_t)i, &stats);
+
+        // Skip functions which haven't been used
+        if (stats.calls == 0)
+        {
+            continue;
+        }
+
+        uint32_t mean = (uint32_t)(stats.total_cycles / stats.calls);
+
+        LOG("[PROFILE] %-24s %7lu %7lu %7lu %7lu (%lu us)",
+            profile_names[i],
+            stats.calls,
+            stats.min_cycles,
+            stats.max_cycles,
+            mean,
+            mean / cycles_per_us);
     }
-    return false;
 }
 
-s1_error_t fpga_tx_rx(uint8_t *tx_buffer, size_t tx_len,
-                      uint8_t *rx_buffer, size_t rx_len)
-{
-    return spi_tx_rx(tx_buffer, tx_len, rx_buffer, rx_len, true);
-}
\ No newline at end of file
+#endif
\ No newline at end of file
@@ -64,6 +64,18 @@ typedef enum
     S1_PMIC_VFPGA_NOT_ENABLED,
     S1_FLASH_FPGA_COMMUNICATION_ERROR,
     S1_FLASH_ERROR,
+    S1_FLASH_INVALID_VALUE,
+    S1_FPGA_CONFIGURATION_ERROR,
+    S1_FPGA_BOOT_TIMEOUT,
+    S1_FPGA_SELF_TEST_ERROR,
+    S1_ADC_INVALID_VALUE,
+    S1_FPGA_FRAME_ERROR,
+    S1_FPGA_CRC_ERROR,
+    S1_FPGA_NOT_BOOTED,
+    S1_STREAM_INVALID_CHANNEL,
+    S1_STREAM_FULL,
+    S1_BLOCKED_IN_INTERRUPT,
+    S1_ADC_BUSY,
 } s1_error_t;
 
 /**
@@ -180,6 +192,79 @@ s1_error_t s1_pmic_get_vio(float *voltage, bool *lsw_mode);
  */
 s1_error_t s1_pmic_set_vio(float voltage, bool lsw_mode);
 
+/**
+ * @brief Same as s1_pmic_get_chg(), but in integer millivolts and microamps.
+ *        The _mv functions avoid floating point, so prefer them where code
+ *        size or speed matters.
+ *
+ * @param voltage_mv: A pointer to where the charger voltage should be stored.
+ *
+ * @param current_ua: A pointer to where the charger current should be stored.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ */
+s1_error_t s1_pmic_get_chg_mv_ua(uint32_t *voltage_mv, uint32_t *current_ua);
+
+/**
+ * @brief Same as s1_pmic_set_chg(), but in integer millivolts and microamps.
+ *
+ * @param voltage_mv: The battery max voltage, from 3600mV to 4600mV. Rounded
+ *                    to the nearest 25mV.
+ *
+ * @param current_ua: The charging current limit, from 7500uA to 300000uA.
+ *                    Rounded to the nearest 7500uA.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_INVALID_VALUE if a value is not a valid range,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ */
+s1_error_t s1_pmic_set_chg_mv_ua(uint32_t voltage_mv, uint32_t current_ua);
+
+/**
+ * @brief Same as s1_pmic_get_vaux(), but in integer millivolts.
+ *
+ * @param voltage_mv: A pointer to where the voltage should be stored.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ */
+s1_error_t s1_pmic_get_vaux_mv(uint32_t *voltage_mv);
+
+/**
+ * @brief Same as s1_pmic_set_vaux(), but in integer millivolts.
+ *
+ * @param voltage_mv: Voltage level from 800mV to 5500mV. Rounded to the
+ *                    nearest 50mV. A value of 0 shuts down the rail.
+ *
+ * @returns The same as s1_pmic_set_vaux().
+ */
+s1_error_t s1_pmic_set_vaux_mv(uint32_t voltage_mv);
+
+/**
+ * @brief Same as s1_pmic_get_vio(), but in integer millivolts. In load switch
+ *        mode, a value of 1 signifies the load switch is on.
+ *
+ * @param voltage_mv: A pointer to where the voltage should be stored.
+ *
+ * @param lsw_mode: A pointer to where the load swich mode should be stored.
+ *
+ * @returns The same as s1_pmic_get_vio().
+ */
+s1_error_t s1_pmic_get_vio_mv(uint32_t *voltage_mv, bool *lsw_mode);
+
+/**
+ * @brief Same as s1_pmic_set_vio(), but in integer millivolts.
+ *
+ * @param voltage_mv: Voltage level from 800mV to 3450mV. Rounded to the
+ *                    nearest 25mV. A value of 0 shuts down the rail.
+ *
+ * @param lsw_mode: If the mode of Vio should be load switch, or LDO.
+ *
+ * @returns The same as s1_pmic_set_vio().
+ */
+s1_error_t s1_pmic_set_vio_mv(uint32_t voltage_mv, bool lsw_mode);
+
 /**
  * @brief Gets the enable state of the FPGA core voltage.
  *
@@ -193,50 +278,797 @@ s1_error_t s1_pimc_get_vfpga(bool *enable);
 /**
  * @brief Sets the enable state of the FPGA core voltage.
  *
- * @param enable: If true, the FPGA is powered, if false the FPGA is shut down.
+ * @param enable: If true, the FPGA is powered, if false the FPGA is shut down.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ */
+s1_error_t s1_pimc_set_vfpga(bool enable);
+
+/**
+ * @brief Lowest FPGA core voltage that s1_pmic_set_vfpga_mv() will allow.
+ *        Designs which have been characterised lower can override this in the
+ *        Makefile.
+ */
+#ifndef S1_VFPGA_MIN_MV
+#define S1_VFPGA_MIN_MV 1000
+#endif
+
+/**
+ * @brief Time given to SBB1 to settle after each voltage step in
+ *        s1_pmic_vfpga_search(), before running the self test.
+ */
+#ifndef S1_VFPGA_SETTLE_US
+#define S1_VFPGA_SETTLE_US 1000
+#endif
+
+/**
+ * @brief Gets the FPGA core voltage setting.
+ *
+ * @param voltage_mv: A pointer to where the voltage should be stored.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ */
+s1_error_t s1_pmic_get_vfpga_mv(uint32_t *voltage_mv);
+
+/**
+ * @brief Sets the FPGA core voltage, to save power in designs which have been
+ *        shown to work at a lower voltage. The setting is kept for the next
+ *        s1_pimc_set_vfpga(true).
+ *
+ * @param voltage_mv: Voltage from S1_VFPGA_MIN_MV up to the nominal 1200mV.
+ *                    Rounded to the nearest 50mV.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_INVALID_VALUE if voltage is not a valid range,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ */
+s1_error_t s1_pmic_set_vfpga_mv(uint32_t voltage_mv);
+
+/**
+ * @brief User supplied FPGA self test used by s1_pmic_vfpga_search(). Would
+ *        typically exercise the design using fpga_tx_rx(), and check the
+ *        results.
+ *
+ * @param context: Pointer given to s1_pmic_vfpga_search().
+ *
+ * @returns True if the FPGA design passed.
+ */
+typedef bool (*s1_fpga_self_test_t)(void *context);
+
+/**
+ * @brief Finds the lowest FPGA core voltage at which the running design still
+ *        passes a self test. Steps down from 1200mV in 50mV steps until the
+ *        test fails or S1_VFPGA_MIN_MV is reached. It then backs off by the
+ *        margin and checks the test passes again. If a step failed, the FPGA
+ *        is reset and the same design booted again before that final test,
+ *        which also disables the doorbell. That's either from the flash, or
+ *        from the image last configured by s1_fpga_configure_from_buffer(),
+ *        which must still be valid. The FPGA must be booted, and the result
+ *        stays applied.
+ *
+ * @param self_test: Function which tests the FPGA design.
+ *
+ * @param context: Pointer passed to the self test.
+ *
+ * @param margin_mv: Safety margin to add to the lowest passing voltage.
+ *
+ * @param voltage_mv: A pointer to where the chosen voltage will be stored.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_VFPGA_NOT_ENABLED if the FPGA isn't powered,
+ *          S1_FPGA_SELF_TEST_ERROR if the test fails at the nominal or chosen
+ *          voltage, in which case 1200mV is restored and the FPGA may need to
+ *          be rebooted,
+ *          S1_FPGA_BOOT_TIMEOUT or S1_FPGA_CONFIGURATION_ERROR if the FPGA
+ *          didn't boot again, in which case 1200mV is restored,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ */
+s1_error_t s1_pmic_vfpga_search(s1_fpga_self_test_t self_test,
+                                void *context,
+                                uint32_t margin_mv,
+                                uint32_t *voltage_mv);
+
+/**
+ * @brief Counters for the I2C traffic to the PMIC.
+ */
+typedef struct
+{
+    uint32_t bus_reads;
+    uint32_t bus_writes;
+    uint32_t shadow_hits;
+} s1_pmic_stats_t;
+
+/**
+ * @brief Forgets the RAM shadow of the PMIC configuration registers, so the
+ *        next reads go to the PMIC. Use this if something else may have changed
+ *        the PMIC, such as a debugger or another I2C controller.
+ */
+void s1_pmic_invalidate_shadow(void);
+
+/**
+ * @brief Enables reading back every PMIC register write to check that it took.
+ *        Writes which don't read back the same value return
+ *        S1_PMIC_COMMUNICATION_ERROR. Off by default.
+ *
+ * @param verify: True to enable, false to disable.
+ */
+void s1_pmic_set_shadow_verify(bool verify);
+
+/**
+ * @brief Gets how many I2C reads and writes have been made to the PMIC, and how
+ *        many reads were served from the shadow instead.
+ *
+ * @param stats: Pointer to where the counters will be stored.
+ */
+void s1_pmic_get_stats(s1_pmic_stats_t *stats);
+
+/**
+ * @brief State of all the PMIC rails, as returned by s1_pmic_snapshot(). In
+ *        millivolts and microamps. In load switch mode, a Vio of 1 means on.
+ */
+typedef struct
+{
+    uint32_t chg_mv;
+    uint32_t chg_ua;
+    uint32_t vaux_mv;
+    uint32_t vio_mv;
+    bool vio_lsw_mode;
+    bool vfpga_enable;
+} s1_pmic_snapshot_t;
+
+/**
+ * @brief Reads the state of every rail in a single I2C transfer. This also
+ *        refreshes the register shadow from the PMIC.
+ *
+ * @param snapshot: Pointer to where the rail states will be stored.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ */
+s1_error_t s1_pmic_snapshot(s1_pmic_snapshot_t *snapshot);
+
+/**
+ * @brief Number of PMIC transfers which can wait for the I2C bus. Can be
+ *        overridden in the Makefile.
+ */
+#ifndef S1_PMIC_QUEUE_SIZE
+#define S1_PMIC_QUEUE_SIZE 8
+#endif
+
+/**
+ * @brief Handler called from the I2C interrupt once a queued PMIC transfer
+ *        completes.
+ *
+ * @param err: S1_SUCCESS if okay, or S1_PMIC_COMMUNICATION_ERROR if the PMIC
+ *             did not respond.
+ *
+ * @param context: Pointer given when the transfer was queued.
+ */
+typedef void (*s1_pmic_handler_t)(s1_error_t err, void *context);
+
+/**
+ * @brief Queues a read of consecutive PMIC registers, and returns immediately.
+ *        Configuration registers which are read update the register shadow.
+ *        The blocking s1_pmic_...() functions share the same queue, and wait
+ *        on the I2C and TIMER2 interrupts. From the handler, or any interrupt
+ *        of the same or higher priority, they return S1_BLOCKED_IN_INTERRUPT
+ *        rather than wait forever, so use these async functions there.
+ *
+ * @param reg: Address of the first register to read.
+ *
+ * @param data: Where the register values will be stored. Must be in RAM, and
+ *              stay valid until the handler is called.
+ *
+ * @param len: Number of registers to read.
+ *
+ * @param handler: Called once the read is complete. Can be NULL if
+ *                 s1_pmic_is_busy() is polled instead.
+ *
+ * @param context: Pointer passed back to the handler.
+ *
+ * @returns S1_SUCCESS if the read was queued,
+ *          S1_PMIC_INVALID_VALUE if data isn't in RAM,
+ *          S1_PMIC_COMMUNICATION_ERROR if the queue is full.
+ */
+s1_error_t s1_pmic_read_async(uint8_t reg, uint8_t *data, size_t len,
+                              s1_pmic_handler_t handler, void *context);
+
+/**
+ * @brief Queues a write of a single PMIC register, and returns immediately.
+ *        Unlike the s1_pmic_set_...() functions, no checks are made on the
+ *        value, so take care with the rails powering the FPGA and flash.
+ *
+ * @param reg: Address of the register to write.
+ *
+ * @param data: Value to write.
+ *
+ * @param handler: Called once the write is complete. Can be NULL.
+ *
+ * @param context: Pointer passed back to the handler.
+ *
+ * @returns S1_SUCCESS if the write was queued,
+ *          S1_PMIC_COMMUNICATION_ERROR if the queue is full.
+ */
+s1_error_t s1_pmic_write_async(uint8_t reg, uint8_t data,
+                               s1_pmic_handler_t handler, void *context);
+
+/**
+ * @brief Checks if any PMIC transfers are queued or in progress.
+ *
+ * @returns True if the I2C bus is busy.
+ */
+bool s1_pmic_is_busy(void);
+
+/**
+ * @brief Complete power state of the rails, as applied by s1_pmic_apply().
+ */
+typedef struct
+{
+    bool vfpga_enable;
+    uint32_t vaux_mv;
+    uint32_t vio_mv;
+    bool vio_lsw_mode;
+} s1_pmic_state_t;
+
+/**
+ * @brief Switches all the rails to a new power state in one go. The state is
+ *        checked against the same rules as s1_pmic_set_vaux() and
+ *        s1_pmic_set_vio() before anything is written. The rules that those
+ *        functions only warn about are enforced up front. Only registers that
+ *        differ from the current state are written. They are ordered so
+ *        that Vio goes off before Vfpga, and Vfpga comes on before Vio. Each
+ *        write is queued from the interrupt of the one before, and the first
+ *        failure stops the rest, so no rail changes after a write it depends
+ *        on has failed.
+ *
+ * @param state: The target power state in millivolts. A voltage of 0 turns a
+ *               rail off. In load switch mode, any Vio voltage above 0 turns
+ *               it on.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_INVALID_VALUE if a voltage is out of range,
+ *          S1_PMIC_VFPGA_NOT_ENABLED if Vio is on without Vfpga,
+ *          S1_PMIC_VAUX_NOT_ENABLED if Vio is on without Vaux,
+ *          S1_PMIC_VAUX_TOO_LOW if Vaux is below Vio + 100mV in LDO mode,
+ *          S1_PMIC_VAUX_TOO_HIGH if Vaux is above 3.45V in load switch mode,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond,
+ *          S1_BLOCKED_IN_INTERRUPT if called where the PMIC interrupts can't
+ *          run.
+ */
+s1_error_t s1_pmic_apply(s1_pmic_state_t const *state);
+
+/*******************************************************
+ * Telemetry related functions
+ *******************************************************/
+
+/**
+ * @brief Battery and rail measurements taken through the PMIC analog
+ *        multiplexer. Charge current is only valid while charging, and the
+ *        temperature assumes a 10k NTC thermistor on the THM pin.
+ */
+typedef struct
+{
+    uint32_t battery_mv;
+    uint32_t chgin_mv;
+    uint32_t charge_ua;
+    int32_t temperature_dc;
+} s1_telemetry_t;
+
+/**
+ * @brief Handler called from an interrupt after each periodic telemetry round.
+ *
+ * @param telemetry: The new measurements.
+ */
+typedef void (*s1_telemetry_handler_t)(s1_telemetry_t const *telemetry);
+
+/**
+ * @brief Starts sampling the battery voltage, charger input voltage, charge
+ *        current and temperature periodically. Each round selects the AMUX
+ *        channels over I2C and samples them with the SAADC. The AMUX is then
+ *        turned off until the next round. Rounds are skipped while the ADC is
+ *        streaming. Requires the app timer to be initialised.
+ *
+ * @param period_ms: Time between rounds.
+ *
+ * @param handler: Called after each round. Can be NULL if s1_telemetry_get()
+ *                 is used instead.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_INIT_ERROR if the app timer couldn't be started.
+ */
+s1_error_t s1_telemetry_start(uint32_t period_ms, s1_telemetry_handler_t handler);
+
+/**
+ * @brief Stops periodic telemetry sampling.
+ */
+void s1_telemetry_stop(void);
+
+/**
+ * @brief Gets the measurements from the last completed round.
+ *
+ * @param telemetry: A pointer to where the measurements will be stored.
+ */
+void s1_telemetry_get(s1_telemetry_t *telemetry);
+
+/**
+ * @brief Takes one round of measurements straight away, and waits for it.
+ *        Must not be called from an interrupt.
+ *
+ * @param telemetry: A pointer to where the measurements will be stored.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond,
+ *          S1_ADC_BUSY if the ADC stream is using the SAADC,
+ *          S1_INIT_ERROR if the SAADC couldn't start a conversion.
+ */
+s1_error_t s1_telemetry_sample(s1_telemetry_t *telemetry);
+
+/*******************************************************
+ * ADC related functions
+ *******************************************************/
+
+/**
+ * @brief Handler called from the SAADC interrupt each time a block of samples
+ *        is complete. When both ADC pins are streamed, the samples alternate
+ *        between ADC1 and ADC2.
+ *
+ * @param block: The completed block of samples.
+ *
+ * @param len: Number of samples in the block.
+ *
+ * @param context: The context pointer given in the stream configuration.
+ *
+ * @returns True if the block can be reused straight away, or false if the
+ *          application keeps it, and will return it later with
+ *          s1_adc_stream_release().
+ */
+typedef bool (*s1_adc_block_handler_t)(int16_t *block, size_t len,
+                                       void *context);
+
+/**
+ * @brief Configuration of a continuous ADC stream. The buffers are split into
+ *        block_count blocks of block_len samples each, which the SAADC fills
+ *        in turn using EasyDMA.
+ */
+typedef struct
+{
+    uint32_t sample_rate_hz;
+    bool adc1;
+    bool adc2;
+    int16_t *buffers;
+    size_t block_len;
+    size_t block_count;
+    s1_adc_block_handler_t handler;
+    void *context;
+} s1_adc_stream_config_t;
+
+/**
+ * @brief Starts sampling the ADC1 and/or ADC2 pins continuously at a fixed
+ *        rate. A timer triggers each sample through PPI, so the CPU is only
+ *        involved once per block. The SAADC always has the next block queued
+ *        while one is being handled, so there's no gap between blocks as long
+ *        as the application returns them in time. Telemetry sampling is paused
+ *        while streaming.
+ *
+ * @param config: The stream configuration. It's copied, but the buffers must
+ *                stay valid until s1_adc_stream_stop() is called.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_ADC_INVALID_VALUE if the rate, pins or blocks aren't valid,
+ *          S1_INIT_ERROR if the timer, PPI or SAADC couldn't be set up.
+ */
+s1_error_t s1_adc_stream_start(s1_adc_stream_config_t const *config);
+
+/**
+ * @brief Returns a block which was kept by the block handler, so that it can
+ *        be filled again. Can be called from an interrupt.
+ *
+ * @param block: The block given to the handler.
+ */
+void s1_adc_stream_release(int16_t const *block);
+
+/**
+ * @brief Gets the number of times the stream ran out of free blocks. Sampling
+ *        pauses each time this happens, and resumes once a block is released.
+ *
+ * @returns The number of overruns since the stream was started.
+ */
+uint32_t s1_adc_stream_get_overruns(void);
+
+/**
+ * @brief Stops the ADC stream. Any partly filled blocks are discarded.
+ */
+void s1_adc_stream_stop(void);
+
+/**
+ * @brief Counters for the ADC to FPGA pipeline.
+ */
+typedef struct
+{
+    uint32_t blocks_sent;
+    uint32_t blocks_dropped;
+    uint32_t adc_overruns;
+} s1_adc_fpga_stats_t;
+
+/**
+ * @brief Streams the ADC pins straight into the FPGA. Each completed block is
+ *        sent from its DMA buffer with fpga_tx_rx_async(), without being
+ *        copied, and goes back to the SAADC once the transfer is done. Blocks
+ *        are dropped if the SPI queue is full. The FPGA must already be
+ *        booted.
+ *
+ * @param config: The stream configuration, as for s1_adc_stream_start(). The
+ *                handler and context aren't used, and each block must fit in
+ *                one SPI transfer.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_ADC_INVALID_VALUE if the rate, pins or blocks aren't valid,
+ *          S1_INIT_ERROR if the SPI bus, timer, PPI or SAADC couldn't be set
+ *          up.
+ */
+s1_error_t s1_adc_fpga_start(s1_adc_stream_config_t const *config);
+
+/**
+ * @brief Gets the pipeline counters since it was started.
+ *
+ * @param stats: A pointer to where the counters will be stored.
+ */
+void s1_adc_fpga_get_stats(s1_adc_fpga_stats_t *stats);
+
+/**
+ * @brief Stops the ADC to FPGA pipeline, and waits for any blocks still on
+ *        the SPI bus. Must not be called from an interrupt.
+ */
+void s1_adc_fpga_stop(void);
+
+/*******************************************************
+ * SPI bus related functions
+ *******************************************************/
+
+/**
+ * @brief Devices which share the SPI bus. The flash chip select is active low,
+ *        whereas the FPGA chip select is active high.
+ */
+typedef enum
+{
+    S1_SPI_FLASH = 0,
+    S1_SPI_FPGA,
+} s1_spi_target_t;
+
+/**
+ * @brief Handler for when an asynchronous SPI transfer has completed. This is
+ *        called from the SPI interrupt, so keep it short. It's safe to start
+ *        another transfer from within the handler.
+ *
+ * @param err: S1_SUCCESS if every transfer of the batch ran, or
+ *             S1_FLASH_FPGA_COMMUNICATION_ERROR if the driver refused to start
+ *             one of them. The rest of the batch is then skipped.
+ *
+ * @param context: The context pointer given when the transfer was started.
+ */
+typedef void (*s1_spi_handler_t)(s1_error_t err, void *context);
+
+/**
+ * @brief Describes one transfer on the SPI bus. The chip select is asserted for
+ *        the duration of the transfer, and released once it's done unless
+ *        cs_hold is set. Holding the chip select lets the next transfer in the
+ *        same batch continue the same command, for example to split a long
+ *        read into several EasyDMA transfers. The last transfer of a batch
+ *        should not hold the chip select.
+ */
+typedef struct
+{
+    uint8_t *tx_buffer;
+    size_t tx_len;
+    uint8_t *rx_buffer;
+    size_t rx_len;
+    s1_spi_target_t target;
+    bool cs_hold;
+} s1_spi_xfer_t;
+
+/**
+ * @brief Number of transfers which can wait in the SPI queue at once. Can be
+ *        overridden from sdk_config.h, but must be at least 2 so that a
+ *        command and its data can be queued together.
+ */
+#ifndef S1_SPI_QUEUE_SIZE
+#define S1_SPI_QUEUE_SIZE 8
+#endif
+
+/**
+ * @brief Opens a session on the SPI bus to the flash and FPGA. The driver is
+ *        initialised once, and stays initialised for every following transfer
+ *        until s1_spi_close() is called. Calling this is optional, as the first
+ *        flash or FPGA transfer will open the session automatically.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_INIT_ERROR if the SPI resources are already used.
+ */
+s1_error_t s1_spi_open(void);
+
+/**
+ * @brief Selects which device the chip select line is driven for. This only
+ *        changes the idle level of the chip select, so it's cheap to call
+ *        between transfers. flash_tx_rx() and fpga_tx_rx() call this for you.
+ *
+ * @param target: The device to select.
+ */
+void s1_spi_select(s1_spi_target_t target);
+
+/**
+ * @brief Queues a batch of transfers on the SPI bus. They are run back to back
+ *        in order from the SPI interrupt, so there is no CPU round-trip
+ *        between them. The chip select is released after each transfer,
+ *        unless its cs_hold is set, in which case the next transfer continues
+ *        the same command. The last transfer of a batch must not set cs_hold,
+ *        as batches queued from elsewhere may run straight after it. The
+ *        descriptors are copied, but the buffers they point to must stay valid
+ *        until the batch completes.
+ *
+ * @param xfers: Array of transfers to run.
+ *
+ * @param count: Number of transfers in the array.
+ *
+ * @param handler: Called once the last transfer in the batch is complete. Can
+ *                 be NULL.
+ *
+ * @param context: Pointer passed back to the handler.
+ *
+ * @returns S1_SUCCESS if the batch was queued,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the queue doesn't have room for
+ *          the whole batch, the last transfer holds the chip select, the bus
+ *          is busy configuring the FPGA, or the buffers are not within the ram
+ *          region.
+ */
+s1_error_t s1_spi_queue(s1_spi_xfer_t const *xfers, size_t count,
+                        s1_spi_handler_t handler, void *context);
+
+/**
+ * @brief Checks if any queued or asynchronous transfers are still in flight on
+ *        the SPI bus. Can be used as an event flag instead of a handler.
+ *
+ * @return True if busy,
+ *         False if idle.
+ */
+bool s1_spi_is_busy(void);
+
+/**
+ * @brief Closes the SPI session and releases the bus pins as inputs. This is
+ *        called by s1_fpga_boot() so the FPGA can read from the flash.
+ */
+void s1_spi_close(void);
+
+/*******************************************************
+ * Flash related functions
+ *******************************************************/
+
+/**
+ * @brief Wakes up the flash if it's asleep.
+ *
+ * @return S1_SUCCESS if okay,
+ *         S1_FLASH_ERROR if the flash IC did not respond as expected.
+ */
+s1_error_t s1_flash_wakeup(void);
+
+/**
+ * @brief Fully erases the flash chip.
+ */
+void s1_flash_erase_all(void);
+
+/**
+ * @brief Sizes of the sector and block erases supported by the flash.
+ */
+#define S1_FLASH_ERASE_4K 0x1000
+#define S1_FLASH_ERASE_32K 0x8000
+#define S1_FLASH_ERASE_64K 0x10000
+
+/**
+ * @brief A single erase operation, as returned by s1_flash_erase_plan().
+ */
+typedef struct
+{
+    uint32_t address;
+    uint32_t size;
+} s1_flash_erase_t;
+
+/**
+ * @brief Starts erasing a 4KB sector, or a 32KB or 64KB block of the flash.
+ *        Like s1_flash_erase_all(), this returns straight away, and
+ *        s1_flash_is_busy() can be used to check when the erase is complete.
+ *
+ * @param address: Start address. Must be aligned to the size of the erase.
+ *
+ * @param size: S1_FLASH_ERASE_4K, S1_FLASH_ERASE_32K or S1_FLASH_ERASE_64K.
+ *
+ * @return S1_SUCCESS if okay,
+ *         S1_FLASH_INVALID_VALUE if the size or alignment is incorrect,
+ *         S1_FLASH_FPGA_COMMUNICATION_ERROR if the erase couldn't be sent.
+ */
+s1_error_t s1_flash_erase(uint32_t address, uint32_t size);
+
+/**
+ * @brief Plans the fewest sector and block erases which cover a byte range.
+ *        The range is rounded out to whole 4KB sectors, as that's the smallest
+ *        area the flash can erase. No sector outside of that is touched.
+ *
+ * @param address: Start of the range.
+ *
+ * @param len: Length of the range in bytes.
+ *
+ * @param plan: Array where the erases will be stored. Can be NULL if plan_len
+ *              is 0, to only count the erases.
+ *
+ * @param plan_len: Number of entries the plan array can hold.
+ *
+ * @return The number of erases needed. If this is larger than plan_len, only
+ *         the first plan_len erases are stored.
+ */
+size_t s1_flash_erase_plan(uint32_t address, size_t len,
+                           s1_flash_erase_t *plan, size_t plan_len);
+
+/**
+ * @brief Erases a byte range of the flash using the erases planned by
+ *        s1_flash_erase_plan(), and waits until they are complete. Erase time
+ *        therefore scales with the size of the range, not the flash.
+ *
+ * @param address: Start of the range.
+ *
+ * @param len: Length of the range in bytes.
+ *
+ * @return S1_SUCCESS if okay,
+ *         S1_FLASH_INVALID_VALUE if the range is outside of the flash,
+ *         S1_FLASH_FPGA_COMMUNICATION_ERROR if an erase couldn't be sent.
+ */
+s1_error_t s1_flash_erase_range(uint32_t address, size_t len);
+
+/**
+ * @brief Checks if the flash is currently busy with an erase or write operation.
+ *
+ * @return True if busy,
+ *         False if idle.
+ */
+bool s1_flash_is_busy(void);
+
+/**
+ * @brief Flashes a page to the flash at a given offset.
+ *
+ * @param offset: Page offset to flash.
+ *
+ * @param image: Pointer to the start of the binary you wish to flash.
+ */
+void s1_flash_page_from_image(uint32_t offset,
+                              unsigned char *image);
+
+/**
+ * @brief Handler which reports the throughput of s1_flash_program().
+ *
+ * @param bytes: Size of the image that was programmed.
+ *
+ * @param bytes_per_second: Average rate over the whole erase and program.
+ */
+typedef void (*s1_flash_benchmark_handler_t)(size_t bytes,
+                                             uint32_t bytes_per_second);
+
+/**
+ * @brief Sets a handler which is called at the end of every
+ *        s1_flash_program() with the achieved throughput.
+ *
+ * @param handler: The handler, or NULL to disable reporting.
+ */
+void s1_flash_set_benchmark_handler(s1_flash_benchmark_handler_t handler);
+
+/**
+ * @brief Erases and programs a full image, such as an FPGA bitstream, into the
+ *        flash. Only the area covered by the image is erased, using the
+ *        erases planned by s1_flash_erase_plan(). Pages are sent from the SPI
+ *        interrupt as soon as the flash is ready, and the next page is staged
+ *        while the current one is programming. The function returns once the
+ *        last page has finished programming.
+ *
+ * @param address: Where in the flash the image starts. Must be aligned to a
+ *                 4KB sector.
+ *
+ * @param image: Pointer to the start of the image. Can be in flash or RAM.
+ *
+ * @param len: Length of the image in bytes.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FLASH_INVALID_VALUE if the address is not aligned, or the image
+ *          doesn't fit in the flash,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the spi queue is full, or a
+ *          transfer couldn't be started.
+ */
+s1_error_t s1_flash_program(uint32_t address, unsigned char const *image,
+                            size_t len);
+
+/**
+ * @brief Same as s1_flash_program(), starting from address 0 where the FPGA
+ *        loads its bitstream from.
+ *
+ * @param image: Pointer to the start of the image. Can be in flash or RAM.
+ *
+ * @param len: Length of the image in bytes.
  *
- * @returns S1_SUCCESS if okay,
- *          S1_PMIC_COMMUNICATION_ERROR if the PMIC did not respond.
+ * @returns The same as s1_flash_program().
  */
-s1_error_t s1_pimc_set_vfpga(bool enable);
-
-/*******************************************************
- * Flash related functions
- *******************************************************/
+s1_error_t s1_flash_program_image(unsigned char const *image, size_t len);
 
 /**
- * @brief Wakes up the flash if it's asleep.
- *
- * @return S1_SUCCESS if okay,
- *         S1_FLASH_ERROR if the flash IC did not respond as expected.
+ * @brief Results of s1_flash_update().
  */
-s1_error_t s1_flash_wakeup(void);
+typedef struct
+{
+    uint32_t sectors_skipped;
+    uint32_t sectors_written;
+} s1_flash_update_stats_t;
 
 /**
- * @brief Fully erases the flash chip.
+ * @brief Updates an image in the flash by only rewriting the 4KB sectors which
+ *        have changed. Each sector is read back and its CRC-32 compared
+ *        against the new image. Sectors that match are skipped, the rest are
+ *        erased and programmed. The throughput is reported to the handler set
+ *        by s1_flash_set_benchmark_handler().
+ *
+ * @param address: Where in the flash the image starts. Must be aligned to a
+ *                 4KB sector.
+ *
+ * @param image: Pointer to the start of the image. Can be in flash or RAM.
+ *
+ * @param len: Length of the image in bytes.
+ *
+ * @param stats: Where the number of skipped and written sectors is stored.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FLASH_INVALID_VALUE if the address is not aligned, or the image
+ *          doesn't fit in the flash,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the spi queue is full, or a
+ *          transfer couldn't be started. A sector which can't be read back is
+ *          reported rather than rewritten.
  */
-void s1_flash_erase_all(void);
+s1_error_t s1_flash_update(uint32_t address, unsigned char const *image,
+                           size_t len, s1_flash_update_stats_t *stats);
 
 /**
- * @brief Checks if the flash is currently busy with an erase or write operation.
+ * @brief Same as s1_flash_update(), starting from address 0 where the FPGA
+ *        loads its bitstream from.
  *
- * @return True if busy,
- *         False if idle.
+ * @param image: Pointer to the start of the image. Can be in flash or RAM.
+ *
+ * @param len: Length of the image in bytes.
+ *
+ * @param stats: Where the number of skipped and written sectors is stored.
+ *
+ * @returns The same as s1_flash_update().
  */
-bool s1_flash_is_busy(void);
+s1_error_t s1_flash_update_image(unsigned char const *image, size_t len,
+                                 s1_flash_update_stats_t *stats);
 
 /**
- * @brief Flashes a page to the flash at a given offset.
+ * @brief Reads data from the flash using the fast read command. Reads of any
+ *        length are split into the largest transfers EasyDMA allows, and the
+ *        data is received directly into the buffer. Long reads are sent as
+ *        several fast reads, one for each batch of queued transfers.
  *
- * @param offset: Page offset to flash.
+ * @param address: Address to start reading from.
  *
- * @param image: Pointer to the start of the binary you wish to flash.
+ * @param buffer: Where the data will be stored. Must be in RAM.
+ *
+ * @param len: Number of bytes to read.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FLASH_INVALID_VALUE if the read goes past the end of the flash,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the buffer is not within the
+ *          ram region. i.e not writable.
  */
-void s1_flash_page_from_image(uint32_t offset,
-                              unsigned char *image);
+s1_error_t s1_flash_read(uint32_t address, uint8_t *buffer, size_t len);
 
 /**
- * @brief Performs a transfer on the SPI bus to the flash IC.
+ * @brief Performs a transfer on the SPI bus to the flash IC, and waits until
+ *        it completes. The wait relies on the SPI interrupt, so this and the
+ *        other blocking flash and FPGA functions must not be called where that
+ *        interrupt can't run.
  *
  * @param tx_buffer: A pointer to where the transmit data is stored.
  *
@@ -250,15 +1082,51 @@ void s1_flash_page_from_image(uint32_t offset,
  *
  * @returns S1_SUCCESS if okay,
  *          S1_FLASH_FPGA_COMMUNICATION_ERROR if spi bus is busy, or the buffers
- *          are not within the ram region. i.e not writable.
+ *          are not within the ram region. i.e not writable,
+ *          S1_BLOCKED_IN_INTERRUPT if called with interrupts disabled, or from
+ *          an interrupt at the same or higher priority than the SPI interrupt.
+ *          flash_tx_rx_async() can be used there instead.
  */
 s1_error_t flash_tx_rx(uint8_t *tx_buffer, size_t tx_len,
                        uint8_t *rx_buffer, size_t rx_len);
 
+/**
+ * @brief Starts a transfer on the SPI bus to the flash IC, and returns
+ *        immediately while EasyDMA moves the data. The buffers must stay valid
+ *        until the transfer completes.
+ *
+ * @param tx_buffer: A pointer to where the transmit data is stored.
+ *
+ * @param tx_len: Length of the transmit data buffer in bytes.
+ *
+ * @param rx_buffer: A pointer to to where the receive data will be stored.
+ *
+ * @param rx_len: Length of the receive buffer in bytes.
+ *
+ * @param handler: Called once the transfer is complete. Can be NULL if
+ *                 s1_spi_is_busy() is polled instead.
+ *
+ * @param context: Pointer passed back to the handler.
+ *
+ * @returns S1_SUCCESS if the transfer started,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the spi queue is full, or the
+ *          buffers are not within the ram region. i.e not writable.
+ */
+s1_error_t flash_tx_rx_async(uint8_t *tx_buffer, size_t tx_len,
+                             uint8_t *rx_buffer, size_t rx_len,
+                             s1_spi_handler_t handler, void *context);
+
 /*******************************************************
  * FPGA related functions
  *******************************************************/
 
+/**
+ * @brief Handler called from the CDONE interrupt once the FPGA has booted.
+ *
+ * @param boot_time_us: Time from CRESET release until CDONE went high.
+ */
+typedef void (*s1_fpga_boot_handler_t)(uint32_t boot_time_us);
+
 /**
  * @brief Puts the FPGA into reset. It's recommended to wait 200uS before a
  *        subsequent flash or fpga operation.
@@ -272,6 +1140,27 @@ void s1_fpga_hold_reset(void);
  */
 void s1_fpga_boot(void);
 
+/**
+ * @brief Configures the FPGA directly from the nRF using the iCE40 SPI slave
+ *        mode, bypassing the external flash. The image can be in ram or in
+ *        internal flash, and is streamed in EasyDMA chunks. The flash is left
+ *        in deep power down, so call s1_flash_wakeup() before using it again.
+ *        If configuration succeeds, s1_pmic_vfpga_search() may send the same
+ *        image again, so it must stay valid until s1_fpga_boot() or another
+ *        configuration replaces it.
+ *
+ * @param bitstream: Pointer to the FPGA bitstream.
+ *
+ * @param len: Length of the bitstream in bytes.
+ *
+ * @returns S1_SUCCESS if the FPGA reported CDONE,
+ *          S1_INIT_ERROR if the SPI driver could not be initialised,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if a transfer couldn't be queued,
+ *          S1_FPGA_CONFIGURATION_ERROR if CDONE didn't go high.
+ */
+s1_error_t s1_fpga_configure_from_buffer(unsigned char const *bitstream,
+                                         size_t len);
+
 /**
  * @brief Checks if the CDONE pin on the FPGA has gone high which tells us the
  *        device has correctly configured. Note that this pin may not activate
@@ -284,7 +1173,79 @@ void s1_fpga_boot(void);
 bool s1_fpga_is_booted(void);
 
 /**
- * @brief Performs a transfer on the SPI bus to the FPGA.
+ * @brief Waits for the CDONE interrupt after s1_fpga_boot() or
+ *        s1_fpga_configure_from_buffer(), and clears it like
+ *        s1_fpga_is_booted() does.
+ *
+ * @param timeout_ms: How long to wait before giving up.
+ *
+ * @returns S1_SUCCESS if booted,
+ *          S1_FPGA_BOOT_TIMEOUT if CDONE didn't go high in time.
+ */
+s1_error_t s1_fpga_wait_booted(uint32_t timeout_ms);
+
+/**
+ * @brief Sets a handler to be called from the CDONE interrupt each time the
+ *        FPGA boots. Pass NULL to remove it.
+ *
+ * @param handler: Function which receives the boot time.
+ */
+void s1_fpga_set_boot_handler(s1_fpga_boot_handler_t handler);
+
+/**
+ * @brief Gets the time the last boot took, from CRESET release until CDONE went
+ *        high. Measured with the app timer, so app_timer_init() must have been
+ *        called and the low frequency clock must be running, otherwise this
+ *        returns 0.
+ *
+ * @returns The boot time in microseconds, or 0 if it hasn't booted yet.
+ */
+uint32_t s1_fpga_get_boot_time_us(void);
+
+/**
+ * @brief Handler for the FPGA doorbell. Called from an interrupt, so keep it
+ *        short, for example by queueing an async read of whatever the FPGA has
+ *        ready.
+ *
+ * @param context: The context pointer given when the doorbell was enabled.
+ */
+typedef void (*s1_fpga_doorbell_handler_t)(void *context);
+
+/**
+ * @brief Uses the INT pin as a data ready doorbell once the FPGA has booted.
+ *        INT shares the CDONE line, which stays high after boot, so the FPGA
+ *        application must take it low while idle, then raise it to signal the
+ *        nRF, rather than the nRF polling status registers. Each rising edge
+ *        after the doorbell is enabled calls the handler from the GPIOTE
+ *        interrupt. The level of the line when enabling it doesn't count as a
+ *        ring. The doorbell is turned off whenever the FPGA is reset, so that
+ *        the next CDONE edge is seen as a boot again.
+ *
+ * @param handler: Called for each rising edge on INT.
+ *
+ * @param context: Pointer passed back to the handler.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FPGA_NOT_BOOTED if CDONE hasn't gone high since the last reset.
+ */
+s1_error_t s1_fpga_doorbell_enable(s1_fpga_doorbell_handler_t handler,
+                                   void *context);
+
+/**
+ * @brief Stops using the INT pin as a doorbell.
+ */
+void s1_fpga_doorbell_disable(void);
+
+/**
+ * @brief Gets the number of times the doorbell has rung since it was enabled.
+ *
+ * @returns The number of rising edges seen on INT.
+ */
+uint32_t s1_fpga_doorbell_get_count(void);
+
+/**
+ * @brief Performs a transfer on the SPI bus to the FPGA, and waits until it
+ *        completes.
  *
  * @param tx_buffer: A pointer to where the transmit data is stored.
  *
@@ -298,19 +1259,223 @@ bool s1_fpga_is_booted(void);
  *
  * @returns S1_SUCCESS if okay,
  *          S1_FLASH_FPGA_COMMUNICATION_ERROR if spi bus is busy, or the buffers
- *          are not within the ram region. i.e not writable.
+ *          are not within the ram region. i.e not writable,
+ *          S1_BLOCKED_IN_INTERRUPT if called with interrupts disabled, or from
+ *          an interrupt at the same or higher priority than the SPI interrupt.
+ *          fpga_tx_rx_async() can be used there instead.
  */
 s1_error_t fpga_tx_rx(uint8_t *tx_buffer, size_t tx_len,
                       uint8_t *rx_buffer, size_t rx_len);
 
+/**
+ * @brief Starts a transfer on the SPI bus to the FPGA, and returns immediately
+ *        while EasyDMA moves the data. The buffers must stay valid until the
+ *        transfer completes.
+ *
+ * @param tx_buffer: A pointer to where the transmit data is stored.
+ *
+ * @param tx_len: Length of the transmit data buffer in bytes.
+ *
+ * @param rx_buffer: A pointer to to where the receive data will be stored.
+ *
+ * @param rx_len: Length of the receive buffer in bytes.
+ *
+ * @param handler: Called once the transfer is complete. Can be NULL if
+ *                 s1_spi_is_busy() is polled instead.
+ *
+ * @param context: Pointer passed back to the handler.
+ *
+ * @returns S1_SUCCESS if the transfer started,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the spi queue is full, or the
+ *          buffers are not within the ram region. i.e not writable.
+ */
+s1_error_t fpga_tx_rx_async(uint8_t *tx_buffer, size_t tx_len,
+                            uint8_t *rx_buffer, size_t rx_len,
+                            s1_spi_handler_t handler, void *context);
+
+/**
+ * @brief Register operations for the framed FPGA protocol. A frame packs any
+ *        number of accesses into one chip select, each as an opcode, address
+ *        and length byte followed by the data. Reads clock out dummy bytes
+ *        while the FPGA returns the data. The frame ends with an end opcode
+ *        (0x00) and a CRC-16/CCITT of everything before it. The FPGA then
+ *        answers with a status byte (0xA5 if the CRC matched), and a CRC-16
+ *        of everything it sent. Writes only take effect if the CRC matched.
+ *        s1_verilog/s1_reg_slave.v is a reference implementation for the FPGA.
+ */
+typedef enum
+{
+    S1_FPGA_REG_WRITE = 0x01,
+    S1_FPGA_REG_READ = 0x02,
+} s1_fpga_reg_op_t;
+
+/**
+ * @brief One register access within a frame. Registers are 8 bits wide, and
+ *        the address increments after each byte.
+ */
+typedef struct
+{
+    s1_fpga_reg_op_t op;
+    uint8_t address;
+    uint8_t *data;
+    uint8_t len;
+} s1_fpga_reg_access_t;
+
+/**
+ * @brief Largest frame which can be sent, including the 3 byte header of each
+ *        access and the 6 byte trailer. Can be overridden from sdk_config.h.
+ */
+#ifndef S1_FPGA_FRAME_SIZE
+#define S1_FPGA_FRAME_SIZE 256
+#endif
+
+/**
+ * @brief Performs several register reads and writes on the FPGA in one SPI
+ *        transfer. Accesses happen in order, so a read sees earlier writes
+ *        within the same frame. Must not be called from an interrupt.
+ *
+ * @param accesses: The accesses to perform. Read data is stored into their
+ *                  data buffers.
+ *
+ * @param count: Number of accesses.
+ *
+ * @returns S1_SUCCESS if okay,
+ *          S1_FPGA_FRAME_ERROR if an access is invalid, or they don't fit in
+ *          S1_FPGA_FRAME_SIZE,
+ *          S1_FPGA_CRC_ERROR if either CRC failed, in which case none of the
+ *          writes took effect,
+ *          S1_FLASH_FPGA_COMMUNICATION_ERROR if the spi bus is busy.
+ */
+s1_error_t s1_fpga_reg_batch(s1_fpga_reg_access_t const *accesses,
+                             size_t count);
+
+/**
+ * @brief Writes consecutive registers on the FPGA using a single frame.
+ *
+ * @param address: The first register.
+ *
+ * @param data: The values to write.
+ *
+ * @param len: Number of registers to write.
+ *
+ * @returns As for s1_fpga_reg_batch().
+ */
+s1_error_t s1_fpga_reg_write(uint8_t address, uint8_t const *data, uint8_t len);
+
+/**
+ * @brief Reads consecutive registers from the FPGA using a single frame.
+ *
+ * @param address: The first register.
+ *
+ * @param data: A pointer to where the values will be stored.
+ *
+ * @param len: Number of registers to read.
+ *
+ * @returns As for s1_fpga_reg_batch().
+ */
+s1_error_t s1_fpga_reg_read(uint8_t address, uint8_t *data, uint8_t len);
+
+/*******************************************************
+ * RTT data streaming functions
+ *******************************************************/
+
+/**
+ * @brief Sets up an RTT up channel for streaming binary data, such as ADC
+ *        samples or FPGA data, to the host. Logs stay on channel 0, so the two
+ *        never interleave. The number of channels is set by
+ *        SEGGER_RTT_CONFIG_MAX_NUM_UP_BUFFERS in sdk_config.h, which must be
+ *        at least 2. Use s1_tools/s1_stream_read.py to save the data on the
+ *        host.
+ *
+ * @param channel: The RTT channel, from 1 up to
+ *                 SEGGER_RTT_CONFIG_MAX_NUM_UP_BUFFERS - 1.
+ *
+ * @param name: Name which the host sees for the channel. It must stay valid.
+ *
+ * @param buffer: Buffer for the channel, which must stay valid while it's in
+ *                use. It should hold all the data written between two polls
+ *                of the debugger, which are typically 1 to 10ms apart.
+ *
+ * @param size: Size of the buffer in bytes.
+ *
+ * @returns S1_SUCCESS if the channel was set up, or
+ *          S1_STREAM_INVALID_CHANNEL if the channel doesn't exist, or the
+ *          buffer is empty.
+ */
+s1_error_t s1_stream_open(uint8_t channel, char const *name, void *buffer,
+                          size_t size);
+
+/**
+ * @brief Writes a block of data to a stream channel. It never blocks. If the
+ *        whole block doesn't fit into the channel's buffer, none of it is
+ *        written, so the host only ever sees whole blocks. Safe to call from
+ *        interrupts.
+ *
+ * @param channel: A channel set up with s1_stream_open().
+ *
+ * @param data: The data to write.
+ *
+ * @param len: Length of the data in bytes.
+ *
+ * @returns S1_SUCCESS if the block was written,
+ *          S1_STREAM_FULL if it was dropped because the host hasn't kept up, or
+ *          S1_STREAM_INVALID_CHANNEL if the channel isn't set up.
+ */
+s1_error_t s1_stream_write(uint8_t channel, void const *data, size_t len);
+
+/**
+ * @brief Gets the number of blocks dropped from a stream channel because its
+ *        buffer was full.
+ *
+ * @param channel: A channel set up with s1_stream_open().
+ *
+ * @returns The number of dropped blocks since the channel was set up.
+ */
+uint32_t s1_stream_get_dropped(uint8_t channel);
+
 /*******************************************************
  * RTT based logging macros
  *******************************************************/
 
+/**
+ * @brief Size of the buffer each log message is formatted into. This is on the
+ *        stack of whoever calls LOG(), so keep it small. Longer messages are
+ *        truncated. Can be overridden from sdk_config.h.
+ */
+#ifndef S1_LOG_BUFFER_SIZE
+#define S1_LOG_BUFFER_SIZE 256
+#endif
+
+/**
+ * @brief Set S1_LOG_TOKENISED to 1 to send logs as compact binary records
+ *        rather than text. Deferred logs then only send a 16 bit token for the
+ *        format string, and their arguments as variable length integers. The
+ *        format strings are kept in the .elf file, and take no flash. LOG()
+ *        and LOG_RAW() are not tokenised, as they accept floats and any number
+ *        of arguments. They're still formatted on the device and sent as text
+ *        records, which are slightly larger than plain text, so use
+ *        LOG_DEFERRED() for anything frequent. Use s1_tools/s1_log_decode.py
+ *        with the .elf file to turn a capture of the RTT output back into
+ *        text.
+ */
+#ifndef S1_LOG_TOKENISED
+#define S1_LOG_TOKENISED 0
+#endif
+
+/**
+ * @brief Writes a formatted log message to RTT, either as text, or as a text
+ *        record when S1_LOG_TOKENISED is set.
+ */
+#if S1_LOG_TOKENISED
+#define S1_LOG_WRITE(buffer, len) s1_log_text(buffer, len)
+#else
+#define S1_LOG_WRITE(buffer, len) SEGGER_RTT_Write(0, buffer, len)
+#endif
+
 /**
  * @brief Clears the terminal screen of any previous logs.
  */
-#define LOG_CLEAR() SEGGER_RTT_printf(0, RTT_CTRL_CLEAR "\r");
+#define LOG_CLEAR() LOG_RAW(RTT_CTRL_CLEAR "\r")
 
 /**
  * @brief A println style logging macro. You can use all the standard printf
@@ -329,12 +1494,263 @@ s1_error_t fpga_tx_rx(uint8_t *tx_buffer, size_t tx_len,
  *
  * @param ...: Variadic argument list for printf data.
  */
-#define LOG_RAW(format, ...)                                                                                  \
-    do                                                                                                        \
-    {                                                                                                         \
-        char _debug_log_buffer[SEGGER_RTT_CONFIG_BUFFER_SIZE_UP - 1] = "";                                    \
-        snprintf(_debug_log_buffer, SEGGER_RTT_CONFIG_BUFFER_SIZE_UP - 1, format, ##__VA_ARGS__);             \
-        SEGGER_RTT_Write(0, _debug_log_buffer, strnlen(_debug_log_buffer, SEGGER_RTT_CONFIG_BUFFER_SIZE_UP)); \
+#define LOG_RAW(format, ...)                                                             \
+    do                                                                                   \
+    {                                                                                    \
+        char _debug_log_buffer[S1_LOG_BUFFER_SIZE] = "";                                 \
+        snprintf(_debug_log_buffer, S1_LOG_BUFFER_SIZE, format, ##__VA_ARGS__);          \
+        S1_LOG_WRITE(_debug_log_buffer, strnlen(_debug_log_buffer, S1_LOG_BUFFER_SIZE)); \
+    } while (0)
+
+/**
+ * @brief Log levels, from the most to the least severe.
+ */
+#define S1_LOG_LEVEL_NONE 0
+#define S1_LOG_LEVEL_ERROR 1
+#define S1_LOG_LEVEL_WARN 2
+#define S1_LOG_LEVEL_INFO 3
+#define S1_LOG_LEVEL_DEBUG 4
+
+/**
+ * @brief The most verbose level which is logged by LOG_ERROR(), LOG_WARN(),
+ *        LOG_INFO() and LOG_DEBUG(). Can be overridden from sdk_config.h, or
+ *        with -D in the Makefile. For example, a production build might set it
+ *        to S1_LOG_LEVEL_ERROR.
+ */
+#ifndef S1_LOG_LEVEL
+#define S1_LOG_LEVEL S1_LOG_LEVEL_DEBUG
+#endif
+
+/**
+ * @brief Level for the current source file. Define S1_LOG_MODULE_LEVEL before
+ *        including s1.h to give a file its own level. Otherwise it uses
+ *        S1_LOG_LEVEL.
+ */
+#ifndef S1_LOG_MODULE_LEVEL
+#define S1_LOG_MODULE_LEVEL S1_LOG_LEVEL
+#endif
+
+/**
+ * @brief True if logs of the given level are enabled in the current source
+ *        file. It's a constant, so code behind it is removed when it's false.
+ */
+#define S1_LOG_ENABLED(level) ((level) <= S1_LOG_MODULE_LEVEL)
+
+/**
+ * @brief Logs a message with LOG() if its level is enabled. Otherwise the call
+ *        compiles to nothing, and its arguments are never evaluated. They're
+ *        still type checked against the format either way.
+ *
+ * @param level: One of the S1_LOG_LEVEL_... values.
+ *
+ * @param format: printf style format string.
+ *
+ * @param ...: Variadic argument list for printf data.
+ */
+#define S1_LOG_AT(level, format, ...)   \
+    do                                  \
+    {                                   \
+        if (S1_LOG_ENABLED(level))      \
+        {                               \
+            LOG(format, ##__VA_ARGS__); \
+        }                               \
     } while (0)
 
+/**
+ * @brief Leveled versions of LOG(), which add the level to the start of each
+ *        message.
+ */
+#define LOG_ERROR(format, ...)    \
+    S1_LOG_AT(S1_LOG_LEVEL_ERROR, \
+              RTT_CTRL_TEXT_BRIGHT_RED "[ERROR] " RTT_CTRL_RESET format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...)    \
+    S1_LOG_AT(S1_LOG_LEVEL_WARN, \
+              RTT_CTRL_TEXT_BRIGHT_YELLOW "[WARN] " RTT_CTRL_RESET format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) \
+    S1_LOG_AT(S1_LOG_LEVEL_INFO, "[INFO] " format, ##__VA_ARGS__)
+#define LOG_DEBUG(format, ...) \
+    S1_LOG_AT(S1_LOG_LEVEL_DEBUG, "[DEBUG] " format, ##__VA_ARGS__)
+
+/**
+ * @brief Number of log messages which can wait to be printed by
+ *        s1_log_flush(). Must be a power of two. Can be overridden from
+ *        sdk_config.h.
+ */
+#ifndef S1_LOG_DEFERRED_ENTRIES
+#define S1_LOG_DEFERRED_ENTRIES 32
+#endif
+
+/**
+ * @brief Most arguments a deferred log message can have.
+ */
+#define S1_LOG_DEFERRED_MAX_ARGS 6
+
+/**
+ * @brief Records a log message to be printed later by s1_log_flush(). Only the
+ *        format string pointer and the raw argument words are stored, so it's
+ *        quick, uses little stack, and is safe to call from interrupts. The
+ *        format must be a string literal, the arguments must be integers,
+ *        characters or pointers (no floats), and any %s strings must still
+ *        exist when the message is flushed. Up to S1_LOG_DEFERRED_MAX_ARGS
+ *        arguments are supported, and more is a compile error.
+ *
+ * @param format: printf style format string.
+ *
+ * @param ...: Variadic argument list for printf data.
+ */
+#define LOG_DEFERRED(format, ...)                                      \
+    (S1_LOG_CHECK_NARGS(S1_LOG_NARGS(__VA_ARGS__)),                    \
+     s1_log_deferred(S1_LOG_FORMAT("\r\n" format),                     \
+                     S1_LOG_NARGS(__VA_ARGS__),                        \
+                     &((uint32_t const[]){0, S1_LOG_WORDS(__VA_ARGS__)})[1]))
+
+/**
+ * @brief Puts a deferred log format string into the s1_log_fmt section when
+ *        logs are tokenised, so that its offset can be used as the token.
+ */
+#if S1_LOG_TOKENISED
+#define S1_LOG_FORMAT(format)                                      \
+    __extension__({                                                \
+        static char const _s1_log_format[]                         \
+            __attribute__((section("s1_log_fmt"), used)) = format; \
+        _s1_log_format;                                            \
+    })
+#else
+#define S1_LOG_FORMAT(format) (format)
+#endif
+
+/**
+ * @brief Helpers for LOG_DEFERRED() which count the arguments, and convert
+ *        each of them to a 32 bit word. The count goes past the maximum so
+ *        that too many arguments can be caught.
+ */
+#define S1_LOG_NARGS(...)                                                    \
+    S1_LOG_NARGS_(0, ##__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, \
+                  5, 4, 3, 2, 1, 0)
+#define S1_LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+                      _13, _14, _15, _16, n, ...) n
+#define S1_LOG_CHECK_NARGS(n)                                        \
+    ((void)sizeof(struct {                                           \
+        _Static_assert((n) <= S1_LOG_DEFERRED_MAX_ARGS,              \
+                       "Too many arguments for LOG_DEFERRED()");     \
+        int unused;                                                  \
+    }))
+#define S1_LOG_CONCAT(a, b) S1_LOG_CONCAT_(a, b)
+#define S1_LOG_CONCAT_(a, b) a##b
+#define S1_LOG_WORD(a) (uint32_t)(uintptr_t)(a)
+#define S1_LOG_WORDS(...) \
+    S1_LOG_CONCAT(S1_LOG_WORDS_, S1_LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define S1_LOG_WORDS_0()
+#define S1_LOG_WORDS_1(a) S1_LOG_WORD(a)
+#define S1_LOG_WORDS_2(a, ...) S1_LOG_WORD(a), S1_LOG_WORDS_1(__VA_ARGS__)
+#define S1_LOG_WORDS_3(a, ...) S1_LOG_WORD(a), S1_LOG_WORDS_2(__VA_ARGS__)
+#define S1_LOG_WORDS_4(a, ...) S1_LOG_WORD(a), S1_LOG_WORDS_3(__VA_ARGS__)
+#define S1_LOG_WORDS_5(a, ...) S1_LOG_WORD(a), S1_LOG_WORDS_4(__VA_ARGS__)
+#define S1_LOG_WORDS_6(a, ...) S1_LOG_WORD(a), S1_LOG_WORDS_5(__VA_ARGS__)
+
+/**
+ * @brief Stores a deferred log message. Use LOG_DEFERRED() rather than calling
+ *        this directly. If the queue is full, the message is dropped.
+ *
+ * @param format: printf style format string, which must stay valid.
+ *
+ * @param argc: Number of argument words.
+ *
+ * @param args: The argument words.
+ */
+void s1_log_deferred(char const *format, size_t argc, uint32_t const *args);
+
+/**
+ * @brief Writes a text record to RTT when logs are tokenised. LOG() and
+ *        LOG_RAW() use this through S1_LOG_WRITE().
+ *
+ * @param text: The text to send. It doesn't need to be null terminated.
+ *
+ * @param len: Length of the text. Anything over S1_LOG_BUFFER_SIZE is cut off.
+ */
+void s1_log_text(char const *text, size_t len);
+
+/**
+ * @brief Prints all waiting deferred log messages over RTT. Call it from the
+ *        main loop, or whenever the application is idle. Must not be called
+ *        from an interrupt.
+ */
+void s1_log_flush(void);
+
+/**
+ * @brief Gets the number of deferred log messages dropped because the queue
+ *        was full.
+ *
+ * @returns The number of dropped messages since startup.
+ */
+uint32_t s1_log_get_dropped(void);
+
+/*******************************************************
+ * Profiling functions
+ *******************************************************/
+
+/**
+ * @brief Set S1_PROFILE to 1 to time the SDK's hot paths with the Cortex-M4
+ *        cycle counter. When it's 0, the timing and the functions below are
+ *        compiled out entirely. Can be overridden from sdk_config.h, or with
+ *        -D in the Makefile.
+ */
+#ifndef S1_PROFILE
+#define S1_PROFILE 0
+#endif
+
+#if S1_PROFILE
+
+/**
+ * @brief The functions which are timed. Nested calls are timed separately, so
+ *        for example, s1_flash_read() also counts as an spi_queue_wait() call.
+ */
+typedef enum
+{
+    S1_PROFILE_PMIC_READ_REGS = 0,
+    S1_PROFILE_PMIC_WRITE_REG,
+    S1_PROFILE_SPI_QUEUE_WAIT,
+    S1_PROFILE_SPI_TX_RX,
+    S1_PROFILE_FLASH_PAGE_FROM_IMAGE,
+    S1_PROFILE_FLASH_READ,
+    S1_PROFILE_FLASH_PROGRAM_IMAGE,
+    S1_PROFILE_FPGA_REG_BATCH,
+    S1_PROFILE_POINTS,
+} s1_profile_point_t;
+
+/**
+ * @brief Timings of one function. Each call must take less than 2^32 cycles,
+ *        which is about 67 seconds at 64MHz.
+ */
+typedef struct
+{
+    uint32_t calls;
+    uint32_t min_cycles;
+    uint32_t max_cycles;
+    uint64_t total_cycles;
+} s1_profile_stats_t;
+
+/**
+ * @brief Gets the timings of one function.
+ *
+ * @param point: The function.
+ *
+ * @param stats: Pointer to where the timings will be stored. min_cycles is 0 if
+ *               there haven't been any calls.
+ */
+void s1_profile_get(s1_profile_point_t point, s1_profile_stats_t *stats);
+
+/**
+ * @brief Clears the timings of all functions.
+ */
+void s1_profile_reset(void);
+
+/**
+ * @brief Logs the call count, and the min, max and mean time of each function
+ *        which has been called, over RTT.
+ */
+void s1_profile_dump(void);
+
+#endif
+
 #endif
\ No newline at end of file
@@ -22,38 +22,159 @@
  * PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include "app_timer.h"
+#include "nrf_delay.h"
+#include "nrfx_clock.h"
+#include "nrf52811.h"
 #include "s1.h"
 
 /**
- * @brief Macro for logging passed tests in green.
+ * @brief Area at the top of the flash used by the programming tests, well
+ *        clear of the FPGA bitstream at address 0.
  */
-#define LOG_PASS(cond, format, ...)                                                                               \
-    do                                                                                                            \
-    {                                                                                                             \
-        if (cond)                                                                                                 \
-        {                                                                                                         \
-            char _debug_log_buffer[SEGGER_RTT_CONFIG_BUFFER_SIZE_UP - 1] = "";                                    \
-            snprintf(_debug_log_buffer, SEGGER_RTT_CONFIG_BUFFER_SIZE_UP - 1,                                     \
-                     "\r\n" RTT_CTRL_TEXT_BRIGHT_GREEN "[PASS] " RTT_CTRL_RESET format, ##__VA_ARGS__);           \
-            SEGGER_RTT_Write(0, _debug_log_buffer, strnlen(_debug_log_buffer, SEGGER_RTT_CONFIG_BUFFER_SIZE_UP)); \
-        }                                                                                                         \
+#define TEST_FLASH_SCRATCH_ADDRESS 0x3F0000
+
+/**
+ * @brief Macro for logging passed tests in green. These are logged at the info
+ *        level, so building with S1_LOG_LEVEL set to S1_LOG_LEVEL_ERROR only
+ *        prints the failures, and skips formatting the passes.
+ */
+#define LOG_PASS(cond, format, ...)                                                         \
+    do                                                                                      \
+    {                                                                                       \
+        if (S1_LOG_ENABLED(S1_LOG_LEVEL_INFO) && (cond))                                    \
+        {                                                                                   \
+            LOG(RTT_CTRL_TEXT_BRIGHT_GREEN "[PASS] " RTT_CTRL_RESET format, ##__VA_ARGS__); \
+        }                                                                                   \
     } while (0)
 
 /**
- * @brief Macro for logging failed tests in red.
+ * @brief Macro for logging failed tests in red, at the error level.
  */
-#define LOG_FAIL(cond, format, ...)                                                                               \
-    do                                                                                                            \
-    {                                                                                                             \
-        if (cond)                                                                                                 \
-        {                                                                                                         \
-            char _debug_log_buffer[SEGGER_RTT_CONFIG_BUFFER_SIZE_UP - 1] = "";                                    \
-            snprintf(_debug_log_buffer, SEGGER_RTT_CONFIG_BUFFER_SIZE_UP - 1,                                     \
-                     "\r\n" RTT_CTRL_TEXT_BRIGHT_RED "[FAIL] " RTT_CTRL_RESET format, ##__VA_ARGS__);             \
-            SEGGER_RTT_Write(0, _debug_log_buffer, strnlen(_debug_log_buffer, SEGGER_RTT_CONFIG_BUFFER_SIZE_UP)); \
-        }                                                                                                         \
+#define LOG_FAIL(cond, format, ...)                                                       \
+    do                                                                                    \
+    {                                                                                     \
+        if (S1_LOG_ENABLED(S1_LOG_LEVEL_ERROR) && (cond))                                 \
+        {                                                                                 \
+            LOG(RTT_CTRL_TEXT_BRIGHT_RED "[FAIL] " RTT_CTRL_RESET format, ##__VA_ARGS__); \
+        }                                                                                 \
     } while (0)
 
+/**
+ * @brief Set by spi_done_handler() once an asynchronous transfer completes
+ *        successfully.
+ */
+static volatile bool spi_done_flag = false;
+
+/**
+ * @brief Completion handler used for the asynchronous SPI tests.
+ */
+static void spi_done_handler(s1_error_t err, void *context)
+{
+    (void)context;
+    spi_done_flag = err == S1_SUCCESS;
+}
+
+/**
+ * @brief Result passed to pmic_done_handler(), and whether it has been called.
+ */
+static volatile s1_error_t pmic_done_err = S1_SUCCESS;
+static volatile bool pmic_done_flag = false;
+
+/**
+ * @brief Completion handler used for the asynchronous PMIC tests.
+ */
+static void pmic_done_handler(s1_error_t err, void *context)
+{
+    (void)context;
+    pmic_done_err = err;
+    pmic_done_flag = true;
+}
+
+/**
+ * @brief Logs the throughput reported by s1_flash_program().
+ */
+static void flash_benchmark_handler(size_t bytes, uint32_t bytes_per_second)
+{
+    LOG_INFO("Programmed %u bytes at %lu bytes/s",
+        bytes,
+        bytes_per_second);
+}
+
+/**
+ * @brief Boot time reported by fpga_boot_handler().
+ */
+static volatile uint32_t fpga_boot_time_us = 0;
+
+/**
+ * @brief Records the boot time passed to the CDONE handler.
+ */
+static void fpga_boot_handler(uint32_t boot_time_us)
+{
+    fpga_boot_time_us = boot_time_us;
+}
+
+/**
+ * @brief Number of times vfpga_self_test() has been called.
+ */
+static uint32_t vfpga_self_test_calls = 0;
+
+/**
+ * @brief Stand in for a design's self test, which only passes at or above the
+ *        voltage in mV that the context points to.
+ */
+static bool vfpga_self_test(void *context)
+{
+    uint32_t vfpga_mv = 0;
+    vfpga_self_test_calls++;
+    s1_pmic_get_vfpga_mv(&vfpga_mv);
+    return vfpga_mv >= *(uint32_t *)context;
+}
+
+/**
+ * @brief Blocks for the ADC stream test, and how many have been filled.
+ */
+static int16_t adc_stream_buffers[4 * 64];
+static volatile uint32_t adc_stream_blocks = 0;
+
+/**
+ * @brief Counts completed ADC blocks, and hands them straight back.
+ */
+static bool adc_block_handler(int16_t *block, size_t len, void *context)
+{
+    (void)block;
+    (void)len;
+    (void)context;
+    adc_stream_blocks++;
+    return true;
+}
+
+/**
+ * @brief Buffer for the RTT data stream test. Blocks of this size or larger
+ *        can never fit, as RTT keeps one byte of the buffer free.
+ */
+static uint8_t stream_buffer[64];
+
+/**
+ * @brief Doorbell handler. Counts rings into the context, which should match
+ *        s1_fpga_doorbell_get_count().
+ */
+static void fpga_doorbell_handler(void *context)
+{
+    if (context != NULL)
+    {
+        (*(volatile uint32_t *)context)++;
+    }
+}
+
+/**
+ * @brief The app timer only needs the low frequency clock started.
+ */
+static void clock_event_handler(nrfx_clock_evt_type_t event)
+{
+    (void)event;
+}
+
 /**
  * @brief Test application.
  */
@@ -74,8 +195,40 @@ int main(void)
     LOG_PASS(err == S1_SUCCESS, "S1 started");
     LOG_FAIL(err != S1_SUCCESS, "S1 init error. Code: %d", err);
 
+    // Deferred logs should come out in order once flushed
+    LOG_DEFERRED("[INFO] Deferred log without arguments");
+    LOG_DEFERRED("[INFO] Deferred log of %d, %s and 0x%02X", -1, "a string", 0xA5);
+    s1_log_flush();
+
+    // Filling the queue should drop the overflow, rather than block
+    uint32_t log_dropped = s1_log_get_dropped();
+    for (uint32_t i = 0; i < S1_LOG_DEFERRED_ENTRIES + 4; i++)
+    {
+        LOG_DEFERRED("[INFO] Deferred log %lu", i);
+    }
+    log_dropped = s1_log_get_dropped() - log_dropped;
+    s1_log_flush();
+    LOG_FAIL(log_dropped != 4, "%lu deferred logs were dropped instead of 4", log_dropped);
+    LOG_PASS(log_dropped == 4, "Deferred log queue dropped its overflow");
+
+    // Data streams can't use the log channel
+    err = s1_stream_open(0, "Data", stream_buffer, sizeof(stream_buffer));
+    LOG_FAIL(err != S1_STREAM_INVALID_CHANNEL, "Stream opened on the log channel");
+
+    // Blocks should be written whole, or dropped whole without blocking
+    err = s1_stream_open(1, "Data", stream_buffer, sizeof(stream_buffer));
+    LOG_FAIL(err != S1_SUCCESS, "Stream open error. Code: %d", err);
+    static uint8_t const stream_block[sizeof(stream_buffer)] = {0xA5};
+    err = s1_stream_write(1, stream_block, sizeof(stream_block) / 2);
+    LOG_FAIL(err != S1_SUCCESS, "Stream write error. Code: %d", err);
+    err = s1_stream_write(1, stream_block, sizeof(stream_block));
+    LOG_FAIL(err != S1_STREAM_FULL, "Oversized stream block wasn't dropped");
+    LOG_FAIL(s1_stream_get_dropped(1) != 1, "%lu stream blocks were dropped instead of 1",
+             s1_stream_get_dropped(1));
+    LOG_PASS(s1_stream_get_dropped(1) == 1, "Data stream dropped a block that didn't fit");
+
     // Set the rails to default values
-    LOG("[INFO] Setting all rails to default values");
+    LOG_INFO("Setting all rails to default values");
     err = s1_pmic_set_vaux(3.55f);
     LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_vaux() returned the error code %d", err);
     err = s1_pmic_set_vio(3.0f, false);
@@ -84,7 +237,7 @@ int main(void)
     LOG_FAIL(err != S1_SUCCESS, "s1_pimc_set_vfpga() returned the error code %d", err);
 
     // Enable Vio and Vfpga to their nominal voltages
-    LOG("[INFO] Enabling Vfpga and Vio to their nominal voltages");
+    LOG_INFO("Enabling Vfpga and Vio to their nominal voltages");
     err = s1_pimc_set_vfpga(true);
     LOG_FAIL(err != S1_SUCCESS, "s1_pimc_set_vfpga() returned the error code %d", err);
     err = s1_pmic_set_vio(1.8f, false);
@@ -104,7 +257,7 @@ int main(void)
     LOG_PASS(vfpga_enabled == true, "Vfpga enabled correctly");
 
     // Disable Vfpga and make sure Vio disables also
-    LOG("[INFO] Disabling Vfpga and checking Vio disables also");
+    LOG_INFO("Disabling Vfpga and checking Vio disables also");
     err = s1_pimc_set_vfpga(false);
     LOG_FAIL(err != S1_SUCCESS, "s1_pimc_set_vfpga() returned the error code %d", err);
     err = s1_pimc_get_vfpga(&vfpga_enabled);
@@ -117,7 +270,7 @@ int main(void)
     LOG_PASS(vio == 0.0f, "Vio disabled automatically");
 
     // Attempt to re-enable Vio without enabling Vfpga first
-    LOG("[INFO] Attempting to re-enable Vio without enabling Vfpga first");
+    LOG_INFO("Attempting to re-enable Vio without enabling Vfpga first");
     err = s1_pmic_set_vio(1.8f, false);
     LOG_FAIL(err != S1_PMIC_VFPGA_NOT_ENABLED, "s1_pmic_set_vio() returned the error code %d", err);
     LOG_PASS(err == S1_PMIC_VFPGA_NOT_ENABLED, "Vio correctly refused to turn on in LDO mode");
@@ -127,7 +280,7 @@ int main(void)
     LOG_PASS(err == S1_PMIC_VFPGA_NOT_ENABLED, "Vio correctly refused to turn on in LSW mode");
 
     // Enable Vfpga again, and attempt to set Vio out of normal ranges
-    LOG("[INFO] Enabling Vfpga for Vio range tests");
+    LOG_INFO("Enabling Vfpga for Vio range tests");
     err = s1_pimc_set_vfpga(true);
     LOG_FAIL(err != S1_SUCCESS, "s1_pimc_set_vfpga() returned the error code %d", err);
 
@@ -148,7 +301,7 @@ int main(void)
     LOG_PASS(err == S1_SUCCESS, "Vio correctly set to 3.45V");
 
     // Test correct rounding of passed parameters for Vio
-    LOG("[INFO] Testing correct rounding of Vio voltage parameters");
+    LOG_INFO("Testing correct rounding of Vio voltage parameters");
     err = s1_pmic_set_vio(3.01f, false);
     LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_vio() returned the error code %d", err);
     err = s1_pmic_get_vio(&vio, &lsw_mode);
@@ -164,7 +317,7 @@ int main(void)
     LOG_PASS(vio == 3.025f, "Vio correctly rounded up to 3.025V");
 
     // Test Vio warning when Vaux is not in a suitable range
-    LOG("[INFO] Testing Vio configuration when Vaux is disabled");
+    LOG_INFO("Testing Vio configuration when Vaux is disabled");
     err = s1_pmic_set_vaux(0.0f);
     LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_vaux() returned the error code %d", err);
     LOG_PASS(err == S1_SUCCESS, "Vaux correctly shutdown");
@@ -191,7 +344,7 @@ int main(void)
     LOG_PASS(vio == 2.925f, "Vio correctly configured to 2.925V anyway");
 
     // Check load switch modes for Vio
-    LOG("[INFO] Testing Vio load switch modes");
+    LOG_INFO("Testing Vio load switch modes");
     err = s1_pmic_set_vio(0.0f, true);
     LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_vio() returned the error code %d", err);
     err = s1_pmic_get_vio(&vio, &lsw_mode);
@@ -219,7 +372,7 @@ int main(void)
     LOG_PASS(err == S1_PMIC_VAUX_TOO_HIGH, "Vio correctly refused to set to load switch mode while Vaux is too high");
 
     // Test Vaux ranges
-    LOG("[INFO] Testing Vaux range limits");
+    LOG_INFO("Testing Vaux range limits");
     err = s1_pmic_set_vaux(0.75f);
     LOG_FAIL(err != S1_PMIC_INVALID_VALUE, "Vaux incorrectly set below 0.8V");
     LOG_PASS(err == S1_PMIC_INVALID_VALUE, "Vaux correctly refused to set below 0.8V");
@@ -239,7 +392,7 @@ int main(void)
     LOG_PASS(err == S1_SUCCESS, "Vaux correctly set to 5.5V");
 
     // Test correct rounding of passed parameters for Vaux
-    LOG("[INFO] Testing correct rounding of Vaux voltage parameters");
+    LOG_INFO("Testing correct rounding of Vaux voltage parameters");
     err = s1_pmic_set_vaux(3.02f);
     LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_aux() returned the error code %d", err);
     float vaux;
@@ -255,5 +408,450 @@ int main(void)
     LOG_FAIL(vaux != 3.05f, "Vaux did not round up correctly. Vio = %f", (double)vaux);
     LOG_PASS(vaux == 3.05f, "Vaux correctly rounded up to 3.05V");
 
+    // Integer versions should round the same way as the float ones
+    LOG_INFO("Testing the millivolt PMIC functions");
+    uint32_t vaux_mv;
+    err = s1_pmic_set_vaux_mv(3020);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_vaux_mv() returned the error code %d", err);
+    err = s1_pmic_get_vaux_mv(&vaux_mv);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_get_vaux_mv() returned the error code %d", err);
+    LOG_FAIL(vaux_mv != 3000, "Vaux did not round down correctly. Vaux = %lumV", vaux_mv);
+    LOG_PASS(vaux_mv == 3000, "Vaux correctly rounded down to 3000mV");
+
+    err = s1_pmic_set_vaux_mv(5550);
+    LOG_FAIL(err != S1_PMIC_INVALID_VALUE, "Vaux incorrectly set above 5500mV");
+    LOG_PASS(err == S1_PMIC_INVALID_VALUE, "Vaux correctly refused to set above 5500mV");
+
+    // Lower the FPGA core voltage, and check the limits
+    uint32_t vfpga_mv;
+    err = s1_pmic_set_vfpga_mv(1130);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_vfpga_mv() returned the error code %d", err);
+    err = s1_pmic_get_vfpga_mv(&vfpga_mv);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_get_vfpga_mv() returned the error code %d", err);
+    LOG_FAIL(vfpga_mv != 1150, "Vfpga did not round up correctly. Vfpga = %lumV", vfpga_mv);
+    LOG_PASS(vfpga_mv == 1150, "Vfpga correctly lowered to 1150mV");
+
+    err = s1_pmic_set_vfpga_mv(1250);
+    LOG_FAIL(err != S1_PMIC_INVALID_VALUE, "Vfpga incorrectly set above 1200mV");
+    LOG_PASS(err == S1_PMIC_INVALID_VALUE, "Vfpga correctly refused to set above 1200mV");
+
+    err = s1_pmic_set_vfpga_mv(1200);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_vfpga_mv() returned the error code %d", err);
+
+    // Report how much I2C traffic the register shadow saved so far
+    s1_pmic_stats_t pmic_stats;
+    s1_pmic_get_stats(&pmic_stats);
+    LOG_INFO("PMIC I2C reads: %lu, writes: %lu, reads saved by shadow: %lu",
+        pmic_stats.bus_reads, pmic_stats.bus_writes, pmic_stats.shadow_hits);
+
+    // Once the shadow is invalidated, Vaux should come from the PMIC once
+    s1_pmic_invalidate_shadow();
+    s1_pmic_get_stats(&pmic_stats);
+    uint32_t reads_before = pmic_stats.bus_reads;
+    err = s1_pmic_get_vaux(&vaux);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_get_vaux() returned the error code %d", err);
+    err = s1_pmic_get_vaux(&vaux);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_get_vaux() returned the error code %d", err);
+    s1_pmic_get_stats(&pmic_stats);
+    LOG_FAIL(pmic_stats.bus_reads - reads_before != 2,
+             "Reading Vaux twice took %lu I2C reads", pmic_stats.bus_reads - reads_before);
+    LOG_PASS(pmic_stats.bus_reads - reads_before == 2,
+             "Second Vaux read was served from the shadow");
+
+    // Verified writes should read back what was written
+    s1_pmic_set_shadow_verify(true);
+    err = s1_pmic_set_vaux(3.3f);
+    LOG_FAIL(err != S1_SUCCESS, "Verified s1_pmic_set_vaux() returned the error code %d", err);
+    LOG_PASS(err == S1_SUCCESS, "Verified Vaux write read back correctly");
+    s1_pmic_set_shadow_verify(false);
+
+    // A full power state dump should take one I2C transfer
+    s1_pmic_snapshot_t snapshot;
+    s1_pmic_get_stats(&pmic_stats);
+    reads_before = pmic_stats.bus_reads;
+    err = s1_pmic_snapshot(&snapshot);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_snapshot() returned the error code %d", err);
+    s1_pmic_get_stats(&pmic_stats);
+    LOG_FAIL(pmic_stats.bus_reads - reads_before != 1,
+             "Snapshot took %lu I2C reads", pmic_stats.bus_reads - reads_before);
+    LOG_FAIL(snapshot.vaux_mv != 3300,
+             "Snapshot reported Vaux = %lumV", snapshot.vaux_mv);
+    LOG_PASS(pmic_stats.bus_reads - reads_before == 1 && snapshot.vaux_mv == 3300,
+             "Snapshot read all rails in one transfer");
+
+    // Read the PMIC chip ID without blocking, and count while we wait
+    uint8_t pmic_chip_id = 0;
+    uint32_t idle_loops = 0;
+    err = s1_pmic_read_async(0x14, &pmic_chip_id, 1, pmic_done_handler, NULL);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_read_async() returned the error code %d", err);
+    while (!pmic_done_flag)
+    {
+        idle_loops++;
+    }
+    LOG_FAIL(pmic_done_err != S1_SUCCESS || pmic_chip_id != 0x7A,
+             "Async PMIC read returned %d with chip ID 0x%x", pmic_done_err, pmic_chip_id);
+    LOG_PASS(pmic_done_err == S1_SUCCESS && pmic_chip_id == 0x7A,
+             "Async PMIC read completed, CPU was free for %lu loops", idle_loops);
+
+    // Switch to a full power profile in one call, then apply it again
+    s1_pmic_state_t profile = {
+        .vfpga_enable = true,
+        .vaux_mv = 3300,
+        .vio_mv = 1800,
+        .vio_lsw_mode = false,
+    };
+    err = s1_pmic_apply(&profile);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_apply() returned the error code %d", err);
+    s1_pmic_get_stats(&pmic_stats);
+    uint32_t writes_before = pmic_stats.bus_writes;
+    err = s1_pmic_apply(&profile);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_apply() returned the error code %d", err);
+    s1_pmic_get_stats(&pmic_stats);
+    LOG_FAIL(pmic_stats.bus_writes != writes_before,
+             "Re-applying the same profile made %lu writes", pmic_stats.bus_writes - writes_before);
+    LOG_PASS(err == S1_SUCCESS && pmic_stats.bus_writes == writes_before,
+             "Power profile applied, and re-applying it made no writes");
+
+    // Profiles which break the rules shouldn't write anything
+    profile.vaux_mv = 1800;
+    err = s1_pmic_apply(&profile);
+    LOG_FAIL(err != S1_PMIC_VAUX_TOO_LOW, "Profile with Vaux below Vio was applied");
+    LOG_PASS(err == S1_PMIC_VAUX_TOO_LOW, "Profile with Vaux below Vio was refused");
+
+    // Sample the battery and charger through the PMIC AMUX
+    s1_telemetry_t telemetry;
+    err = s1_telemetry_sample(&telemetry);
+    LOG_FAIL(err != S1_SUCCESS, "s1_telemetry_sample() returned the error code %d", err);
+
+    // A bare board has nothing on BATT, which then reads well below any cell
+    bool battery_present = err == S1_SUCCESS && telemetry.battery_mv >= 1000;
+    if (err == S1_SUCCESS && !battery_present)
+    {
+        LOG_INFO("No battery connected, skipping the battery and thermistor checks");
+    }
+
+    // A Li-ion cell should be within its working range, and the thermistor
+    // should read somewhere around room temperature, rather than either end
+    // of the table when it's open or shorted
+    bool telemetry_ok = err == S1_SUCCESS &&
+                        (!battery_present ||
+                         (telemetry.battery_mv >= 2700 &&
+                          telemetry.battery_mv <= 4400 &&
+                          telemetry.temperature_dc > -100 &&
+                          telemetry.temperature_dc < 600));
+    LOG_FAIL(err == S1_SUCCESS && !telemetry_ok,
+             "Telemetry out of range: battery %lumV, %ld x 0.1C",
+             telemetry.battery_mv, telemetry.temperature_dc);
+    LOG_PASS(telemetry_ok,
+             "Telemetry: battery %lumV, charger %lumV, charging %luuA, %ld x 0.1C",
+             telemetry.battery_mv, telemetry.chgin_mv, telemetry.charge_ua,
+             telemetry.temperature_dc);
+
+    // Stream both ADC pins at 10kHz, which fills a block every 3.2ms
+    s1_adc_stream_config_t adc_stream = {
+        .sample_rate_hz = 10000,
+        .adc1 = true,
+        .adc2 = true,
+        .buffers = adc_stream_buffers,
+        .block_len = 64,
+        .block_count = 4,
+        .handler = adc_block_handler,
+        .context = NULL,
+    };
+    err = s1_adc_stream_start(&adc_stream);
+    LOG_FAIL(err != S1_SUCCESS, "s1_adc_stream_start() returned the error code %d", err);
+    nrf_delay_ms(100);
+
+    // The SAADC is busy streaming, so telemetry shouldn't get a look in
+    err = s1_telemetry_sample(&telemetry);
+    LOG_FAIL(err != S1_ADC_BUSY, "Telemetry returned %d while the ADC was streaming", err);
+
+    s1_adc_stream_stop();
+    LOG_FAIL(adc_stream_blocks < 25 || s1_adc_stream_get_overruns() != 0,
+             "ADC stream filled %lu blocks with %lu overruns",
+             adc_stream_blocks, s1_adc_stream_get_overruns());
+    LOG_PASS(adc_stream_blocks >= 25 && s1_adc_stream_get_overruns() == 0,
+             "ADC stream filled %lu blocks in 100ms without overruns",
+             adc_stream_blocks);
+
+    // Two channels can't keep up with 100kHz
+    adc_stream.sample_rate_hz = 100000;
+    err = s1_adc_stream_start(&adc_stream);
+    LOG_FAIL(err != S1_ADC_INVALID_VALUE, "ADC stream started at 100kHz");
+    LOG_PASS(err == S1_ADC_INVALID_VALUE, "ADC stream refused 100kHz on two pins");
+
+    // Telemetry should work again once the stream is stopped
+    err = s1_telemetry_sample(&telemetry);
+    LOG_FAIL(err != S1_SUCCESS, "Telemetry failed after the ADC stream stopped");
+
+    // Power up the FPGA and wake up the flash for the SPI bus tests
+    LOG_INFO("Waking up the flash for SPI bus tests");
+    err = s1_pimc_set_vfpga(true);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pimc_set_vfpga() returned the error code %d", err);
+    err = s1_pmic_set_vio(1.8f, false);
+    LOG_FAIL(err != S1_SUCCESS, "s1_pmic_set_vio() returned the error code %d", err);
+    s1_fpga_hold_reset();
+    nrf_delay_ms(1);
+
+    err = s1_flash_wakeup();
+    LOG_FAIL(err != S1_SUCCESS, "s1_flash_wakeup() returned the error code %d", err);
+    LOG_PASS(err == S1_SUCCESS, "Flash woke up and returned the correct capacity ID");
+
+    // Compare the cost of re-initialising the SPI driver for every transfer
+    // against keeping a session open, using the Cortex-M4 cycle counter
+    LOG_INFO("Benchmarking SPI per-transfer overhead");
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    uint32_t start = DWT->CYCCNT;
+    for (int i = 0; i < 100; i++)
+    {
+        s1_spi_close();
+        s1_flash_is_busy();
+    }
+    uint32_t reinit_cycles = (DWT->CYCCNT - start) / 100;
+
+    err = s1_spi_open();
+    LOG_FAIL(err != S1_SUCCESS, "s1_spi_open() returned the error code %d", err);
+
+    start = DWT->CYCCNT;
+    for (int i = 0; i < 100; i++)
+    {
+        s1_flash_is_busy();
+    }
+    uint32_t session_cycles = (DWT->CYCCNT - start) / 100;
+
+    LOG_INFO("Status read: %lu cycles with re-init, %lu cycles with a session",
+        reinit_cycles,
+        session_cycles);
+    LOG_FAIL(session_cycles >= reinit_cycles, "SPI session did not reduce the per-transfer overhead");
+    LOG_PASS(session_cycles < reinit_cycles, "SPI session reduced the per-transfer overhead");
+
+    // Read the flash ID without blocking, and check the completion handler
+    LOG_INFO("Testing asynchronous SPI transfers");
+    uint8_t id_cmd[1] = {0x9F};
+    uint8_t id_res[4] = {0};
+    err = flash_tx_rx_async(id_cmd, 1, id_res, 4, spi_done_handler, NULL);
+    LOG_FAIL(err != S1_SUCCESS, "flash_tx_rx_async() returned the error code %d", err);
+    while (s1_spi_is_busy())
+    {
+    }
+    LOG_FAIL(spi_done_flag == false, "Asynchronous transfer did not call the handler");
+    LOG_FAIL(id_res[3] != 0x16, "Asynchronous transfer read the wrong capacity ID");
+    LOG_PASS(spi_done_flag == true && id_res[3] == 0x16, "Asynchronous transfer completed correctly");
+
+    // The FPGA is held in reset, so nothing comes back, but the handler should
+    // still be called, and the flash should work again straight afterwards
+    uint8_t fpga_cmd[4] = {0xA5, 0x5A, 0xA5, 0x5A};
+    uint8_t fpga_res[4] = {0};
+    spi_done_flag = false;
+    err = fpga_tx_rx_async(fpga_cmd, sizeof(fpga_cmd), fpga_res, sizeof(fpga_res),
+                           spi_done_handler, NULL);
+    LOG_FAIL(err != S1_SUCCESS, "fpga_tx_rx_async() returned the error code %d", err);
+    while (s1_spi_is_busy())
+    {
+    }
+    memset(id_res, 0, sizeof(id_res));
+    err = flash_tx_rx(id_cmd, 1, id_res, 4);
+    LOG_FAIL(spi_done_flag == false, "Asynchronous FPGA transfer did not call the handler");
+    LOG_FAIL(err != S1_SUCCESS || id_res[3] != 0x16,
+             "Flash didn't respond after an asynchronous FPGA transfer");
+    LOG_PASS(spi_done_flag == true && err == S1_SUCCESS && id_res[3] == 0x16,
+             "Asynchronous FPGA transfer completed and released the bus");
+
+    // The write enable latch only sets if WREN gets its own chip select, so
+    // reading it back checks both the ordering and the boundaries of the queue
+    LOG_INFO("Testing the SPI transaction queue");
+    uint8_t wren_cmd[1] = {0x06};
+    uint8_t wrdi_cmd[1] = {0x04};
+    uint8_t rdsr_cmd[1] = {0x05};
+    uint8_t status_res[2][2] = {{0}};
+    s1_spi_xfer_t latch_xfers[4] = {
+        {wren_cmd, 1, NULL, 0, S1_SPI_FLASH, false},
+        {rdsr_cmd, 1, status_res[0], 2, S1_SPI_FLASH, false},
+        {wrdi_cmd, 1, NULL, 0, S1_SPI_FLASH, false},
+        {rdsr_cmd, 1, status_res[1], 2, S1_SPI_FLASH, false},
+    };
+    spi_done_flag = false;
+    err = s1_spi_queue(latch_xfers, 4, spi_done_handler, NULL);
+    LOG_FAIL(err != S1_SUCCESS, "s1_spi_queue() returned the error code %d", err);
+    while (!spi_done_flag)
+    {
+    }
+    LOG_FAIL((status_res[0][1] & 0x02) == 0, "Write enable latch was not set by the queued WREN");
+    LOG_FAIL((status_res[1][1] & 0x02) != 0, "Write enable latch was not cleared by the queued WRDI");
+    LOG_PASS((status_res[0][1] & 0x02) != 0 && (status_res[1][1] & 0x02) == 0,
+             "Queued transfers ran in order with separate chip selects");
+
+    // Program part of the nRF's own firmware as a test image, which also
+    // checks that images can be staged from internal flash. It goes into the
+    // scratch area so the FPGA bitstream is left intact
+    LOG_INFO("Testing full image programming");
+    s1_flash_set_benchmark_handler(flash_benchmark_handler);
+    unsigned char const *test_image = (unsigned char const *)0x1000;
+    size_t test_image_len = 20000;
+    err = s1_flash_program(TEST_FLASH_SCRATCH_ADDRESS, test_image, test_image_len);
+    LOG_FAIL(err != S1_SUCCESS, "s1_flash_program() returned the error code %d", err);
+    LOG_PASS(err == S1_SUCCESS, "Image programmed");
+
+    // Read across a page boundary and check it against the image
+    static uint8_t read_buffer[1024];
+    err = s1_flash_read(TEST_FLASH_SCRATCH_ADDRESS + 0x80, read_buffer, sizeof(read_buffer));
+    LOG_FAIL(err != S1_SUCCESS, "s1_flash_read() returned the error code %d", err);
+    bool read_ok = memcmp(read_buffer, test_image + 0x80, sizeof(read_buffer)) == 0;
+    LOG_FAIL(!read_ok, "Flash contents did not match the programmed image");
+    LOG_PASS(read_ok, "Flash contents read back correctly");
+
+    // A range which starts mid-block should use sectors up to the first 32KB
+    // boundary, and then the largest blocks that fit
+    LOG_INFO("Testing the flash erase planner");
+    s1_flash_erase_t plan[8];
+    size_t plan_count = s1_flash_erase_plan(0x3800, 0x1D000, plan, 8);
+    bool plan_ok = plan_count == 8 &&
+                   plan[0].address == 0x3000 && plan[0].size == S1_FLASH_ERASE_4K &&
+                   plan[5].address == 0x8000 && plan[5].size == S1_FLASH_ERASE_32K &&
+                   plan[6].address == 0x10000 && plan[6].size == S1_FLASH_ERASE_64K &&
+                   plan[7].address == 0x20000 && plan[7].size == S1_FLASH_ERASE_4K;
+    LOG_FAIL(!plan_ok, "Erase plan was not minimal. %u erases planned", plan_count);
+    LOG_PASS(plan_ok, "Erase plan was minimal");
+
+    // Updating with the same image should leave every sector untouched
+    LOG_INFO("Testing differential flash updates");
+    s1_flash_update_stats_t update_stats;
+    err = s1_flash_update(TEST_FLASH_SCRATCH_ADDRESS, test_image, test_image_len, &update_stats);
+    LOG_FAIL(err != S1_SUCCESS, "s1_flash_update() returned the error code %d", err);
+    LOG_FAIL(update_stats.sectors_written != 0,
+             "Unchanged image rewrote %lu sectors", update_stats.sectors_written);
+    LOG_PASS(update_stats.sectors_written == 0,
+             "Unchanged image skipped all %lu sectors", update_stats.sectors_skipped);
+
+    // Frames need at least one register per access
+    uint8_t fpga_regs[4] = {0x11, 0x22, 0x33, 0x44};
+    err = s1_fpga_reg_write(0x02, fpga_regs, 0);
+    LOG_FAIL(err != S1_FPGA_FRAME_ERROR, "Empty register write was sent");
+
+    // Without a register slave loaded on the FPGA, nothing should come back
+    // with a valid status and CRC
+    s1_fpga_reg_access_t fpga_accesses[] = {
+        {S1_FPGA_REG_WRITE, 0x02, fpga_regs, 2},
+        {S1_FPGA_REG_READ, 0x02, &fpga_regs[2], 2},
+    };
+    err = s1_fpga_reg_batch(fpga_accesses, 2);
+    LOG_FAIL(err != S1_FPGA_CRC_ERROR,
+             "Register frame to an unconfigured FPGA returned the code %d", err);
+    LOG_PASS(err == S1_FPGA_CRC_ERROR,
+             "Register frame to an unconfigured FPGA failed its CRC check");
+
+    // Start the low frequency clock and app timer to measure the boot time
+    nrfx_clock_init(clock_event_handler);
+    nrfx_clock_enable();
+    nrfx_clock_lfclk_start();
+    while (!nrfx_clock_lfclk_is_running())
+    {
+    }
+    app_timer_init();
+
+    // The doorbell can't be used until the FPGA has booted
+    err = s1_fpga_doorbell_enable(fpga_doorbell_handler, NULL);
+    LOG_FAIL(err != S1_FPGA_NOT_BOOTED, "Doorbell was enabled before boot");
+
+    // Boot the image at flash address 0, and wait for CDONE. The flash tests
+    // above only use the scratch area, so the image is still there. The
+    // doorbell and ADC to FPGA tests below need it, so it's a failure if it
+    // doesn't boot
+    s1_fpga_set_boot_handler(fpga_boot_handler);
+    s1_fpga_boot();
+    err = s1_fpga_wait_booted(100);
+    LOG_FAIL(err != S1_SUCCESS,
+             "FPGA didn't boot within 100ms. Is there an image at flash address 0?");
+    LOG_FAIL(err == S1_SUCCESS && fpga_boot_time_us != s1_fpga_get_boot_time_us(),
+             "Boot handler reported %lu us, expected %lu us",
+             fpga_boot_time_us, s1_fpga_get_boot_time_us());
+    LOG_PASS(err == S1_SUCCESS,
+             "FPGA booted in %lu us", s1_fpga_get_boot_time_us());
+
+    // Search for the lowest core voltage with a self test that fails below
+    // 1050mV. The failed step should reboot the FPGA before the final test
+    if (err == S1_SUCCESS)
+    {
+        uint32_t vfpga_pass_mv = 1050;
+        vfpga_mv = 0;
+        vfpga_self_test_calls = 0;
+        fpga_boot_time_us = 0;
+        s1_error_t search_err = s1_pmic_vfpga_search(vfpga_self_test, &vfpga_pass_mv,
+                                                     100, &vfpga_mv);
+        LOG_FAIL(search_err != S1_SUCCESS,
+                 "s1_pmic_vfpga_search() returned the error code %d", search_err);
+        LOG_FAIL(search_err == S1_SUCCESS && vfpga_mv != 1150,
+                 "Vfpga search chose %lumV, expected 1150mV", vfpga_mv);
+        LOG_FAIL(search_err == S1_SUCCESS && fpga_boot_time_us == 0,
+                 "FPGA was not rebooted after the failed step");
+        LOG_PASS(search_err == S1_SUCCESS && vfpga_mv == 1150 && fpga_boot_time_us != 0,
+                 "Vfpga search chose 1150mV after %lu self tests", vfpga_self_test_calls);
+        s1_pmic_set_vfpga_mv(1200);
+    }
+    s1_fpga_set_boot_handler(NULL);
+
+    // Once booted, the INT pin can be used as a doorbell instead. CDONE stays
+    // high after boot, which isn't an edge, so enabling it shouldn't ring
+    if (err == S1_SUCCESS)
+    {
+        volatile uint32_t doorbell_rings = 0;
+        err = s1_fpga_doorbell_enable(fpga_doorbell_handler, (void *)&doorbell_rings);
+        LOG_FAIL(err != S1_SUCCESS, "s1_fpga_doorbell_enable() returned the error code %d", err);
+        nrf_delay_ms(1);
+        bool doorbell_ok = err == S1_SUCCESS &&
+                           doorbell_rings == 0 && s1_fpga_doorbell_get_count() == 0;
+        LOG_FAIL(err == S1_SUCCESS && !doorbell_ok,
+                 "FPGA doorbell rang %lu times without an edge", doorbell_rings);
+        LOG_PASS(doorbell_ok, "FPGA doorbell stayed quiet while INT was held high");
+        s1_fpga_doorbell_disable();
+    }
+
+    // Send the ADC pins to the booted FPGA straight from the DMA blocks
+    if (err == S1_SUCCESS)
+    {
+        s1_adc_stream_config_t adc_fpga = {
+            .sample_rate_hz = 10000,
+            .adc1 = true,
+            .adc2 = true,
+            .buffers = adc_stream_buffers,
+            .block_len = 64,
+            .block_count = 4,
+        };
+        err = s1_adc_fpga_start(&adc_fpga);
+        LOG_FAIL(err != S1_SUCCESS, "s1_adc_fpga_start() returned the error code %d", err);
+        nrf_delay_ms(100);
+        s1_adc_fpga_stop();
+
+        s1_adc_fpga_stats_t adc_fpga_stats;
+        s1_adc_fpga_get_stats(&adc_fpga_stats);
+        bool adc_fpga_ok = adc_fpga_stats.blocks_sent >= 25 &&
+                           adc_fpga_stats.blocks_dropped == 0 &&
+                           adc_fpga_stats.adc_overruns == 0;
+        LOG_FAIL(!adc_fpga_ok,
+                 "ADC to FPGA sent %lu blocks, dropped %lu, with %lu overruns",
+                 adc_fpga_stats.blocks_sent, adc_fpga_stats.blocks_dropped,
+                 adc_fpga_stats.adc_overruns);
+        LOG_PASS(adc_fpga_ok, "ADC to FPGA sent %lu blocks in 100ms",
+                 adc_fpga_stats.blocks_sent);
+    }
+
+#if S1_PROFILE
+    // The flash and PMIC tests above should all have been timed
+    s1_profile_stats_t flash_read_stats;
+    s1_profile_get(S1_PROFILE_FLASH_READ, &flash_read_stats);
+    s1_profile_stats_t pmic_read_stats;
+    s1_profile_get(S1_PROFILE_PMIC_READ_REGS, &pmic_read_stats);
+    bool profile_ok = flash_read_stats.calls > 0 &&
+                      pmic_read_stats.calls > 0 &&
+                      flash_read_stats.min_cycles <= flash_read_stats.max_cycles;
+    LOG_FAIL(!profile_ok, "Profiling missed flash reads or PMIC reads");
+    LOG_PASS(profile_ok, "Profiled %lu flash reads and %lu PMIC reads",
+             flash_read_stats.calls, pmic_read_stats.calls);
+    s1_profile_dump();
+#endif
+
     return 0;
 }
\ No newline at end of file
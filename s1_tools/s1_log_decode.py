@@ -0,0 +1,263 @@
+#!/usr/bin/env python3
+#
+# Decoder for tokenised S1 logs.
+#
+# Copyright 2022 Silicon Witchery AB
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+# REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+# AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+# INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+# LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+# OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+# PERFORMANCE OF THIS SOFTWARE.
+#
+
+"""
+Turns the RTT output of an S1 application built with S1_LOG_TOKENISED=1 back
+into text, using the format strings kept in the application's .elf file.
+
+Capture the RTT output to a file, for example with:
+
+    JLinkRTTLogger -Device NRF52811_XXAA -If SWD -Speed 4000 -RTTChannel 0 log.bin
+
+and then decode it with:
+
+    python3 s1_log_decode.py .build/s1_sdk_standalone.out log.bin
+
+The capture can also be piped in through stdin by passing - instead of a file.
+Only the Python standard library is needed.
+"""
+
+import re
+import struct
+import sys
+
+# Section holding the format strings, and the token used for text records
+FORMAT_SECTION = "s1_log_fmt"
+TOKEN_TEXT = 0xFFFF
+
+# ELF section flag for sections which are loaded onto the device
+SHF_ALLOC = 0x2
+
+
+class Elf:
+    """
+    Minimal reader for little endian ELF files. Keeps the format string section,
+    and every section which is loaded onto the device, so that %s arguments
+    which point at constant strings can also be resolved.
+    """
+
+    def __init__(self, path):
+        with open(path, "rb") as file:
+            data = file.read()
+
+        if data[:4] != b"\x7fELF" or data[5] != 1:
+            raise ValueError(f"{path} is not a little endian ELF file")
+
+        is_64 = data[4] == 2
+
+        if is_64:
+            shoff, = struct.unpack_from("<Q", data, 0x28)
+            shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x3A)
+            header = "<IIQQQQIIQQ"
+        else:
+            shoff, = struct.unpack_from("<I", data, 0x20)
+            shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x2E)
+            header = "<IIIIIIIIII"
+
+        sections = []
+        for i in range(shnum):
+            fields = struct.unpack_from(header, data, shoff + i * shentsize)
+            name, kind, flags, addr, offset, size = fields[:6]
+            contents = data[offset:offset + size] if kind != 8 else b""
+            sections.append((name, flags, addr, contents))
+
+        names = sections[shstrndx][3]
+
+        self.formats = None
+        self.loaded = []
+
+        for name, flags, addr, contents in sections:
+            name = names[name:names.index(b"\0", name)].decode()
+
+            if name == FORMAT_SECTION:
+                self.formats = contents
+
+            elif flags & SHF_ALLOC and contents:
+                self.loaded.append((addr, contents))
+
+        if self.formats is None:
+            raise ValueError(f"{path} has no {FORMAT_SECTION} section. "
+                             "Was it built with S1_LOG_TOKENISED=1?")
+
+    def format_string(self, token):
+        """Returns the format string for a token, or None if it's not valid."""
+        if token >= len(self.formats):
+            return None
+
+        end = self.formats.find(b"\0", token)
+        return self.formats[token:end].decode(errors="replace")
+
+    def string_at(self, address):
+        """Returns the constant string at an address, or None if it's not in
+        the .elf file, for example because it was on the stack."""
+        for start, contents in self.loaded:
+            if start <= address < start + len(contents):
+                offset = address - start
+                end = contents.find(b"\0", offset)
+                if end < 0:
+                    return None
+                return contents[offset:end].decode(errors="replace")
+
+        return None
+
+
+def cobs_decode(frame):
+    """Decodes one COBS frame, without its zero delimiter. Returns None if the
+    frame is corrupt."""
+    output = bytearray()
+    i = 0
+
+    while i < len(frame):
+        code = frame[i]
+
+        if code == 0 or i + code > len(frame):
+            return None
+
+        output += frame[i + 1:i + code]
+        i += code
+
+        if code < 0xFF and i < len(frame):
+            output.append(0)
+
+    return bytes(output)
+
+
+def read_varints(data):
+    """Splits the argument bytes of a record into 32 bit words."""
+    words = []
+    word = 0
+    shift = 0
+
+    for byte in data:
+        word |= (byte & 0x7F) << shift
+        shift += 7
+
+        if byte & 0x80 == 0:
+            words.append(word & 0xFFFFFFFF)
+            word = 0
+            shift = 0
+
+    return words
+
+
+# printf conversion specifiers, as supported by LOG_DEFERRED()
+CONVERSION = re.compile(
+    r"%([-+ #0]*)(\d+)?(?:\.(\d+))?(?:hh|h|ll|l|z|j|t)?([diouxXcsp%])")
+
+
+def format_printf(elf, format, words):
+    """Formats the argument words the same way the nRF's printf would."""
+    words = list(words)
+
+    def convert(match):
+        flags, width, precision, kind = match.groups()
+
+        if kind == "%":
+            return "%"
+
+        word = words.pop(0) if words else 0
+        spec = "%" + flags + (width or "") + \
+            ("." + precision if precision is not None else "")
+
+        if kind in "di":
+            value = word - (1 << 32) if word & 0x80000000 else word
+            return (spec + "d") % value
+
+        if kind in "ouxX":
+            return (spec + ("d" if kind == "u" else kind)) % word
+
+        if kind == "c":
+            return (spec + "c") % chr(word & 0xFF)
+
+        if kind == "p":
+            return (spec + "s") % f"0x{word:08x}"
+
+        string = elf.string_at(word)
+        if string is None:
+            string = f"<string at 0x{word:08x}>"
+        return (spec + "s") % string
+
+    return CONVERSION.sub(convert, format)
+
+
+def decode_record(elf, record):
+    """Turns one decoded record back into text."""
+    if len(record) < 2:
+        return "<short record>\n"
+
+    token, = struct.unpack_from("<H", record)
+
+    if token == TOKEN_TEXT:
+        return record[2:].decode(errors="replace")
+
+    format = elf.format_string(token)
+    if format is None:
+        return f"<unknown token 0x{token:04x}>\n"
+
+    return format_printf(elf, format, read_varints(record[2:]))
+
+
+def decode_stream(elf, stream, output):
+    """Decodes records from a binary stream as they arrive. A corrupt record
+    is reported, and decoding carries on from the next one."""
+    pending = b""
+
+    while True:
+        chunk = stream.read1(4096) if hasattr(stream, "read1") \
+            else stream.read(4096)
+
+        if not chunk:
+            break
+
+        pending += chunk
+        *frames, pending = pending.split(b"\0")
+
+        for frame in frames:
+            if not frame:
+                continue
+
+            record = cobs_decode(frame)
+
+            if record is None:
+                output.write("\n<corrupt record>\n")
+            else:
+                output.write(decode_record(elf, record).replace("\r", ""))
+
+        output.flush()
+
+
+def main():
+    if len(sys.argv) != 3:
+        print("Usage: s1_log_decode.py <application.elf> <capture.bin | ->",
+              file=sys.stderr)
+        return 1
+
+    elf = Elf(sys.argv[1])
+
+    if sys.argv[2] == "-":
+        decode_stream(elf, sys.stdin.buffer, sys.stdout)
+    else:
+        with open(sys.argv[2], "rb") as stream:
+            decode_stream(elf, stream, sys.stdout)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
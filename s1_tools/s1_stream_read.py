@@ -0,0 +1,187 @@
+#!/usr/bin/env python3
+#
+# Reader for S1 RTT data streams.
+#
+# Copyright 2022 Silicon Witchery AB
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+# REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+# AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+# INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+# LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+# OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+# PERFORMANCE OF THIS SOFTWARE.
+#
+
+"""
+Saves the data written with s1_stream_write() on one or more RTT channels, and
+reports the data rate of each channel while it runs.
+
+Each stream is given as SOURCE=OUTPUT. The source is either host:port of an
+RTT server, a capture file, or - for stdin. The output is a file, or - for
+stdout.
+
+OpenOCD can serve each RTT channel on its own TCP port:
+
+    openocd -f interface/jlink.cfg -c "transport select swd" \\
+        -f target/nrf52.cfg -c init \\
+        -c "rtt setup 0x20000000 0x6000 \\"SEGGER RTT\\"" -c "rtt start" \\
+        -c "rtt server start 9091 1" -c "rtt server start 9092 2"
+
+    python3 s1_stream_read.py localhost:9091=adc.bin localhost:9092=fpga.bin
+
+With a J-Link, capture each channel with JLinkRTTLogger instead:
+
+    JLinkRTTLogger -Device NRF52811_XXAA -If SWD -Speed 4000 -RTTChannel 1 adc.bin
+
+The --csv option turns 16 bit samples, such as those from
+s1_adc_stream_start(), into one line per sample period. For example, use
+--csv 2 when streaming both ADC pins. Only the Python standard library is
+needed.
+"""
+
+import argparse
+import socket
+import sys
+import threading
+import time
+
+
+class Stream:
+    """One RTT channel being saved, and the number of bytes it has seen."""
+
+    def __init__(self, spec, columns):
+        if "=" not in spec:
+            raise ValueError(f"{spec} should be SOURCE=OUTPUT")
+
+        self.source, self.output = spec.rsplit("=", 1)
+        self.columns = columns
+        self.bytes = 0
+        self.error = None
+        self.file = None
+
+    def open_source(self):
+        """Returns a function which reads the next chunk from the source, or
+        an empty chunk once it has ended."""
+        if self.source == "-":
+            return lambda: sys.stdin.buffer.read1(4096)
+
+        host, _, port = self.source.rpartition(":")
+
+        if host and port.isdigit():
+            connection = socket.create_connection((host, int(port)))
+            return lambda: connection.recv(4096)
+
+        file = open(self.source, "rb")
+        return lambda: file.read(4096)
+
+    def open_output(self):
+        """Returns the file which the data, or CSV text, is written to."""
+        if self.output == "-":
+            return sys.stdout if self.columns else sys.stdout.buffer
+
+        return open(self.output, "w" if self.columns else "wb")
+
+    def run(self):
+        try:
+            read = self.open_source()
+            output = self.file = self.open_output()
+            pending = b""
+            row_size = 2 * self.columns
+
+            while True:
+                chunk = read()
+
+                if not chunk:
+                    break
+
+                self.bytes += len(chunk)
+
+                if not self.columns:
+                    output.write(chunk)
+                    continue
+
+                # Only convert whole rows, and keep the rest for later
+                pending += chunk
+                whole = len(pending) - len(pending) % row_size
+
+                for i in range(0, whole, row_size):
+                    row = pending[i:i + row_size]
+                    output.write(",".join(
+                        str(int.from_bytes(row[j:j + 2], "little", signed=True))
+                        for j in range(0, row_size, 2)) + "\n")
+
+                pending = pending[whole:]
+
+            output.flush()
+
+        except (OSError, ValueError) as error:
+            self.error = error
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Save S1 RTT data streams to files.")
+    parser.add_argument("streams", nargs="+", metavar="SOURCE=OUTPUT",
+                        help="host:port, file or - to read from, and the "
+                        "file or - to write to")
+    parser.add_argument("--csv", type=int, default=0, metavar="COLUMNS",
+                        help="write 16 bit samples as CSV, with this many "
+                        "samples per line")
+    args = parser.parse_args()
+
+    if args.csv < 0:
+        parser.error("--csv must be positive")
+
+    try:
+        streams = [Stream(spec, args.csv) for spec in args.streams]
+    except ValueError as error:
+        parser.error(str(error))
+
+    threads = [threading.Thread(target=stream.run, daemon=True)
+               for stream in streams]
+
+    for thread in threads:
+        thread.start()
+
+    # Report each stream's rate once a second until they've all ended
+    last = [0] * len(streams)
+
+    try:
+        while any(thread.is_alive() for thread in threads):
+            time.sleep(1)
+
+            rates = []
+            for i, stream in enumerate(streams):
+                rates.append(f"{stream.source}: "
+                             f"{(stream.bytes - last[i]) / 1000:.1f}kB/s")
+                last[i] = stream.bytes
+
+            print("  ".join(rates), file=sys.stderr)
+
+    except KeyboardInterrupt:
+        pass
+
+    failed = False
+
+    for stream in streams:
+        if stream.file:
+            stream.file.flush()
+
+        if stream.error:
+            print(f"{stream.source}: {stream.error}", file=sys.stderr)
+            failed = True
+
+        else:
+            print(f"{stream.source}: {stream.bytes} bytes saved to "
+                  f"{stream.output}", file=sys.stderr)
+
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+#
+# Tests for the tokenised S1 log decoder.
+#
+# Copyright 2022 Silicon Witchery AB
+#
+# Permission to use, copy, modify, and/or distribute this software for any
+# purpose with or without fee is hereby granted, provided that the above
+# copyright notice and this permission notice appear in all copies.
+#
+# THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+# REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+# AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+# INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+# LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+# OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+# PERFORMANCE OF THIS SOFTWARE.
+#
+
+"""
+Feeds records framed the same way as log_write_record() in s1.c through
+decode_stream(), using a small ELF file built on the fly. Run it with:
+
+    python3 s1_tools/test_s1_log_decode.py
+"""
+
+import io
+import os
+import struct
+import tempfile
+import unittest
+
+import s1_log_decode
+
+# Where the constant strings of the test ELF file are loaded
+RODATA_ADDRESS = 0x1000
+
+
+def cobs_frame(record):
+    """Frames a record with COBS and a zero delimiter, as s1.c does."""
+    frame = bytearray()
+    i = 0
+
+    while True:
+        start = i
+        while i < len(record) and i - start < 254 and record[i] != 0:
+            i += 1
+
+        frame.append(i - start + 1)
+        frame += record[start:i]
+
+        if i - start == 254:
+            continue
+
+        if i == len(record):
+            break
+
+        i += 1
+
+    return bytes(frame) + b"\0"
+
+
+def deferred_record(token, words):
+    """Builds a deferred record, with each argument word as a varint."""
+    record = bytearray(struct.pack("<H", token))
+
+    for word in words:
+        word &= 0xFFFFFFFF
+        while word >= 0x80:
+            record.append((word & 0x7F) | 0x80)
+            word >>= 7
+        record.append(word)
+
+    return cobs_frame(bytes(record))
+
+
+def text_record(text):
+    """Builds a text record, as LOG() sends when logs are tokenised."""
+    return cobs_frame(struct.pack("<H", s1_log_decode.TOKEN_TEXT) + text)
+
+
+def build_elf(formats, rodata):
+    """Returns a minimal 32 bit ELF file with a format string section, and a
+    loaded section of constant strings."""
+    names = b"\0.shstrtab\0" + s1_log_decode.FORMAT_SECTION.encode() + \
+        b"\0.rodata\0"
+    contents = [names, formats, rodata]
+    offsets = []
+    data = bytearray(52)
+
+    for section in contents:
+        offsets.append(len(data))
+        data += section
+
+    shoff = len(data)
+
+    # Null section, then .shstrtab, s1_log_fmt and .rodata
+    data += bytes(40)
+    data += struct.pack("<IIIIIIIIII", 1, 3, 0, 0,
+                        offsets[0], len(names), 0, 0, 1, 0)
+    data += struct.pack("<IIIIIIIIII", 11, 1, 0, 0,
+                        offsets[1], len(formats), 0, 0, 1, 0)
+    data += struct.pack("<IIIIIIIIII", 22, 1, s1_log_decode.SHF_ALLOC,
+                        RODATA_ADDRESS, offsets[2], len(rodata), 0, 0, 1, 0)
+
+    data[0:16] = b"\x7fELF\x01\x01\x01" + bytes(9)
+    struct.pack_into("<HHIIIIIHHHHHH", data, 16,
+                     2, 40, 1, 0, 0, shoff, 0, 52, 0, 0, 40, 4, 1)
+
+    return bytes(data)
+
+
+class ChunkedStream:
+    """Stream which only returns a few bytes at a time, like a live capture."""
+
+    def __init__(self, data, chunk):
+        self.data = data
+        self.chunk = chunk
+
+    def read(self, size):
+        result = self.data[:min(size, self.chunk)]
+        self.data = self.data[len(result):]
+        return result
+
+
+class DecodeStreamTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.formats = b"Started\n\0ADC %d mV on %s, %u%%\n\0Flags 0x%04x\n\0"
+        cls.rodata = b"ADC1\0ADC2\0"
+
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "test.elf")
+
+            with open(path, "wb") as file:
+                file.write(build_elf(cls.formats, cls.rodata))
+
+            cls.elf = s1_log_decode.Elf(path)
+
+    def decode(self, stream):
+        output = io.StringIO()
+        s1_log_decode.decode_stream(self.elf, stream, output)
+        return output.getvalue()
+
+    def token(self, format):
+        return self.formats.index(format)
+
+    def test_deferred_records(self):
+        stream = deferred_record(self.token(b"Started"), []) + \
+            deferred_record(self.token(b"ADC"),
+                            [-12, RODATA_ADDRESS + 5, 100]) + \
+            deferred_record(self.token(b"Flags"), [0xBEEF])
+
+        self.assertEqual(self.decode(io.BytesIO(stream)),
+                         "Started\nADC -12 mV on ADC2, 100%\nFlags 0xbeef\n")
+
+    def test_text_records(self):
+        long_text = b"x" * 300 + b"\r\n"
+        stream = text_record(b"Hello\r\n") + text_record(long_text)
+
+        self.assertEqual(self.decode(io.BytesIO(stream)),
+                         "Hello\n" + "x" * 300 + "\n")
+
+    def test_records_split_across_reads(self):
+        stream = text_record(b"one\n") + \
+            deferred_record(self.token(b"ADC"), [0, RODATA_ADDRESS, 7]) + \
+            text_record(b"two\n")
+
+        self.assertEqual(self.decode(ChunkedStream(stream, 3)),
+                         "one\nADC 0 mV on ADC1, 7%\ntwo\n")
+
+    def test_unknown_token_and_string(self):
+        stream = deferred_record(0x7FFF, []) + \
+            deferred_record(self.token(b"ADC"), [1, 0x20000000, 2])
+
+        self.assertEqual(self.decode(io.BytesIO(stream)),
+                         "<unknown token 0x7fff>\n"
+                         "ADC 1 mV on <string at 0x20000000>, 2%\n")
+
+    def test_recovers_after_corrupt_record(self):
+        corrupt = text_record(b"lost bytes\n")[3:]
+        stream = corrupt + text_record(b"after\n")
+
+        self.assertEqual(self.decode(io.BytesIO(stream)),
+                         "\n<corrupt record>\nafter\n")
+
+
+if __name__ == "__main__":
+    unittest.main()
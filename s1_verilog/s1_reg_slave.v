@@ -0,0 +1,331 @@
+/*
+ * @file  s1_reg_slave.v
+ *
+ * @brief S1 Framed Register Slave
+ *
+ *        Reference FPGA side of the framed register protocol used by
+ *        s1_fpga_reg_batch() in s1.c. Each frame is one chip select, and
+ *        contains any number of register accesses:
+ *
+ *          0x01 (write), address, length, data...
+ *          0x02 (read),  address, length, dummy bytes while data is returned
+ *          0x00 (end),   CRC high, CRC low, then 3 bytes to clock out the
+ *                        status (0xA5 if okay, 0xE1 on a CRC error) and the
+ *                        CRC of everything sent back
+ *
+ *        Both CRCs are CRC-16/CCITT with an initial value of 0xFFFF. Writes
+ *        are staged, and only copied into the registers once the CRC has
+ *        matched. Reads return the staged values, so they see earlier writes
+ *        from the same frame.
+ *
+ *        The SPI signals are oversampled, so clk must be at least 8 times the
+ *        SPI clock. The nRF runs the bus at 4MHz in mode 0, and the chip
+ *        select is active high.
+ *
+ * @attention Copyright 2022 Silicon Witchery AB
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+module s1_reg_slave #(
+    // Number of 8 bit registers. Must be a power of two, and at least 2
+    parameter REGISTERS = 16
+) (
+    input wire clk,
+
+    input wire spi_sck,
+    input wire spi_cs,
+    input wire spi_copi,
+    output wire spi_cipo,
+
+    // All registers, with register 0 in the lowest byte
+    output wire [8 * REGISTERS - 1:0] registers
+);
+
+    localparam ADDRESS_BITS = $clog2(REGISTERS);
+
+    localparam OP_END = 8'h00;
+    localparam OP_WRITE = 8'h01;
+    localparam OP_READ = 8'h02;
+
+    localparam STATUS_OK = 8'hA5;
+    localparam STATUS_CRC_ERROR = 8'hE1;
+
+    // Frame states, in the order they happen. Anything before S_CRC_HI is
+    // covered by the received CRC, and anything before S_TX_CRC_HI by the
+    // transmitted one
+    localparam S_OP = 4'd0;
+    localparam S_ADDRESS = 4'd1;
+    localparam S_LENGTH = 4'd2;
+    localparam S_WRITE = 4'd3;
+    localparam S_READ = 4'd4;
+    localparam S_CRC_HI = 4'd5;
+    localparam S_CRC_LO = 4'd6;
+    localparam S_STATUS = 4'd7;
+    localparam S_TX_CRC_HI = 4'd8;
+    localparam S_TX_CRC_LO = 4'd9;
+    localparam S_DONE = 4'd10;
+
+    // CRC-16/CCITT of one more byte, MSB first
+    function [15:0] crc16;
+        input [15:0] crc;
+        input [7:0] data;
+        integer n;
+        begin
+            crc16 = crc ^ {data, 8'h00};
+
+            for (n = 0; n < 8; n = n + 1)
+            begin
+                crc16 = crc16[15] ? {crc16[14:0], 1'b0} ^ 16'h1021
+                                  : {crc16[14:0], 1'b0};
+            end
+        end
+    endfunction
+
+    // Bring the SPI signals into the clk domain
+    reg [2:0] sck_sync = 3'b000;
+    reg [1:0] cs_sync = 2'b00;
+    reg [1:0] copi_sync = 2'b00;
+
+    always @(posedge clk)
+    begin
+        sck_sync <= {sck_sync[1:0], spi_sck};
+        cs_sync <= {cs_sync[0], spi_cs};
+        copi_sync <= {copi_sync[0], spi_copi};
+    end
+
+    wire sck_rise = sck_sync[2:1] == 2'b01;
+    wire sck_fall = sck_sync[2:1] == 2'b10;
+    wire selected = cs_sync[1];
+
+    // Byte shifting
+    reg [2:0] bit_count = 3'd0;
+    reg [7:0] shift_in = 8'h00;
+    reg [7:0] shift_out = 8'h00;
+    reg [7:0] tx_byte = 8'h00;
+
+    wire [7:0] rx_byte = {shift_in[6:0], copi_sync[1]};
+
+    assign spi_cipo = shift_out[7];
+
+    // Frame decoding
+    reg [3:0] state = S_OP;
+    reg writing = 1'b0;
+    reg [ADDRESS_BITS - 1:0] address = 0;
+    reg [7:0] count = 8'h00;
+    reg [7:0] crc_hi = 8'h00;
+    reg [15:0] rx_crc = 16'hFFFF;
+    reg [15:0] tx_crc = 16'hFFFF;
+
+    wire [15:0] rx_crc_next = crc16(rx_crc, rx_byte);
+    wire [15:0] tx_crc_next = crc16(tx_crc, tx_byte);
+
+    // Registers, and the copy that writes go to until the CRC is checked
+    reg [7:0] regs [0:REGISTERS - 1];
+    reg [7:0] staged [0:REGISTERS - 1];
+
+    integer i;
+
+    initial
+    begin
+        for (i = 0; i < REGISTERS; i = i + 1)
+        begin
+            regs[i] = 8'h00;
+            staged[i] = 8'h00;
+        end
+    end
+
+    genvar g;
+    generate
+        for (g = 0; g < REGISTERS; g = g + 1)
+        begin : register_outputs
+            assign registers[8 * g +: 8] = regs[g];
+        end
+    endgenerate
+
+    always @(posedge clk)
+    begin
+        // Start every frame from a clean state
+        if (!selected)
+        begin
+            state <= S_OP;
+            bit_count <= 3'd0;
+            shift_out <= 8'h00;
+            tx_byte <= 8'h00;
+            rx_crc <= 16'hFFFF;
+            tx_crc <= 16'hFFFF;
+
+            for (i = 0; i < REGISTERS; i = i + 1)
+            begin
+                staged[i] <= regs[i];
+            end
+        end
+
+        else
+        begin
+            // Shift out on the falling edge, except where a new byte was just
+            // loaded, as its first bit is already on the line
+            if (sck_fall && bit_count != 3'd0)
+            begin
+                shift_out <= {shift_out[6:0], 1'b0};
+            end
+
+            // Shift in on the rising edge
+            if (sck_rise)
+            begin
+                shift_in <= rx_byte;
+                bit_count <= bit_count + 3'd1;
+
+                if (bit_count == 3'd7)
+                begin
+                    if (state < S_CRC_HI)
+                    begin
+                        rx_crc <= rx_crc_next;
+                    end
+
+                    if (state < S_TX_CRC_HI)
+                    begin
+                        tx_crc <= tx_crc_next;
+                    end
+
+                    // Send zeros unless there's something to return
+                    tx_byte <= 8'h00;
+                    shift_out <= 8'h00;
+
+                    case (state)
+                        S_OP:
+                        begin
+                            writing <= rx_byte == OP_WRITE;
+
+                            case (rx_byte)
+                                OP_WRITE, OP_READ: state <= S_ADDRESS;
+                                OP_END: state <= S_CRC_HI;
+
+                                // Framing is lost, so let the nRF's CRC check
+                                // catch it
+                                default: state <= S_DONE;
+                            endcase
+                        end
+
+                        S_ADDRESS:
+                        begin
+                            address <= rx_byte[ADDRESS_BITS - 1:0];
+                            state <= S_LENGTH;
+                        end
+
+                        S_LENGTH:
+                        begin
+                            count <= rx_byte;
+
+                            if (rx_byte == 8'h00)
+                            begin
+                                state <= S_OP;
+                            end
+
+                            else if (writing)
+                            begin
+                                state <= S_WRITE;
+                            end
+
+                            else
+                            begin
+                                state <= S_READ;
+                                tx_byte <= staged[address];
+                                shift_out <= staged[address];
+                            end
+                        end
+
+                        S_WRITE:
+                        begin
+                            staged[address] <= rx_byte;
+                            address <= address + 1'b1;
+                            count <= count - 8'd1;
+
+                            if (count == 8'd1)
+                            begin
+                                state <= S_OP;
+                            end
+                        end
+
+                        S_READ:
+                        begin
+                            address <= address + 1'b1;
+                            count <= count - 8'd1;
+
+                            if (count == 8'd1)
+                            begin
+                                state <= S_OP;
+                            end
+
+                            else
+                            begin
+                                tx_byte <= staged[address + 1'b1];
+                                shift_out <= staged[address + 1'b1];
+                            end
+                        end
+
+                        S_CRC_HI:
+                        begin
+                            crc_hi <= rx_byte;
+                            state <= S_CRC_LO;
+                        end
+
+                        // Commit the writes only if the CRC matches
+                        S_CRC_LO:
+                        begin
+                            state <= S_STATUS;
+
+                            if ({crc_hi, rx_byte} == rx_crc)
+                            begin
+                                tx_byte <= STATUS_OK;
+                                shift_out <= STATUS_OK;
+
+                                for (i = 0; i < REGISTERS; i = i + 1)
+                                begin
+                                    regs[i] <= staged[i];
+                                end
+                            end
+
+                            else
+                            begin
+                                tx_byte <= STATUS_CRC_ERROR;
+                                shift_out <= STATUS_CRC_ERROR;
+                            end
+                        end
+
+                        // The status byte is the last one covered by our CRC
+                        S_STATUS:
+                        begin
+                            state <= S_TX_CRC_HI;
+                            tx_byte <= tx_crc_next[15:8];
+                            shift_out <= tx_crc_next[15:8];
+                        end
+
+                        S_TX_CRC_HI:
+                        begin
+                            state <= S_TX_CRC_LO;
+                            tx_byte <= tx_crc[7:0];
+                            shift_out <= tx_crc[7:0];
+                        end
+
+                        default:
+                        begin
+                            state <= S_DONE;
+                        end
+                    endcase
+                end
+            end
+        end
+    end
+
+endmodule
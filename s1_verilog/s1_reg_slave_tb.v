@@ -0,0 +1,208 @@
+/*
+ * @file  s1_reg_slave_tb.v
+ *
+ * @brief S1 Framed Register Slave Test Bench
+ *
+ *        Sends frames to s1_reg_slave the same way s1_fpga_reg_batch() does,
+ *        and checks the read data, status and CRCs which come back. Run it
+ *        with "make sim", and open the .vcd file from the sim directory in
+ *        gtkwave to see the waveforms.
+ *
+ * @attention Copyright 2022 Silicon Witchery AB
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+ * REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+ * INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+ * LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR
+ * OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+ * PERFORMANCE OF THIS SOFTWARE.
+ */
+
+`timescale 1ns / 1ps
+
+module s1_reg_slave_tb;
+
+    // 48MHz system clock, and the 4MHz SPI bus from the nRF
+    reg clk = 1'b0;
+    always #10.417 clk = ~clk;
+
+    reg sck = 1'b0;
+    reg cs = 1'b0;
+    reg copi = 1'b0;
+    wire cipo;
+    wire [8 * 16 - 1:0] registers;
+
+    s1_reg_slave #(
+        .REGISTERS(16)
+    ) dut (
+        .clk(clk),
+        .spi_sck(sck),
+        .spi_cs(cs),
+        .spi_copi(copi),
+        .spi_cipo(cipo),
+        .registers(registers)
+    );
+
+    // Frame buffers, in the same layout as s1_fpga_reg_batch() uses
+    reg [7:0] tx [0:63];
+    reg [7:0] rx [0:63];
+    integer len;
+    integer errors = 0;
+
+    function [15:0] crc16;
+        input [15:0] crc;
+        input [7:0] data;
+        integer n;
+        begin
+            crc16 = crc ^ {data, 8'h00};
+
+            for (n = 0; n < 8; n = n + 1)
+            begin
+                crc16 = crc16[15] ? {crc16[14:0], 1'b0} ^ 16'h1021
+                                  : {crc16[14:0], 1'b0};
+            end
+        end
+    endfunction
+
+    // Clocks out len bytes in mode 0, under one chip select
+    task spi_transfer;
+        integer b;
+        integer k;
+        begin
+            cs = 1'b1;
+            #250;
+
+            for (b = 0; b < len; b = b + 1)
+            begin
+                for (k = 7; k >= 0; k = k - 1)
+                begin
+                    copi = tx[b][k];
+                    #125 sck = 1'b1;
+                    rx[b][k] = cipo;
+                    #125 sck = 1'b0;
+                end
+            end
+
+            #250 cs = 1'b0;
+            #500;
+        end
+    endtask
+
+    // Adds the end opcode and CRC to the accesses in tx, optionally breaking
+    // the CRC, then sends the frame and checks the status and returned CRC
+    task send_frame;
+        input corrupt;
+        input [7:0] expected_status;
+        reg [15:0] crc;
+        integer b;
+        begin
+            tx[len] = 8'h00;
+            len = len + 1;
+
+            crc = 16'hFFFF;
+            for (b = 0; b < len; b = b + 1)
+            begin
+                crc = crc16(crc, tx[b]);
+            end
+
+            tx[len] = crc[15:8] ^ (corrupt ? 8'h01 : 8'h00);
+            tx[len + 1] = crc[7:0];
+            tx[len + 2] = 8'h00;
+            tx[len + 3] = 8'h00;
+            tx[len + 4] = 8'h00;
+            len = len + 5;
+
+            spi_transfer;
+
+            if (rx[len - 3] != expected_status)
+            begin
+                $display("[FAIL] Status was %h, expected %h",
+                         rx[len - 3], expected_status);
+                errors = errors + 1;
+            end
+
+            crc = 16'hFFFF;
+            for (b = 0; b < len - 2; b = b + 1)
+            begin
+                crc = crc16(crc, rx[b]);
+            end
+
+            if ({rx[len - 2], rx[len - 1]} != crc)
+            begin
+                $display("[FAIL] Returned CRC was %h%h, expected %h",
+                         rx[len - 2], rx[len - 1], crc);
+                errors = errors + 1;
+            end
+        end
+    endtask
+
+    initial
+    begin
+        $dumpfile("s1_reg_slave_tb.vcd");
+        $dumpvars(0, s1_reg_slave_tb);
+
+        #1000;
+
+        // Write three registers, and read them back within the same frame
+        tx[0] = 8'h01; tx[1] = 8'h02; tx[2] = 8'h03;
+        tx[3] = 8'h11; tx[4] = 8'h22; tx[5] = 8'h33;
+        tx[6] = 8'h02; tx[7] = 8'h02; tx[8] = 8'h03;
+        tx[9] = 8'h00; tx[10] = 8'h00; tx[11] = 8'h00;
+        len = 12;
+        send_frame(1'b0, 8'hA5);
+
+        if (rx[9] != 8'h11 || rx[10] != 8'h22 || rx[11] != 8'h33)
+        begin
+            $display("[FAIL] Read back %h %h %h within the frame",
+                     rx[9], rx[10], rx[11]);
+            errors = errors + 1;
+        end
+
+        if (registers[8 * 2 +: 24] != 24'h332211)
+        begin
+            $display("[FAIL] Registers 2-4 are %h after the write",
+                     registers[8 * 2 +: 24]);
+            errors = errors + 1;
+        end
+
+        // A broken CRC must not change anything
+        tx[0] = 8'h01; tx[1] = 8'h02; tx[2] = 8'h01; tx[3] = 8'h44;
+        len = 4;
+        send_frame(1'b1, 8'hE1);
+
+        if (registers[8 * 2 +: 8] != 8'h11)
+        begin
+            $display("[FAIL] Register 2 changed to %h despite a CRC error",
+                     registers[8 * 2 +: 8]);
+            errors = errors + 1;
+        end
+
+        // Reads on their own, wrapping around the end of the registers
+        tx[0] = 8'h02; tx[1] = 8'h0F; tx[2] = 8'h04;
+        tx[3] = 8'h00; tx[4] = 8'h00; tx[5] = 8'h00; tx[6] = 8'h00;
+        len = 7;
+        send_frame(1'b0, 8'hA5);
+
+        if (rx[3] != 8'h00 || rx[4] != 8'h00 || rx[5] != 8'h00 ||
+            rx[6] != 8'h11)
+        begin
+            $display("[FAIL] Wrapped read returned %h %h %h %h",
+                     rx[3], rx[4], rx[5], rx[6]);
+            errors = errors + 1;
+        end
+
+        if (errors != 0)
+        begin
+            $fatal(1, "[FAIL] s1_reg_slave with %0d errors", errors);
+        end
+
+        $display("[PASS] s1_reg_slave");
+        $finish;
+    end
+
+endmodule